@@ -11,6 +11,45 @@
 
 // Header inclusions
 #include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+
+// SSE2 is used for batched light-versus-cluster tests when the target has it, AVX for eight-wide frustum culling
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#define USE_AVX 1
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX // Keep windows.h from defining min and max macros
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 
@@ -30,10 +69,46 @@ using namespace std; // Standard namespace
 #ifndef GLSL
 #define GLSL(Version, Source) "#version " #Version "\n" #Source
 #endif
+#define GLSL_CHUNK(Source) #Source // Shader text that follows a GLSL() string in the same stage
+
+#define FRAME_DATA_BINDING 0 // Uniform buffer binding point shared by every program for per-frame data
+#define LIGHT_DATA_BINDING 1 // Uniform buffer binding point for the scene lights
+
+// Clustered lighting: the view frustum is split into a grid of clusters, each with its own light list
+#define MAX_LIGHTS 256 // 256 lights of 64 bytes fill the 16KB uniform block every GL 3.3 driver supports
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_RECORD_UNIT 1 // Texture unit of the per-cluster offset/count buffer
+#define CLUSTER_INDEX_UNIT 2 // Texture unit of the cluster light index buffer
+#define INSTANCE_DATA_UNIT 3 // Texture unit of the per-instance matrices
+#define INSTANCE_TEXELS 7 // RGBA32F texels per instance: four model matrix columns, three normal matrix columns
+#define CULL_CHUNK 4096 // Instances culled per worker job, a multiple of the SIMD width
+
+// Level of detail: simplified meshes for mid distances and a baked billboard impostor for far chairs
+#define LOD_MESHES 3 // The original mesh and two simplified versions
+#define LOD_LEVELS (LOD_MESHES + 1) // The impostor is the last level
+#define LOD_HYSTERESIS 0.75f // A chair only switches to a coarser level once its error drops this far below the threshold
+#define IMPOSTOR_AZIMUTHS 8 // Atlas columns, matching the impostor vertex shader
+#define IMPOSTOR_ELEVATIONS 4 // Atlas rows, matching the impostor vertex shader
+#define IMPOSTOR_TILE 64 // Pixels per atlas tile
+#define IMPOSTOR_ALBEDO_UNIT 4 // Texture unit of the impostor color atlas
+#define IMPOSTOR_NORMAL_UNIT 5 // Texture unit of the impostor normal atlas
+
+// Shadows: the two original lights render distance cube maps that are cached until the light or the scene moves
+#define SHADOW_LIGHTS 2 // Lights 0 and 1 cast shadows, matching ShadowFactor in the lighting shader
+#define SHADOW_MAP_UNIT 6 // Texture unit of light 0's cube map; light 1 uses the next unit
 
 // Variable declarations for shader, window size initialization, buffer, and array objects
 GLint shaderProgram, WindowWidth = 800, WindowHeight = 600;
-GLuint VBO, VAO, texture;
+int chairTexture; // Streamed texture handle of the chair material
+GLsizei chairIndexCount; // Number of indices drawn for the chair
+GLuint instanceVBO, instanceTexture; // Per-instance model and normal matrices, read through a texture buffer
+int showroomCount = 0; // Number of chairs in showroom mode, 0 for the single chair viewer
+GLuint lightUBO; // Uniform buffer holding every scene light
+GLuint clusterRecordBuffer, clusterRecordTexture; // Offset and count of each cluster's light list
+GLuint clusterIndexBuffer, clusterIndexTexture; // Concatenated light lists of all clusters
+GLuint sceneFBO, sceneColor, sceneDepth; // Offscreen target holding the last rendered frame
 GLfloat degrees = glm::radians(0.0f); //converts float to degrees
 
 // Light color
@@ -44,11 +119,16 @@ glm::vec3 lightPosition(1.0f, 0.5f, -3.0f);
 glm::vec3 lightScale(0.3f);
                       //ambient   specular    highlight
 glm::vec3 lightStrength(0.1f,     1.0f,       0.5f);
+glm::vec3 secondLightPosition(6.0f, 0.0f, -3.0f);
+int extraLightCount = 0; // Additional point and spot lights scattered over the scene
+GLfloat nearPlane = 0.1f, farPlane = 100.0f; // Depth range of both projections
 
 GLfloat cameraSpeed = 0.0010f; // Movement speed per frame
 
 GLchar currentKey; //Will store key pressed
 
+// Input and camera state from here on is owned by the simulation thread; the renderer only sees it through snapshots
+
 int mod; // Variable for modifiers
 
 // Scale variables
@@ -67,21 +147,784 @@ bool checkMotion = false;
 bool checkZoom = false;
 bool perspective = false;
 
+// Frame scheduling: frames are only rendered when something changed
+bool frameDirty = true; // Scene state changed since the last rendered frame
+bool redisplayPending = false; // A redisplay or frame timer is already queued
+bool inputPoll = false; // The queued frame only picks up input, so there is nothing to present if the scene is unchanged
+bool continuousRendering = false; // Benchmark mode: render every frame even when nothing changed
+GLfloat frameRateCap = 0.0f; // Maximum frames per second, 0 for uncapped
+int lastFrameTime = 0; // Elapsed time in milliseconds when the last frame was rendered
+
+// Low-latency presentation: a fence after every presented frame bounds how far the CPU may run ahead of the GPU and
+// tells when the input the frame shows has made it through
+#define LATENCY_FENCES 4 // Presented frames tracked until the GPU has finished them
+#define LATENCY_BUCKETS 100 // One millisecond histogram buckets, the last one also collects everything slower
+#define LATENCY_INPUT_WAIT 2.0 // Milliseconds a capped frame waits for the simulation to apply input queued before it
+int framesInFlight = 0; // Frames the CPU may queue ahead of the GPU (1 or 2), 0 leaves it to the driver
+string latencyOutput = "latency.csv"; // Histogram export file, written together with the profile
+struct UPresentedFrame {
+	GLsync fence;
+	bool measured; // The frame shows input that no earlier frame showed
+	chrono::high_resolution_clock::time_point input; // When the oldest of that input arrived
+};
+struct ULatency {
+	UPresentedFrame frames[LATENCY_FENCES]; // Ring of frames the GPU may still be working on
+	int oldest, count;
+	unsigned long long histogram[LATENCY_BUCKETS]; // Input-to-present latency of retired frames
+	unsigned long long samples;
+	unsigned long long dropped; // Measured frames no longer tracked before they finished
+	double last, total; // Milliseconds
+	double waited; // Milliseconds the last frame blocked on earlier ones
+	bool timerPending; // A timer keeps retiring frames while the viewer is idle
+};
+ULatency latency;
+
+// Headless benchmark: replays a camera path offscreen and reports frame timings
+bool benchmarkMode = false;
+string cameraPathFile; // Recorded camera path, empty for the scripted orbit
+int benchmarkFrames = 600; // Length of the scripted orbit
+int benchmarkWidth = 1280, benchmarkHeight = 720; // Offscreen resolution
+string frameDumpPrefix; // When set, every frame is saved as <prefix>NNNN.png
+string benchmarkOutput; // When set, per-frame timings are written to this CSV file
+
+// Frame profiler: named CPU scopes and GPU timestamp queries with rolling statistics
+#define PROFILE_HISTORY 240 // Samples kept per scope for the rolling statistics
+#define GPU_QUERY_FRAMES 4 // Frames of GPU queries in flight before results are read back
+bool profilerEnabled = false; // Collect timings and draw the stats overlay
+bool profileFrameActive = false; // Scopes only record between UProfilerBeginFrame and UProfilerEndFrame
+bool timerQueriesSupported = false;
+int profileFrame = 0; // Frames profiled so far
+string profileOutput = "profile.csv"; // Export file, JSON when it ends in .json
+
 // Global vector declarations
 glm::vec3 cameraPosition = glm::vec3(0.0f, 0.0f, 0.0f); // Initial camera position
 glm::vec3 CameraUpY = glm::vec3(0.0f, 1.0f, 0.0f); // Temporary y unit vector
 glm::vec3 CameraForwardZ = glm::vec3(0.0f, 0.0f, -1.0f); // Temporary z unit vector
 glm::vec3 front; // Temporary z unit vector for mouse
 
+// Uniform locations and block indices of a linked program, resolved once so rendering never looks up names
+struct UProgramInfo {
+	GLuint program;
+	map<string, GLint> uniforms; // Active default-block uniforms by name
+	map<string, GLuint> blocks; // Active uniform blocks by name
+	GLint modelLoc; // Cached per-draw uniforms
+	GLint textureLoc;
+};
+
+// Binary mesh file: header, interleaved vertex data, then 32-bit triangle indices
+#define MESH_FILE_MAGIC "UMSH"
+#define MESH_FILE_VERSION 1
+#define MESH_MAX_ATTRIBUTES 8
+#define MESH_ATTRIBUTE_LOCATIONS 3 // Mesh data feeds locations 0 to 2; 3 is the instance index, 4 the lightmap coordinates
+
+// Describes one vertex attribute inside the interleaved vertex data
+struct UMeshAttribute {
+	GLuint location; // Vertex attribute location in the shaders
+	GLuint components; // 1 to 4
+	GLuint type; // GL component type, e.g. GL_FLOAT
+	GLuint normalized; // Non-zero for normalized integer data
+	GLuint offset; // Byte offset inside a vertex
+};
+
+// Fixed-size header at the start of a mesh file; all fields are 4 bytes so the layout has no padding
+struct UMeshFileHeader {
+	char magic[4]; // MESH_FILE_MAGIC
+	GLuint version;
+	GLuint vertexCount, indexCount;
+	GLuint vertexStride; // Bytes per vertex
+	GLuint attributeCount;
+	UMeshAttribute attributes[MESH_MAX_ATTRIBUTES];
+	GLfloat boundsMin[3], boundsMax[3]; // Axis-aligned bounds of the positions
+	GLuint vertexOffset, indexOffset; // Byte offsets of the vertex and index data from the start of the file
+};
+
+// A file mapped read-only into memory
+struct UMappedFile {
+	void* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+	UMappedFile() : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {}
+#else
+	int descriptor;
+	UMappedFile() : data(NULL), size(0), descriptor(-1) {}
+#endif
+};
+UMappedFile chairMeshFile; // Stays mapped so the mesh data remains readable on the CPU
+string meshFileName = "chair.umesh"; // Mesh drawn for every chair
+
+// Packed vertex layout, 16 bytes instead of 32: the position as three shorts quantized over the mesh bounds plus
+// padding, the normal as GL_INT_2_10_10_10_REV and the texture coordinates as unorm16, or half floats when they leave
+// 0 to 1. Positions stay integers in the attribute and the vertex shaders scale them back with positionScale and
+// positionOffset; float meshes use a scale of one and an offset of zero
+#define VERTEX_FORMAT_FLOAT 0
+#define VERTEX_FORMAT_PACKED 1
+#define PACKED_VERTEX_STRIDE 16
+int vertexFormat = VERTEX_FORMAT_FLOAT; // Layout the chair vertices are uploaded in; float mesh files are packed at load
+glm::vec3 positionScale(1.0f), positionOffset(0.0f); // Object position = offset + scale * stored position
+
+// Buffer arenas: large vertex and index buffers carved into ranges, so all meshes of one vertex format share a vertex
+// buffer and a vertex array and are drawn with base-vertex offsets. Free ranges are kept sorted by offset and merged
+// with their neighbors; an allocation takes the first free range it fits in. When none fits although enough space is
+// free, the arena is compacted into a new buffer, and when too little is free it grows the same way. Compaction keeps
+// the order of the live ranges, so a mesh that was never preceded by a freed one stays where it is
+#define ARENA_INITIAL_BYTES (1 << 20)
+struct UArenaRange {
+	GLintptr offset;
+	GLsizeiptr size;
+};
+struct UBufferArena {
+	GLenum target; // GL_ARRAY_BUFFER or GL_ELEMENT_ARRAY_BUFFER
+	GLuint buffer;
+	GLsizeiptr capacity, used; // Bytes in the buffer, and in live ranges
+	GLsizeiptr alignment; // Every range starts at a multiple of this: the vertex stride, or the index size
+	vector<UArenaRange> freeRanges; // Sorted by offset, never adjacent to each other
+	map<GLintptr, GLsizeiptr> live; // Allocated ranges by offset
+	int rebuilds; // Compactions and growths so far
+};
+
+// One vertex format: its layout, the arena its meshes' vertices live in, and the vertex array they are all drawn with
+struct UVertexFormat {
+	UMeshFileHeader layout; // Only the stride and the attributes are used
+	UBufferArena vertices;
+	GLuint vertexArray;
+};
+
+// A mesh placed in the arenas
+struct UMeshRange {
+	int format; // Index into vertexFormats, -1 once the mesh is removed
+	GLintptr vertexOffset, indexOffset; // Byte offsets in the format's vertex arena and in the index arena
+	GLsizeiptr vertexBytes, indexBytes;
+	GLint baseVertex; // Added to every index: the mesh's first vertex in the format's vertex buffer
+	GLuint firstIndex; // The mesh's first index in the index buffer
+};
+vector<UVertexFormat> vertexFormats;
+UBufferArena indexArena; // Indices of every mesh, 32 bits each
+vector<UMeshRange> meshRanges; // By mesh id
+int chairMesh = -1; // Mesh id of the chair
+
+// Texture streaming: images decode on worker threads and upload through a ring of pixel buffers
+#define STREAM_RING_SIZE 3 // Pixel buffers in flight; a slot is reused once its fence has signaled
+#define STREAM_SLOT_BYTES (4 * 1024 * 1024) // Largest chunk copied through one pixel buffer
+
+// A texture requested from the streaming service; the handle is its index in UTextureStream::textures
+struct UStreamedTexture {
+	string fileName;
+	GLuint texture; // Created when the first rows are uploaded
+	unsigned char* pixels; // Decoded RGBA pixels, freed once every row is in a pixel buffer
+	int width, height;
+	int uploadedRows; // Rows already submitted for upload
+	bool resident; // Every upload has completed, so sampling never waits on the transfer
+};
+
+// An image finished by a decode thread, waiting for the main thread to pick it up
+struct UDecodedImage {
+	int handle;
+	unsigned char* pixels; // NULL when decoding failed
+	int width, height;
+};
+
+// One pixel buffer of the upload ring
+struct UStreamSlot {
+	GLuint buffer;
+	GLsync fence; // Signals when the GPU has finished reading the buffer, 0 while the slot is free
+	int handle; // Texture the chunk belongs to
+	bool lastChunk; // The texture becomes resident when this chunk's fence signals
+};
+
+struct UTextureStream {
+	vector<UStreamedTexture> textures; // Main thread only
+	vector<thread> decoders;
+	mutex lock;
+	condition_variable wake;
+	deque<UDecodedImage> decodeQueue; // Requests for the decoders (pixels still NULL), guarded by lock
+	deque<UDecodedImage> decoded; // Results for the main thread, guarded by lock
+	deque<int> uploadQueue; // Decoded textures waiting for upload, main thread only
+	UStreamSlot slots[STREAM_RING_SIZE];
+	int nextSlot;
+	int pending; // Textures neither resident nor failed
+	bool quit;
+	GLuint placeholder; // Bound in place of textures that are not resident yet
+};
+UTextureStream textureStream;
+int decodeThreadCount = 2; // Image decode threads
+size_t uploadBudget = 2 * 1024 * 1024; // Bytes of texture data uploaded per frame
+
+// Program binary cache: linked programs are saved per source and driver so later launches skip compiling
+#define PROGRAM_CACHE_MAGIC "UPRG"
+#define PROGRAM_CACHE_VERSION 1
+string programCachePrefix = "shadercache_"; // Cache files are <prefix><key>.bin; empty disables the cache
+
+// Header of a program cache file, followed by the driver's program binary
+struct UProgramCacheHeader {
+	char magic[4]; // PROGRAM_CACHE_MAGIC
+	GLuint version;
+	GLuint keyLow, keyHigh; // Source and driver hash, checked against the file name's key
+	GLuint format; // Binary format returned by glGetProgramBinary
+	GLuint length; // Bytes of binary data
+};
+
+// A program being built. Compiles and links are issued without waiting for them, so with parallel shader compilation
+// several programs are compiled at once and only checked when they are finished
+struct UPendingProgram {
+	string label;
+	GLuint program;
+	GLuint vertexShader, fragmentShader; // 0 when the program came from the binary cache
+	unsigned long long key; // Cache key of the sources
+	chrono::high_resolution_clock::time_point start;
+};
+
+// Shader variants: the chair and impostor programs are specialized for the features a draw needs. The features become
+// #defines in front of the sources, and the shaders test them in constant conditions the compiler folds away, so a
+// variant carries no code, uniforms or samplers for features it lacks. Variants are cached by key and built on first
+// use; the ones a run is known to need are compiled in parallel at startup
+#define SHADER_LIGHT 0 // The chair mesh
+#define SHADER_IMPOSTOR 1
+#define SHADER_DEPTH 2 // The chair mesh for the depth pre-pass
+#define VARIANT_INSTANCED 0x01 // Placement read from the instance buffer; otherwise the model matrix alone
+#define VARIANT_TEXTURED 0x02 // Surface color from the chair texture; otherwise the surfaceColor uniform
+#define VARIANT_SPECULAR 0x04 // Phong specular highlights
+#define VARIANT_SHADOWS 0x08 // Shadow cube map lookups
+#define VARIANT_LIGHTMAP 0x10 // Baked light from the lightmap instead of evaluating the lights
+#define VARIANT_CLUSTERED 0x20 // Lights found through the cluster lists; otherwise the first LIGHT_COUNT lights are shaded
+#define VARIANT_FEATURES 6 // Number of feature bits above
+#define DIRECT_LIGHT_LIMIT 4 // Scenes with at most this many lights shade them all and skip the cluster lookup
+struct UShaderVariant {
+	unsigned key; // Shader << 16 | light count << 8 | features
+	string label;
+	string defines; // Version and feature lines compiled in front of the sources
+	UProgramInfo info; // Program 0 if the variant failed to build
+};
+map<unsigned, UShaderVariant> shaderVariants;
+bool variantsConfigured = false; // Textures and buffers exist, so a new variant gets its samplers and constants at once
+bool specularEnabled = true; // Build variants with specular highlights
+
+// CPU-side indexed mesh: interleaved vertices plus triangle list indices
+struct UMesh {
+	vector<GLfloat> vertices; // floatsPerVertex floats per vertex
+	vector<GLuint> indices; // Three indices per triangle
+	int floatsPerVertex;
+};
+
+// Per-instance data streamed through the instance buffer
+struct UInstance {
+	glm::mat4 model; // Placement in the scene
+	glm::mat3 normalMatrix; // Inverse transpose of the placement's upper 3x3, computed once on the CPU
+};
+vector<UInstance> chairInstances; // Every chair in the scene
+
+// Frustum culling state: instance bounds in structure-of-arrays form and the compacted visible list
+struct UCullData {
+	glm::vec3 objectMin, objectMax; // Bounds of the mesh itself
+	vector<GLfloat> centerX, centerY, centerZ; // Center of each instance's bounds, before the scene transform
+	vector<GLfloat> extentX, extentY, extentZ; // Half size of each instance's bounds
+	vector<GLfloat> scale; // Uniform scale of each instance, for level of detail
+	glm::vec4 planes[6]; // Frustum planes of the current frame, in the same space as the bounds
+	glm::vec4 depthRow; // Last row of the clip matrix: gives each instance's distance along the view axis
+	GLfloat pixelScale; // Pixels covered by one object unit at distance 1 (or at any distance in ortho)
+	vector<GLuint> chunkVisible[LOD_LEVELS]; // Visible instances found by each job, per level of detail; job c owns the
+	                                         // CULL_CHUNK entries from c * CULL_CHUNK, so nothing grows while culling
+	vector<GLuint> chunkCount[LOD_LEVELS]; // Entries each job wrote, per level
+	vector<GLfloat> chunkNearest[LOD_LEVELS]; // View depth of the nearest of them, per job and level
+	vector<GLuint> visible; // All visible instances grouped by level of detail, written to visibleStream
+	GLintptr visibleOffset; // Where this frame's copy of visible starts in visibleStream
+	GLuint lodFirst[LOD_LEVELS], lodCount[LOD_LEVELS]; // Range of each level in visible
+	GLfloat lodNearest[LOD_LEVELS]; // View depth of each level's nearest instance, for draw ordering
+};
+UCullData cullData;
+
+// One simplified mesh: a range of the shared index buffer and how far its surface strays from the original
+struct ULodMesh {
+	GLuint firstIndex;
+	GLsizei indexCount;
+	GLfloat error; // Largest distance a vertex moved, in object units
+};
+
+// Level of detail state
+struct ULodData {
+	ULodMesh meshes[LOD_MESHES];
+	GLfloat switchError[LOD_LEVELS]; // Object-space error of each level; the impostor's is derived from impostorSize
+	vector<unsigned char> instanceLevel; // Level each chair was drawn with last, for hysteresis
+	glm::vec4 bounds; // Object-space bounding sphere: center and radius
+	bool impostorReady; // The atlas has been baked; until then the coarsest mesh is the last level
+	GLuint albedoAtlas, normalAtlas; // Impostor views: color with coverage in alpha, object-space normals
+};
+ULodData lodData;
+GLfloat lodThreshold = 1.0f; // Screen-space error in pixels a level may show
+GLfloat impostorSize = 24.0f; // Chairs smaller than this many pixels across become impostors
+bool lodEnabled = true;
+GLuint impostorBakeProgram, impostorVAO;
+UProgramInfo impostorBakeProgramInfo;
+
+// Shadow cube maps of the shadowed lights. Only the static chairs cast shadows, so the maps are rendered once and
+// reused until a light moves or the scene transform (zoom) changes
+struct UShadowMaps {
+	GLuint cubes[SHADOW_LIGHTS]; // Distance to the nearest caster divided by range, compared in the shader
+	GLuint framebuffer;
+	GLfloat range; // Distance stored as depth 1
+	bool valid; // The maps match cachedModel and cachedLights
+	glm::mat4 cachedModel; // Scene transform the maps were rendered with
+	glm::vec3 cachedLights[SHADOW_LIGHTS]; // Light positions the maps were rendered from
+	int renders; // Number of times the maps were rendered
+};
+UShadowMaps shadowMaps;
+GLsizei shadowSize = 512; // Cube face resolution, 0 disables shadows
+int shadowKernel = 3; // PCF kernel width in texels
+GLuint shadowProgram;
+UProgramInfo shadowProgramInfo;
+
+// Baked lighting: diffuse light and ambient occlusion ray traced on the CPU into a lightmap atlas with one tile per
+// chair, read by a shader variant instead of evaluating the lights per pixel. It is baked for one scene transform;
+// while zooming changes the transform the chairs are lit per pixel, and the atlas is baked again once it settles.
+// Bakes run as background jobs on the worker pool, and the texture keeps the previous atlas until a bake is complete.
+// Only the full mesh uses it; the simplified meshes weld vertices across charts, so they and the impostors stay lit
+// per pixel
+#define LIGHTMAP_UNIT 8 // Texture unit of the lightmap atlas
+#define LIGHTMAP_GUTTER 1 // Texels around each chart that only hold copies of its edge, so filtering never reaches a neighbor
+#define LIGHTMAP_IDLE 0 // Bake stages
+#define LIGHTMAP_TRACING_BVH 1 // Moving the chairs into world space and building the hierarchy, one background item
+#define LIGHTMAP_BAKING_CHARTS 2 // One background item per chart of every chair
+#define LIGHTMAP_POLL_INTERVAL 16 // Milliseconds between checks on a running bake while the viewer is idle
+#define LIGHTMAP_FRAME_BUDGET 4.0 // Milliseconds of bake work a frame or check does itself when there are no workers
+#define BVH_LEAF_TRIANGLES 4
+struct UBvhNode {
+	glm::vec3 boundsMin, boundsMax;
+	GLuint first, count; // Leaves: range of triangles. Inner nodes: count 0, children at first and first + 1
+};
+struct UBvh {
+	vector<UBvhNode> nodes;
+	vector<glm::vec3> corners; // Three world-space corners per triangle, in leaf order
+};
+struct ULightmap {
+	GLuint texture;
+	vector<glm::vec3> positions, normals; // Object-space mesh data the texels are interpolated from
+	vector<glm::vec2> coordinates; // Lightmap coordinate of every vertex inside a chair's tile, 0 to 1
+	vector<vector<GLuint> > charts; // First index of every triangle of each chart; a chart is a connected patch
+	int tilesAcross, width, height; // Tiles per atlas row, atlas size in texels
+	vector<glm::vec3> texels; // Baked light of the whole atlas, to be multiplied by the surface color
+	vector<unsigned char> covered; // Texels a triangle covers, as opposed to gutter filled in by dilation
+	UBvh bvh; // Every chair in the scene, in world space
+	bool ready; // The charts fit and the atlas exists
+	bool valid; // The atlas matches cachedModel
+	glm::mat4 cachedModel; // Scene transform the atlas was baked with
+	glm::mat4 settlingModel; // Scene transform of the last frame drawn without the atlas
+	int stage; // LIGHTMAP_IDLE or the stage of the running bake
+	glm::mat4 bakingModel; // Scene transform the running bake is for
+	chrono::high_resolution_clock::time_point bakeStart;
+	bool timerPending; // ULightmapTimer is checking on the bake
+	int bakes; // Number of times the atlas was baked
+	double bakeTime; // Milliseconds the last bake took, from start to upload
+};
+ULightmap lightmap;
+bool lightmapEnabled = false; // Bake a lightmap and draw the full mesh with it
+int lightmapSize = 64; // Texels across one chair's tile
+int lightmapSamples = 16; // Ambient occlusion rays per texel
+
+// Rolling timings of one named scope
+struct UProfileStat {
+	vector<double> samples; // The last PROFILE_HISTORY samples in milliseconds, oldest overwritten first
+	size_t next; // Slot the next sample goes to
+	double last; // Most recent sample
+	UProfileStat() : next(0), last(0.0) {}
+};
+map<string, UProfileStat> cpuProfile, gpuProfile;
+
+// Dynamic resolution: the scene renders into the lower-left part of the scene target at a scale chosen from the
+// measured time of previous scene passes, and is stretched to the window when presented
+#define RESOLUTION_QUERY_FRAMES 4 // Frames of scene pass timestamps in flight before the controller reads them
+struct UDynamicResolution {
+	GLfloat scale; // Current factor per axis
+	GLsizei width, height; // Scene resolution of the current frame
+	GLuint queries[RESOLUTION_QUERY_FRAMES][2]; // Timestamps around each frame's scene pass
+	bool pending[RESOLUTION_QUERY_FRAMES]; // The slot's timestamps have not been read yet
+	int frame; // Frames rendered, selects the query slot
+	double lastTime; // Most recent scene pass time in milliseconds
+	UProfileStat history; // Rolling window of the scale in percent, for the stats overlay
+};
+UDynamicResolution resolution;
+GLfloat frameBudget = 0.0f; // Scene pass time to aim for in milliseconds, 0 always renders at full resolution
+GLfloat minimumScale = 0.5f; // Lowest resolution scale per axis
+
+// Timestamp queries issued during one frame, read back once the GPU has passed them
+struct UGpuQueryFrame {
+	vector<string> names; // Scope of each query pair
+	vector<GLuint> queries; // Begin and end timestamp per scope
+	size_t used; // Pairs issued and not yet read back
+	UGpuQueryFrame() : used(0) {}
+};
+UGpuQueryFrame gpuQueryFrames[GPU_QUERY_FRAMES];
+
+// Times the enclosing CPU block under a name
+struct UProfileScope {
+	UProfileScope(const char* name);
+	~UProfileScope();
+	const char* name;
+	chrono::high_resolution_clock::time_point start;
+};
+
+// Brackets the enclosing render pass with GPU timestamps
+struct UGpuProfileScope {
+	UGpuProfileScope(const char* name);
+	~UGpuProfileScope();
+	GLuint endQuery; // 0 when the scope is not recorded
+};
+
+// One camera state on a benchmark path, the same state the mouse handlers drive
+struct UCameraKey {
+	GLfloat yaw, pitch; // Orbit angles in radians
+	GLfloat scale; // Zoom scale applied to scale_by_x/y/z
+	bool perspective; // Perspective or orthographic projection
+};
+
+// Per-frame camera, cluster state and scene transform, laid out to match the std140 block in frameDataShaderSource
+struct UFrameData {
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec4 viewPosition;
+	glm::vec4 ambient; // Sum of every light's ambient term
+	glm::vec4 viewport; // Render target size in pixels
+	glm::vec4 clusterParams; // Near plane, far plane, slices per unit of (log) depth, 1 for logarithmic slicing
+	GLuint clusterGrid[4]; // Cluster counts along x, y and z
+	glm::mat4 model; // Scene transform
+	glm::vec4 normalMatrix[3]; // Its normal matrix; std140 pads each mat3 column to a vec4
+};
+
+// One point or spot light, laid out to match the std140 Light struct in the fragment shader
+struct ULight {
+	glm::vec4 positionRange; // World position, range beyond which the light has no effect
+	glm::vec4 colorSpecular; // Color, specular strength
+	glm::vec4 directionCosine; // Spot direction, cosine of the outer cone angle (-1 for point lights)
+	glm::vec4 params; // Ambient strength, shininess, cosine of the inner cone angle
+};
+vector<ULight> sceneLights;
+
+// View-space bounds of every cluster and the light lists built for them each frame
+struct ULightClusters {
+	vector<glm::vec3> boundsMin, boundsMax; // Indexed (z * CLUSTER_Y + y) * CLUSTER_X + x
+	glm::mat4 projection; // Projection the bounds were computed for
+	vector<GLfloat> lightX, lightY, lightZ, lightRadius2; // View-space light spheres, structure of arrays
+	vector<vector<GLushort> > sliceIndices; // Light lists of each depth slice, concatenated per cluster
+	vector<GLuint> sliceCounts; // Light count of each cluster
+	vector<GLuint> records; // Offset and count per cluster, as uploaded
+	vector<GLushort> indices; // All light lists, as uploaded
+};
+ULightClusters lightClusters;
+
+// Persistent worker threads for data-parallel jobs
+struct UWorkerPool {
+	vector<thread> threads;
+	mutex lock;
+	condition_variable wake, finished;
+	const function<void(int)>* job; // Job of the current UParallelFor, called once per item
+	int itemCount;
+	atomic<int> nextItem; // Next item to hand out
+	int busyWorkers; // Workers that joined the current job and are still inside it
+	unsigned generation; // Bumped for every job so workers can tell a new one arrived
+	bool quit;
+	function<void(int)> backgroundJob; // Long-running job the workers take items of whenever no UParallelFor needs them
+	int backgroundCount;
+	int nextBackground; // Next background item to hand out, under lock
+	atomic<int> backgroundDone; // Background items finished
+};
+UWorkerPool workerPool;
+
+// Input recorded by the GLUT callbacks and applied on the simulation thread
+#define INPUT_CLICK 0
+#define INPUT_DRAG 1 // Motion with a button held
+#define INPUT_MOVE 2 // Passive motion
+struct UInputEvent {
+	int type;
+	int button, state, modifiers; // Clicks only; modifiers are read in the callback, the only place GLUT reports them
+	int x, y; // Only drags use the position
+	chrono::high_resolution_clock::time_point time; // When the callback saw it, for the latency measurement
+};
+
+// Everything the renderer needs from the simulation for one frame, never modified once published
+struct USceneSnapshot {
+	glm::mat4 model;
+	glm::mat4 view;
+	bool perspective;
+	unsigned revision; // Bumped whenever the scene changed
+	unsigned inputSequence; // Input events applied so far
+	unsigned inputRevision; // Revision of the oldest scene change the renderer had not taken when this was published
+	chrono::high_resolution_clock::time_point inputTime; // When the input behind that change arrived
+};
+
+// Lock-free triple buffer: the simulation fills the back slot and swaps it with the middle one, the renderer swaps
+// the middle slot with its front slot when a newer snapshot is there. Neither side ever waits for the other
+#define SNAPSHOT_FRESH 4 // Set in middle while the slot holds a snapshot the renderer has not taken yet
+struct USnapshotBuffer {
+	USceneSnapshot slots[3];
+	atomic<unsigned> middle; // Slot index, plus SNAPSHOT_FRESH
+	unsigned back; // Written by the simulation only
+	unsigned front; // Read by the renderer only
+};
+
+// Simulation thread: applies queued input to the camera and publishes snapshots
+struct USimulation {
+	thread worker;
+	mutex lock;
+	condition_variable wake;
+	deque<UInputEvent> events; // Input not yet applied
+	bool quit;
+	unsigned submitted; // Input events queued so far, GLUT thread only
+	unsigned applied; // Input events applied so far, simulation only
+	unsigned revision; // Scene revision, simulation only
+	bool changed; // The events being applied changed the scene
+	unsigned inputRevision; // Oldest scene change not yet taken by the renderer, simulation only
+	chrono::high_resolution_clock::time_point inputTime;
+	atomic<unsigned> acquiredRevision; // Revision of the renderer's newest snapshot
+	unsigned renderedRevision; // Revision of the last rendered frame, renderer only
+	USnapshotBuffer snapshots;
+};
+USimulation simulation;
+
+// Buffer rewritten every frame, split into one region per frame in flight. With GL_ARB_buffer_storage it stays
+// persistently mapped and each region is fenced, so the CPU fills one region while the GPU still reads the others;
+// without it every write orphans the buffer and uploads a CPU-side copy
+#define DYNAMIC_REGIONS 3
+struct UDynamicBuffer {
+	GLuint buffer;
+	GLenum target;
+	GLsizeiptr regionSize; // Bytes per region, rounded up to the offset alignment of the target
+	int region; // Region of the current write
+	unsigned char* mapped; // Persistent, coherent mapping of all regions, NULL when orphaning
+	GLsync fences[DYNAMIC_REGIONS]; // Signalled once the GPU has read each region
+	vector<unsigned char> staging; // Orphaning fallback: filled by the CPU, uploaded when the write ends
+};
+UDynamicBuffer visibleStream; // Indices of the instances that passed frustum culling, one per drawn instance
+UDynamicBuffer frameStream; // Per-frame camera and cluster state for the FrameData uniform block
+bool persistentMapping = true; // Use persistently mapped buffers when the driver has GL_ARB_buffer_storage
+
+// Render queue: draws are recorded as packets and submitted in the order of a 64-bit key, most significant field
+// first: pass (4 bits), program (8), texture (12), vertex array (8), front-to-back depth (24), recording order (8).
+// Draws sharing state end up next to each other, and the submission skips binds of state that is already current.
+// The pass sets the depth and color write state its draws are submitted with
+#define QUEUE_PASS_DEPTH 0 // Depth only, laying down the depth the equal pass is shaded against
+#define QUEUE_PASS_EQUAL 1 // Shaded where the depth matches the depth pass, without writing depth
+#define QUEUE_PASS_OPAQUE 2 // Depth tested and written as usual
+#define QUEUE_STATES 3 // Program, vertex array and texture, the state the queue tracks
+struct UDrawPacket {
+	unsigned long long key;
+	GLuint program;
+	GLuint vertexArray;
+	GLuint texture; // Bound to unit 0, 0 when the program samples nothing there
+	GLenum mode;
+	GLsizei count; // Indices, or vertices for non-indexed draws
+	GLintptr first; // Byte offset into the element buffer, or the first vertex
+	GLint baseVertex; // Added to the indices of an indexed draw
+	bool indexed;
+	GLsizei instances;
+	GLintptr instanceOffset; // Byte offset of the packet's visible instance indices in visibleStream
+};
+// Indirect submission: the sorted packets become draw commands in a per-frame buffer, and each run of packets sharing
+// pass and state is issued as one multi-draw. A packet's visible instance indices are found through its base instance,
+// which the instance index attribute (divisor 1) adds to every fetch. Without multi-draw indirect, or with more
+// commands than the buffer holds, the same commands are issued one at a time from their CPU copy
+#define INDIRECT_COMMANDS 1024 // Commands per frame the indirect buffer holds
+struct UDrawCommand {
+	GLuint count; // Indices, or vertices for non-indexed draws
+	GLuint instanceCount;
+	GLuint first; // First index, or first vertex
+	GLint baseVertex; // For non-indexed draws this is the base instance, as in DrawArraysIndirectCommand
+	GLuint baseInstance; // Unused by non-indexed draws
+};
+
+struct URenderQueue {
+	vector<UDrawPacket> packets, scratch; // Packets of the current frame, and the radix sort's second buffer
+	vector<UDrawCommand> commands; // One per sorted packet, the indirect buffer's contents
+	unsigned drawCalls; // Draw calls the last submission issued
+	bool indirect; // The last submission used multi-draw indirect
+	unsigned long long totalDrawCalls;
+	vector<GLuint> names[QUEUE_STATES]; // GL names seen so far; the position of a name is its id in the key
+	unsigned binds[QUEUE_STATES], skipped[QUEUE_STATES]; // Binds issued and redundant binds avoided by the last submission
+	unsigned long long totalBinds[QUEUE_STATES], totalSkipped[QUEUE_STATES]; // The same over all submissions
+	unsigned long long totalPackets;
+	int submissions;
+};
+URenderQueue renderQueue;
+UDynamicBuffer indirectStream; // The render queue's draw commands, rewritten every frame
+bool indirectDraws = true; // Submit the render queue with multi-draw indirect where supported
+
+// Depth pre-pass: the mesh chairs are drawn depth only first, then shaded in the equal pass so each pixel is shaded
+// once however many chairs overlap it. That only pays for the second geometry pass when chairs overlap, so in auto
+// mode occlusion queries measure the overdraw of the mesh draws and the pre-pass runs while it exceeds a threshold.
+// A frame with the pre-pass measures both counts: samples passing the depth pass are what a single pass would shade,
+// samples passing the equal pass are the visible ones
+#define PREPASS_OFF 0
+#define PREPASS_ON 1
+#define PREPASS_AUTO 2
+#define PREPASS_QUERY_FRAMES 4 // Frames of sample counts in flight before they are read
+#define PREPASS_PROBE_INTERVAL 30 // Frames between measurements while auto mode has the pre-pass off
+struct UDepthPrepass {
+	GLuint queries[PREPASS_QUERY_FRAMES][2]; // Samples passed by the depth pass and by the equal pass
+	bool pending[PREPASS_QUERY_FRAMES]; // The slot's counts have not been read yet
+	int frame; // Frames rendered, selects the query slot
+	bool active; // The current frame uses the pre-pass
+	bool enabled; // Auto mode's choice from the last measured overdraw
+	int sinceProbe; // Frames since the last frame with the pre-pass
+	double overdraw; // Last measured samples shaded per visible sample, without the pre-pass
+	double overdrawSum; // For the benchmark's average
+	int measurements;
+	int frames; // Frames that used the pre-pass
+};
+UDepthPrepass depthPrepass;
+int prepassMode = PREPASS_AUTO;
+GLfloat overdrawThreshold = 1.5f; // Auto mode runs the pre-pass above this overdraw
+
 // Function prototypes
 void UResizeWindow(int, int);
 void URenderGraphics(void);
-void UCreateShader(void);
-void UCreateBuffers(void);
+bool UCreateShader(void);
+GLuint UBuildProgram(const char* label, const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources);
+UPendingProgram UBeginProgram(const char* label, const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources);
+GLuint UFinishProgram(UPendingProgram& pending);
+GLuint UCompileShader(GLenum type, const vector<const char*>& sources);
+bool UCheckShader(const char* label, GLenum type, GLuint shader);
+bool UCheckProgram(const char* label, GLuint program);
+bool UCreateVariants(void);
+unsigned UDrawFeatures(void);
+unsigned UVariantKey(int shader, unsigned features);
+UShaderVariant& UShaderFor(int shader, unsigned features);
+GLuint UVariantProgram(int shader, unsigned features);
+bool UPrecompileVariants(const vector<unsigned>& keys);
+UPendingProgram UBeginVariant(UShaderVariant& variant, unsigned key);
+bool UFinishVariant(UShaderVariant& variant, UPendingProgram& pending);
+void UConfigureVariant(UShaderVariant& variant);
+unsigned long long UProgramKey(const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources);
+void UBindFrameBlocks(const UProgramInfo& info);
+bool UProgramBinarySupported(void);
+bool UCreateBuffers(void);
 void UMouseClick(int button, int state, int x, int y);
 void UMouseMove(int x, int y);
 void UOnMotion(int x, int y);
+void USimulateClick(int button, int state, int modifiers);
+void USimulateMove(void);
+void USimulateMotion(int x, int y);
+void UQueueInput(const UInputEvent& event);
+void UStartSimulation(void);
+void UStopSimulation(void);
+void USimulationLoop(void);
+void UPublishSnapshot(void);
+bool UAcquireSnapshot(void);
+const USceneSnapshot& UCurrentSnapshot(void);
 void UGenerateTexture(void);
+int UStreamTexture(const string& fileName);
+void UDecodeLoop(void);
+bool UPumpTextureStreaming(size_t budget);
+void UFinishTextureStreaming(void);
+void UStopTextureStreaming(void);
+void UDeleteStreamedTextures(void);
+GLuint UResidentTexture(int handle);
+void UReflectProgram(GLuint program, UProgramInfo& info);
+GLint UUniformLocation(const UProgramInfo& info, const char* name);
+void UCreateUniformBuffers(void);
+void UCreateDynamicBuffer(UDynamicBuffer& dynamic, GLenum target, GLsizeiptr size, GLsizeiptr alignment);
+unsigned char* UBeginDynamicWrite(UDynamicBuffer& dynamic);
+GLintptr UEndDynamicWrite(UDynamicBuffer& dynamic, GLsizeiptr bytes);
+void UFenceDynamicBuffer(UDynamicBuffer& dynamic);
+void UDeleteDynamicBuffer(UDynamicBuffer& dynamic);
+void UParseArguments(int argc, char* argv[]);
+void UCreateSceneTarget(int width, int height);
+void UPresentSceneTarget(void);
+void UFencePresentedFrame(bool measured, chrono::high_resolution_clock::time_point input);
+void URetireFrames(int keep);
+void ULatencyTimer(int);
+void UWaitForInput(void);
+double ULatencyPercentile(double fraction);
+void UExportLatency(const string& fileName);
+void UCreateDynamicResolution(void);
+void UUpdateResolution(void);
+bool UTakeQueryResults(const GLuint queries[2], bool& pending, GLuint64 results[2]);
+void UMarkDirty(void);
+void UScheduleFrame(void);
+void UFrameTimer(int);
+void UUpdateCameraFront(void);
+void UBuildIndexedMesh(const GLfloat* vertices, int vertexCount, int floatsPerVertex, UMesh& mesh);
+void UOptimizeVertexCache(UMesh& mesh);
+void UOptimizeVertexFetch(UMesh& mesh);
+bool UMapMeshFile(const string& fileName, UMappedFile& file);
+bool UMapFile(const string& fileName, UMappedFile& file);
+void UUnmapFile(UMappedFile& file);
+bool UImportObj(const string& objFileName, const string& outputFileName);
+void UCreateInstances(void);
+glm::mat3 UNormalMatrix(const glm::mat4& model);
+void UCullInstances(const glm::mat4& clip, GLfloat pixelScale);
+void UCullChunk(int chunk);
+int USelectLevel(size_t instance, GLfloat& depth);
+glm::vec3 UReadAttribute(const UMeshFileHeader* header, GLuint location, GLuint vertex);
+void UPositionQuantization(const UMeshFileHeader* header, glm::vec3& scale, glm::vec3& offset);
+void UPackVertices(const UMeshFileHeader* header, UMeshFileHeader& packed, vector<unsigned char>& vertices);
+void USetPositionUniforms(const UProgramInfo& info);
+int UAddMesh(const UMeshFileHeader* layout, const void* vertices, GLuint vertexCount, const GLuint* indices, GLuint indexCount,
+	const GLuint* lodIndices, GLuint lodIndexCount);
+void URemoveMesh(int mesh);
+int UFindVertexFormat(const UMeshFileHeader* layout);
+int UAddVertexFormat(const UMeshFileHeader* layout);
+void UAddLightmapCoordinates(int mesh, const glm::vec2* coordinates);
+void UBindVertexFormat(UVertexFormat& format);
+void UCreateArena(UBufferArena& arena, GLenum target, GLsizeiptr alignment);
+GLintptr UArenaAllocate(UBufferArena& arena, GLsizeiptr size);
+void UArenaFree(UBufferArena& arena, GLintptr offset);
+void URebuildArena(UBufferArena& arena, GLsizeiptr capacity);
+void URelocateMeshes(const UBufferArena& arena, const map<GLintptr, GLintptr>& moved);
+void UDeleteArenas(void);
+GLushort UFloatToHalf(GLfloat value);
+GLfloat UHalfToFloat(GLushort value);
+void UBuildLods(const UMeshFileHeader* header, vector<GLuint>& lodIndices);
+void USimplifyMesh(const vector<glm::vec3>& positions, const vector<glm::vec3>& normals, const GLuint* indices, size_t indexCount,
+	GLfloat cellSize, vector<GLuint>& simplified, GLfloat& error);
+void UBakeImpostors(void);
+void UQueueImpostors(void);
+void UQueueDraw(UDrawPacket& packet, int pass, GLfloat depth);
+unsigned USortId(int state, GLuint name, unsigned limit);
+void URadixSort(vector<UDrawPacket>& packets, vector<UDrawPacket>& scratch);
+void USubmitRenderQueue(void);
+bool USameBucket(const UDrawPacket& first, const UDrawPacket& packet);
+void USwitchQueuePass(int from, int to);
+void UCreateDepthPrepass(void);
+void UUpdateDepthPrepass(void);
+void UCreateShadowMaps(void);
+void UUpdateShadowMaps(const glm::mat4& model);
+void USetShadowUniforms(const UProgramInfo& info);
+void UCreateLightmap(void);
+void UUpdateLightmap(const glm::mat4& model);
+void UBakeChart(int job);
+void UBuildLightmapBvh(int job);
+void UPollLightmapBake(void);
+void ULightmapTimer(int);
+glm::vec3 UBakeTexel(const glm::vec3& position, const glm::vec3& normal, GLfloat occlusionDistance, GLfloat bias, unsigned seed);
+void UBuildBvh(UBvh& bvh);
+bool UOccluded(const UBvh& bvh, const glm::vec3& origin, const glm::vec3& direction, GLfloat distance);
+void URenderScene(void);
+void URunBenchmark(void);
+bool ULoadCameraPath(const string& fileName, vector<UCameraKey>& path);
+void UScriptedCameraPath(int frames, vector<UCameraKey>& path);
+void UApplyCameraKey(const UCameraKey& key);
+void UReportTimings(const char* label, vector<double> times);
+void UProfilerBeginFrame(void);
+void UProfilerEndFrame(void);
+void UCollectGpuQueries(void);
+void URecordSample(UProfileStat& stat, double milliseconds);
+void UProfileSummary(const UProfileStat& stat, double& minimum, double& average, double& p99);
+void UDrawProfileOverlay(void);
+void UExportProfile(const string& fileName);
+void UKeyboard(unsigned char key, int x, int y);
+void UCreateLights(void);
+void UBuildLightClusters(const glm::mat4& view, const glm::mat4& projection);
+void UComputeClusterBounds(const glm::mat4& projection);
+GLfloat USliceDepth(int slice, bool logarithmic);
+void UClusterSlice(int slice);
+void UStartWorkers(void);
+void UStopWorkers(void);
+void UWorkerLoop(void);
+void UParallelFor(int count, const function<void(int)>& job);
+void UStartBackground(int count, const function<void(int)>& job);
+bool URunBackground(double milliseconds);
+bool UBackgroundDone(void);
+void UFinishBackground(void);
+void UCloseWindow(void);
+void UDeleteGraphics(void);
 
 // Vertex shader source code
 const GLchar * vertexShaderSource = GLSL(330,
@@ -116,79 +959,331 @@ const GLchar * fragmentShaderSource = GLSL(330,
 	}
 );
 
-const GLchar * lightVertexShaderSource = GLSL(330,
+// Per-frame camera, cluster state and scene transform shared through a uniform buffer. The variant builder compiles it
+// into every stage right after the defines, so all variants declare the block the same way
+const GLchar * frameDataShaderSource = GLSL_CHUNK(
+	layout (std140) uniform FrameData {
+		mat4 view;
+		mat4 projection;
+		vec4 viewPosition;
+		vec4 ambient;
+		vec4 viewport;
+		vec4 clusterParams;
+		uvec4 clusterGrid;
+		mat4 model;
+		mat3 normalMatrix;
+	};
+);
+
+// Chair shaders; the variant defines (INSTANCED, TEXTURED, LIGHTMAP, ...), the version and the FrameData block are
+// compiled in front of them
+const GLchar * lightVertexShaderSource = GLSL_CHUNK(
 	layout (location = 0) in vec3 position; //VAP position 0 for vertex position data
 	layout (location = 1) in vec3 normal; //VAP position 1 for normals
 	layout (location = 2) in vec2 textureCoordinate;
+	layout (location = 3) in uint instanceIndex; //VAP position 3 for the index of a visible instance
+	layout (location = 4) in vec2 lightmapCoordinate; //Position inside a chair's lightmap tile, 0 to 1
 
 	out vec3 Normal; //for outgoing normals to fragment shader
 	out vec3 FragmentPos; // for outgoing color / pixels to fragment shader
 	out vec2 mobileTextureCoordinate; // uv coords for texture
+	out float ViewDepth; // distance in front of the camera, used to find the light cluster
+	out vec2 atlasCoordinate; // lightmap atlas position
+	invariant gl_Position; //The depth pre-pass variant must produce exactly the same depth as the lit variants
 
-	//uniform / global variables for the transform matrices
-	uniform mat4 model;
-	uniform mat4 view;
-	uniform mat4 projection;
+	uniform samplerBuffer instanceData; //Per-instance placement and normal matrices, seven texels each
+	uniform vec4 lightmapLayout; //Tiles per atlas row, tile size relative to the atlas width and height
+	uniform vec3 positionScale; //Turns the stored position into object space
+	uniform vec3 positionOffset;
 
     void main(){
-        gl_Position = projection * view * model * vec4(position, 1.0f);//Transforms vertices into clip coordinates
-        Normal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-        FragmentPos = vec3(model * vec4(position, 1.0f)); //Gets fragment / pixel position in world space only (exclude view and projection)
+        vec3 objectPosition = positionOffset + positionScale * position;
+        mat4 world = model;
+        mat3 worldNormalMatrix = normalMatrix;
+        if (INSTANCED != 0) {
+            int texel = int(instanceIndex) * 7;
+            mat4 instanceModel = mat4(texelFetch(instanceData, texel), texelFetch(instanceData, texel + 1), texelFetch(instanceData, texel + 2), texelFetch(instanceData, texel + 3));
+            mat3 instanceNormalMatrix = mat3(texelFetch(instanceData, texel + 4).xyz, texelFetch(instanceData, texel + 5).xyz, texelFetch(instanceData, texel + 6).xyz);
+            world = model * instanceModel; //Places the instance, then applies the scene transform
+            worldNormalMatrix = normalMatrix * instanceNormalMatrix;
+        }
+        gl_Position = projection * view * world * vec4(objectPosition, 1.0f);//Transforms vertices into clip coordinates
+        Normal = worldNormalMatrix * normal; // get normal vectors in world space only and exclude normal translation properties
+        FragmentPos = vec3(world * vec4(objectPosition, 1.0f)); //Gets fragment / pixel position in world space only (exclude view and projection)
+        ViewDepth = -(view * vec4(FragmentPos, 1.0f)).z;
 		mobileTextureCoordinate = vec2(textureCoordinate.x, 1.0f - textureCoordinate.y); //flips the texture horizontal
+
+		//Each chair has its own tile in the lightmap atlas
+		uint tilesAcross = uint(max(lightmapLayout.x, 1.0f));
+		uint instance = INSTANCED != 0 ? instanceIndex : 0u;
+		atlasCoordinate = LIGHTMAP != 0 ? (vec2(float(instance % tilesAcross), float(instance / tilesAcross)) + lightmapCoordinate) * lightmapLayout.yz : vec2(0.0f);
+	}
+);
+
+// Clustered lighting shared by every lit fragment shader; compiled after the variant defines and the FrameData block,
+// in front of the shader's own GLSL_CHUNK
+const GLchar * lightingShaderSource = GLSL_CHUNK(
+	//Point and spot lights; the array size matches MAX_LIGHTS
+	struct Light {
+		vec4 positionRange;
+		vec4 colorSpecular;
+		vec4 directionCosine;
+		vec4 params;
+	};
+	layout (std140) uniform LightData {
+		Light lights[256];
+	};
+
+	uniform usamplerBuffer clusterRecords; //Offset and count of each cluster's light list
+	uniform usamplerBuffer clusterIndices; //Light indices of all clusters
+
+	uniform samplerCubeShadow shadowMap0; //Distance to the nearest caster around lights 0 and 1, divided by the range
+	uniform samplerCubeShadow shadowMap1;
+	uniform vec4 shadowParams; //1 / range, texel size at unit distance, PCF radius in texels, number of shadowed lights
+
+	float SampleShadow(uint index, vec4 coordinate) {
+		return index == 0u ? texture(shadowMap0, coordinate) : texture(shadowMap1, coordinate);
+	}
+
+	//Fraction of a light's cube map footprint around the fragment that is not in shadow, averaged over the PCF kernel
+	float ShadowFactor(uint index, vec3 lightPosition, vec3 FragmentPos, vec3 norm, float receiverOffset) {
+		if (index >= uint(shadowParams.w)) {
+			return 1.0f;
+		}
+
+		vec3 fromLight = FragmentPos - lightPosition;
+		float texel = length(fromLight) * shadowParams.y; //World size of one shadow map texel at this distance
+		fromLight += norm * (texel * 1.5f + receiverOffset); //Normal offset keeps surfaces from shadowing themselves
+		float reference = (length(fromLight) - texel) * shadowParams.x;
+
+		//Kernel taps are spread one texel apart in the plane facing the light
+		vec3 axis = abs(fromLight.y) < 0.9f * length(fromLight) ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+		vec3 side = normalize(cross(fromLight, axis)) * texel;
+		vec3 up = normalize(cross(side, fromLight)) * texel;
+		int radius = int(shadowParams.z);
+		float lit = 0.0f;
+		for (int y = -radius; y <= radius; y++) {
+			for (int x = -radius; x <= radius; x++) {
+				lit += SampleShadow(index, vec4(fromLight + side * float(x) + up * float(y), reference));
+			}
+		}
+		return lit / float((2 * radius + 1) * (2 * radius + 1));
+	}
+
+	//Finds the cluster holding this fragment from its screen position and view depth
+	int ClusterIndex(float viewDepth) {
+		float depth = max(viewDepth, clusterParams.x);
+		float slice = clusterParams.w > 0.5f ? log(depth / clusterParams.x) * clusterParams.z : (depth - clusterParams.x) * clusterParams.z;
+		ivec3 grid = ivec3(clusterGrid.xyz);
+		ivec3 cluster = clamp(ivec3(ivec2(gl_FragCoord.xy / viewport.xy * vec2(grid.xy)), int(slice)), ivec3(0), grid - 1);
+		return (cluster.z * grid.y + cluster.y) * grid.x + cluster.x;
+	}
+
+	//Light reaching a surface point with unit normal norm, to be multiplied by its albedo. Shadow lookups start
+	//receiverOffset further along the normal, for surfaces that are only approximated by the rasterized one
+	vec3 ShadeFragment(vec3 FragmentPos, vec3 norm, float viewDepth, float receiverOffset) {
+    	vec3 viewDir = normalize(viewPosition.xyz - FragmentPos); //Calculate view direction
+    	vec3 lighting = ambient.rgb; //Ambient light of every light, in range or not
+
+    	//Phong diffuse and specular for the lights listed in this fragment's cluster only, or for all of a few lights
+    	uvec2 record = CLUSTERED != 0 ? texelFetch(clusterRecords, ClusterIndex(viewDepth)).xy : uvec2(0u, uint(LIGHT_COUNT));
+    	for (uint i = 0u; i < record.y; i++) {
+    		uint index = CLUSTERED != 0 ? texelFetch(clusterIndices, int(record.x + i)).x : i;
+    		Light light = lights[index];
+
+    		vec3 toLight = light.positionRange.xyz - FragmentPos;
+    		float distance = length(toLight);
+    		vec3 lightDirection = toLight / distance; //Calculate light direction between light source and fragments/pixels
+    		float falloff = clamp(1.0f - pow(distance / light.positionRange.w, 4.0f), 0.0f, 1.0f); //Smoothly reach zero at the light's range
+    		float cone = light.directionCosine.w > -1.0f ? smoothstep(light.directionCosine.w, light.params.z, dot(-lightDirection, light.directionCosine.xyz)) : 1.0f;
+
+    		float impact = max(dot(norm, lightDirection), 0.0); //Calculate diffuse impact by generating dot product of normal and light
+    		vec3 reflectDir = reflect(-lightDirection, norm); //Calculate reflection vector
+    		float specularComponent = SPECULAR != 0 ? pow(max(dot(viewDir, reflectDir), 0.0), light.params.y) : 0.0f;
+
+    		float shadow = SHADOWS != 0 && impact > 0.0f ? ShadowFactor(index, light.positionRange.xyz, FragmentPos, norm, receiverOffset) : 1.0f;
+
+    		lighting += falloff * falloff * cone * shadow * (impact + light.colorSpecular.a * specularComponent) * light.colorSpecular.rgb;
+    	}
+    	return lighting;
 	}
 );
 
-const GLchar * lightFragmentShaderSource = GLSL(330,
+const GLchar * lightFragmentShaderSource = GLSL_CHUNK(
 	in vec3 Normal; //For incoming normals
 	in vec3 FragmentPos; //for incoming fragment position
 	in vec2 mobileTextureCoordinate;
+	in float ViewDepth;
+	in vec2 atlasCoordinate;
 
 	out vec4 result; //for outgoing light color to the GPU
 
-	//Uniform / Global variables for object color, light color, light position and camera/view position
-	uniform vec3 lightColor;
-	uniform vec3 secondLightColor;
-	uniform vec3 lightPos;
-	uniform vec3 viewPosition;
-    uniform vec3 lightStrength;
 	uniform sampler2D uTexture; //Useful when working with multiple textures
+	uniform vec3 surfaceColor; //Stands in for the texture in untextured variants
+	uniform sampler2D lightmap; //Diffuse light and occluded ambient light, without the surface color
 
     void main(){
     	vec3 norm = normalize(Normal); //Normalize vectors to 1 unit
-    	vec3 ambient = lightStrength.x * lightColor; //Generate ambient light color
-    	vec3 ambientTwo = lightStrength.x * secondLightColor;//Generate second ambient light color
-    	vec3 lightDirection = normalize(lightPos - FragmentPos); //Calculate distance (light direction) between light source and fragments/pixels on
-    	float impact = max(dot(norm, lightDirection), 0.0); //Calculate diffuse impact by generating dot product of normal and light
-    	vec3 diffuse = impact * lightColor; //Generate diffuse light color
-    	vec3 viewDir = normalize(viewPosition - FragmentPos); //Calculate view direction
-    	vec3 reflectDir = reflect(-lightDirection, norm); //Calculate reflection vector
-    	float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), lightStrength.z);
-    	vec3 specular = lightStrength.y * specularComponent * lightColor;
-
-    	//Calculate Phong result
-    	vec3 phongOne = (ambient + diffuse + specular) * vec3(texture(uTexture, mobileTextureCoordinate));
-
-    	// Second light position
-    	lightDirection = normalize(vec3(6.0f, 0.0f, -3.0f)- FragmentPos);
-    	impact = max(dot(norm, lightDirection), 0.0); //Calculate diffuse impact by generating dot product of normal and light
-    	diffuse = impact * secondLightColor; //Generate diffuse light color
-    	viewDir = normalize(viewPosition - FragmentPos); //Calculate view direction
-    	reflectDir = reflect(-lightDirection, norm); //Calculate reflection vector
-    	specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), lightStrength.z);
-
-    	// Second light
-    	vec3 specularTwo = 0.1f * specularComponent * secondLightColor;
-
-    	vec3 phongTwo = (ambientTwo + diffuse + specularTwo) * vec3(texture(uTexture, mobileTextureCoordinate));
-
-    	result = vec4(phongOne + phongTwo, 1.0f); //Send lighting results to GPU
+    	vec3 albedo = TEXTURED != 0 ? vec3(texture(uTexture, mobileTextureCoordinate)) : surfaceColor;
+    	vec3 lighting = LIGHTMAP != 0 ? texture(lightmap, atlasCoordinate).rgb : ShadeFragment(FragmentPos, norm, ViewDepth, 0.0f);
+    	result = vec4(lighting * albedo, 1.0f); //Send lighting results to GPU
+	}
+);
+
+// Depth pre-pass: the chair vertex shader with a fragment shader that leaves everything but depth alone
+const GLchar * depthFragmentShaderSource = GLSL_CHUNK(
+	void main() {
+	}
+);
+
+// Impostor billboards: one camera-facing quad per far chair, showing the atlas view baked closest to the camera direction
+const GLchar * impostorVertexShaderSource = GLSL_CHUNK(
+	layout (location = 3) in uint instanceIndex; //VAP position 3 for the index of a visible instance
+
+	out vec3 FragmentPos;
+	out vec2 atlasCoordinate;
+	out float ViewDepth;
+	flat out mat3 impostorNormalMatrix; //Takes the baked object-space normals to world space
+	flat out float impostorRadius;
+
+	uniform samplerBuffer instanceData;
+	uniform vec4 impostorBounds; //Object-space bounding sphere the atlas views were framed on
+
+	void main() {
+		int texel = int(instanceIndex) * 7;
+		mat4 instanceModel = mat4(texelFetch(instanceData, texel), texelFetch(instanceData, texel + 1), texelFetch(instanceData, texel + 2), texelFetch(instanceData, texel + 3));
+		mat3 instanceNormalMatrix = mat3(texelFetch(instanceData, texel + 4).xyz, texelFetch(instanceData, texel + 5).xyz, texelFetch(instanceData, texel + 6).xyz);
+		mat4 world = model * instanceModel;
+		mat3 linear = mat3(world);
+		vec3 center = vec3(world * vec4(impostorBounds.xyz, 1.0f));
+
+		//Camera direction in object space (rotation and uniform scale only), snapped to the nearest of the 8 x 4 baked views
+		vec3 eye = -transpose(mat3(view)) * view[3].xyz;
+		vec3 direction = normalize(transpose(linear) * (eye - center));
+		float column = mod(floor(atan(direction.x, direction.z) / 0.785398f + 0.5f), 8.0f);
+		float row = clamp(floor((asin(clamp(direction.y, -1.0f, 1.0f)) + 1.570796f) / 0.785398f), 0.0f, 3.0f);
+		float azimuth = column * 0.785398f;
+		float elevation = row * 0.785398f - 1.178097f;
+		vec3 bakeDirection = vec3(sin(azimuth) * cos(elevation), sin(elevation), cos(azimuth) * cos(elevation));
+
+		//The quad lies in the plane the view was baked in, so the image lines up with the chair it replaces
+		vec3 forward = -normalize(linear * bakeDirection);
+		vec3 up = normalize(linear * vec3(0.0f, 1.0f, 0.0f));
+		vec3 side = normalize(cross(forward, up));
+		up = cross(side, forward);
+		vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0f - 1.0f;
+		float radius = impostorBounds.w * length(linear[0]);
+
+		FragmentPos = center + (corner.x * side + corner.y * up) * radius;
+		gl_Position = projection * view * vec4(FragmentPos, 1.0f);
+		ViewDepth = -(view * vec4(FragmentPos, 1.0f)).z;
+		atlasCoordinate = (vec2(column, row) + corner * 0.5f + 0.5f) / vec2(8.0f, 4.0f);
+		impostorNormalMatrix = normalMatrix * instanceNormalMatrix;
+		impostorRadius = radius;
+	}
+);
+
+const GLchar * impostorFragmentShaderSource = GLSL_CHUNK(
+	in vec3 FragmentPos;
+	in vec2 atlasCoordinate;
+	in float ViewDepth;
+	flat in mat3 impostorNormalMatrix;
+	flat in float impostorRadius;
+
+	out vec4 result;
+
+	uniform sampler2D impostorAlbedo; //Baked colors, coverage in alpha
+	uniform sampler2D impostorNormals; //Baked object-space normals
+
+	void main() {
+		vec4 albedo = texture(impostorAlbedo, atlasCoordinate);
+		if (albedo.a < 0.5f) {
+			discard;
+		}
+		vec3 norm = normalize(impostorNormalMatrix * (texture(impostorNormals, atlasCoordinate).xyz * 2.0f - 1.0f));
+		//The quad runs through the chair's center; the surface it shows lies up to a radius towards its normal
+		result = vec4(ShadeFragment(FragmentPos, norm, ViewDepth, impostorRadius * 0.5f) * albedo.rgb, 1.0f);
+	}
+);
+
+// Renders one atlas view of the chair: texture color and object-space normal, without lighting
+const GLchar * impostorBakeVertexShaderSource = GLSL(330,
+	layout (location = 0) in vec3 position;
+	layout (location = 1) in vec3 normal;
+	layout (location = 2) in vec2 textureCoordinate;
+
+	out vec3 ObjectNormal;
+	out vec2 mobileTextureCoordinate;
+
+	uniform mat4 bakeViewProjection;
+	uniform vec3 positionScale;
+	uniform vec3 positionOffset;
+
+	void main() {
+		gl_Position = bakeViewProjection * vec4(positionOffset + positionScale * position, 1.0f);
+		ObjectNormal = normal;
+		mobileTextureCoordinate = vec2(textureCoordinate.x, 1.0f - textureCoordinate.y); //flips the texture horizontal
+	}
+);
+
+const GLchar * impostorBakeFragmentShaderSource = GLSL(330,
+	in vec3 ObjectNormal;
+	in vec2 mobileTextureCoordinate;
+
+	layout (location = 0) out vec4 albedo;
+	layout (location = 1) out vec4 packedNormal;
+
+	uniform sampler2D uTexture;
+
+	void main() {
+		albedo = vec4(vec3(texture(uTexture, mobileTextureCoordinate)), 1.0f);
+		packedNormal = vec4(normalize(ObjectNormal) * 0.5f + 0.5f, 1.0f);
+	}
+);
+
+// Shadow pass: every chair instance from one light into one cube face, storing the distance to the light as depth
+const GLchar * shadowVertexShaderSource = GLSL(330,
+	layout (location = 0) in vec3 position;
+
+	out vec3 WorldPos;
+
+	uniform mat4 model;
+	uniform mat4 faceViewProjection;
+	uniform samplerBuffer instanceData;
+	uniform vec3 positionScale;
+	uniform vec3 positionOffset;
+
+	void main() {
+		int texel = gl_InstanceID * 7; //All instances are drawn, without the visible index list
+		mat4 instanceModel = mat4(texelFetch(instanceData, texel), texelFetch(instanceData, texel + 1), texelFetch(instanceData, texel + 2), texelFetch(instanceData, texel + 3));
+		vec4 world = model * instanceModel * vec4(positionOffset + positionScale * position, 1.0f);
+		WorldPos = world.xyz;
+		gl_Position = faceViewProjection * world;
+	}
+);
+
+const GLchar * shadowFragmentShaderSource = GLSL(330,
+	in vec3 WorldPos;
+
+	uniform vec4 shadowLight; //Light position, 1 / range
+
+	void main() {
+		gl_FragDepth = length(WorldPos - shadowLight.xyz) * shadowLight.w;
 	}
 );
 
 // Main program
 int main(int argc, char* argv[]) {
 
+	// Offline conversion needs no window: --import-obj input.obj output.umesh [float|packed]
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "--import-obj") == 0) {
+		vertexFormat = argc == 5 && strcmp(argv[4], "packed") == 0 ? VERTEX_FORMAT_PACKED : VERTEX_FORMAT_FLOAT;
+		return UImportObj(argv[2], argv[3]) ? 0 : -1;
+	}
+
 	glutInit(&argc, argv);
+	glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS); // Return so the cleanup below joins the threads
+	UParseArguments(argc, argv); // GLUT has already removed its own options
 	glutInitDisplayMode(GLUT_DEPTH | GLUT_DOUBLE | GLUT_RGBA);
 	glutInitWindowSize(WindowWidth, WindowHeight);
 	glutCreateWindow(WINDOW_TITLE);
@@ -201,479 +1296,4678 @@ int main(int argc, char* argv[]) {
 			return -1;
 		}
 
-	UCreateShader();
+	if (!UCreateShader()) {
+		return -1;
+	}
+
+	if (!UCreateBuffers()) {
+		return -1;
+	}
 
-	UCreateBuffers();
+	UCreateInstances();
 
 	UGenerateTexture();
 
+	UCreateUniformBuffers();
+
+	UCreateLights();
 
+	UCreateShadowMaps();
 
-	// Use the shader program
+	UCreateLightmap();
+
+	if (!UCreateVariants()) {
+		return -1;
+	}
+
+	UStartWorkers();
+
+	UStartSimulation();
+
+	// Point the samplers of the fixed programs at their units; the variants were configured when they were built
+	glUseProgram(impostorBakeProgram);
+	glUniform1i(impostorBakeProgramInfo.textureLoc, 0);
+	USetPositionUniforms(impostorBakeProgramInfo);
+	glUseProgram(shadowProgram);
+	glUniform1i(UUniformLocation(shadowProgramInfo, "instanceData"), INSTANCE_DATA_UNIT);
+	USetPositionUniforms(shadowProgramInfo);
 	glUseProgram(shaderProgram);
 
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f); // Set background color
 
-	glutDisplayFunc(URenderGraphics);
+	glEnable(GL_DEPTH_TEST); // Enable z-depth once; only the depth pre-pass changes the test, and restores it
+	glDepthFunc(GL_LEQUAL); // Coplanar faces resolve to the last one drawn, as they do in the pre-pass's equal test
+
+	timerQueriesSupported = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+
+	UCreateDynamicResolution();
+
+	UCreateDepthPrepass();
 
-	glutPassiveMotionFunc(UMouseMove); // Detects mouse movement
+	if (benchmarkMode) {
+		// The window only provides the context; frames go to the offscreen target
+		glutHideWindow();
+		URunBenchmark();
+		UDeleteGraphics();
+	}
+	else {
+		glutDisplayFunc(URenderGraphics);
+
+		glutPassiveMotionFunc(UMouseMove); // Detects mouse movement
+
+		glutMotionFunc(UOnMotion);
 
-	glutMotionFunc(UOnMotion);
+		glutMouseFunc(UMouseClick); // Detects mouse click
 
-	glutMouseFunc(UMouseClick); // Detects mouse click
+		glutKeyboardFunc(UKeyboard); // Profiler overlay and export keys
 
-	glutMainLoop();
+		glutCloseFunc(UCloseWindow);
 
-	// Destroys buffer objects once used
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteBuffers(1, &VBO);
+		glutMainLoop();
+	}
+
+	// UDeleteGraphics has run while the context was current; only the threads and the mapped mesh are left
+	UStopSimulation();
+	UStopWorkers(); // Workers finish the background item they are on and take no more; only then is the mesh unmapped
+	UStopTextureStreaming();
+	UUnmapFile(chairMeshFile);
 
 	return 0;
 }
 
+// Destroys the GL objects once used. Runs while the context is current: from the close callback, or after a benchmark
+void UDeleteGraphics() {
+	UDeleteArenas();
+	glDeleteBuffers(1, &instanceVBO);
+	UDeleteDynamicBuffer(visibleStream);
+	if (indirectDraws) {
+		UDeleteDynamicBuffer(indirectStream);
+	}
+	glDeleteTextures(1, &instanceTexture);
+	glDeleteVertexArrays(1, &impostorVAO);
+	glDeleteTextures(1, &lodData.albedoAtlas);
+	glDeleteTextures(1, &lodData.normalAtlas);
+	glDeleteTextures(SHADOW_LIGHTS, shadowMaps.cubes);
+	glDeleteFramebuffers(1, &shadowMaps.framebuffer);
+	if (lightmap.ready) {
+		glDeleteTextures(1, &lightmap.texture);
+	}
+	UDeleteDynamicBuffer(frameStream);
+	glDeleteFramebuffers(1, &sceneFBO);
+	glDeleteRenderbuffers(1, &sceneColor);
+	glDeleteRenderbuffers(1, &sceneDepth);
+	for (int i = 0; i < latency.count; i++) {
+		glDeleteSync(latency.frames[(latency.oldest + i) % LATENCY_FENCES].fence);
+	}
+	if (frameBudget > 0.0f) {
+		glDeleteQueries(RESOLUTION_QUERY_FRAMES * 2, resolution.queries[0]);
+	}
+	glDeleteQueries(PREPASS_QUERY_FRAMES * 2, depthPrepass.queries[0]);
+	glDeleteBuffers(1, &lightUBO);
+	glDeleteBuffers(1, &clusterRecordBuffer);
+	glDeleteBuffers(1, &clusterIndexBuffer);
+	glDeleteTextures(1, &clusterRecordTexture);
+	glDeleteTextures(1, &clusterIndexTexture);
+	UDeleteStreamedTextures();
+}
+
+// Reads the command line options controlling frame scheduling
+void UParseArguments(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--continuous") == 0) {
+			continuousRendering = true; // Redraw every frame, for benchmarking
+		}
+		else if (strcmp(argv[i], "--fps-cap") == 0 && i + 1 < argc) {
+			frameRateCap = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+			framesInFlight = glm::clamp(atoi(argv[++i]), 0, 2); // Low-latency mode with 1 or 2
+		}
+		else if (strcmp(argv[i], "--latency-out") == 0 && i + 1 < argc) {
+			latencyOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "--showroom") == 0 && i + 1 < argc) {
+			showroomCount = atoi(argv[++i]); // Lay out this many chairs
+		}
+		else if (strcmp(argv[i], "--benchmark") == 0) {
+			benchmarkMode = true;
+			if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+				cameraPathFile = argv[++i]; // Optional recorded path
+			}
+		}
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			benchmarkFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			sscanf(argv[++i], "%dx%d", &benchmarkWidth, &benchmarkHeight);
+		}
+		else if (strcmp(argv[i], "--dump-frames") == 0 && i + 1 < argc) {
+			frameDumpPrefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--benchmark-out") == 0 && i + 1 < argc) {
+			benchmarkOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+			frameBudget = (GLfloat)atof(argv[++i]); // Milliseconds per scene pass
+		}
+		else if (strcmp(argv[i], "--min-scale") == 0 && i + 1 < argc) {
+			minimumScale = glm::clamp((GLfloat)atof(argv[++i]), 0.1f, 1.0f);
+		}
+		else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc) {
+			extraLightCount = atoi(argv[++i]); // Scatter this many extra lights over the scene
+		}
+		else if (strcmp(argv[i], "--upload-budget") == 0 && i + 1 < argc) {
+			uploadBudget = (size_t)max(1, atoi(argv[++i])) * 1024; // Kilobytes of texture data per frame
+		}
+		else if (strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc) {
+			decodeThreadCount = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--shader-cache") == 0 && i + 1 < argc) {
+			programCachePrefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--no-shader-cache") == 0) {
+			programCachePrefix.clear();
+		}
+		else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc) {
+			lodThreshold = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--shadow-size") == 0 && i + 1 < argc) {
+			shadowSize = max(0, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--pcf") == 0 && i + 1 < argc) {
+			shadowKernel = max(1, atoi(argv[++i])) | 1; // Odd, so the kernel is centered on the fragment
+		}
+		else if (strcmp(argv[i], "--no-specular") == 0) {
+			specularEnabled = false; // Diffuse only, with cheaper shader variants
+		}
+		else if (strcmp(argv[i], "--lightmap") == 0) {
+			lightmapEnabled = true;
+		}
+		else if (strcmp(argv[i], "--lightmap-size") == 0 && i + 1 < argc) {
+			lightmapSize = max(8, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--lightmap-samples") == 0 && i + 1 < argc) {
+			lightmapSamples = max(0, atoi(argv[++i])); // 0 bakes direct light only
+		}
+		else if (strcmp(argv[i], "--impostor-size") == 0 && i + 1 < argc) {
+			impostorSize = (GLfloat)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--no-lod") == 0) {
+			lodEnabled = false;
+		}
+		else if (strcmp(argv[i], "--depth-prepass") == 0) {
+			prepassMode = PREPASS_ON;
+		}
+		else if (strcmp(argv[i], "--no-depth-prepass") == 0) {
+			prepassMode = PREPASS_OFF;
+		}
+		else if (strcmp(argv[i], "--overdraw-threshold") == 0 && i + 1 < argc) {
+			overdrawThreshold = (GLfloat)atof(argv[++i]); // Samples shaded per visible sample
+		}
+		else if (strcmp(argv[i], "--no-indirect") == 0) {
+			indirectDraws = false; // Issue the render queue's commands one at a time
+		}
+		else if (strcmp(argv[i], "--no-persistent-map") == 0) {
+			persistentMapping = false; // Orphan and re-upload the dynamic buffers instead
+		}
+		else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+			meshFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--vertex-format") == 0 && i + 1 < argc) {
+			vertexFormat = strcmp(argv[++i], "packed") == 0 ? VERTEX_FORMAT_PACKED : VERTEX_FORMAT_FLOAT;
+		}
+		else if (strcmp(argv[i], "--profile") == 0) {
+			profilerEnabled = true;
+		}
+		else if (strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) {
+			profileOutput = argv[++i];
+		}
+		else {
+			cout << "Ignoring unknown option " << argv[i] << endl;
+		}
+	}
+}
+
 void UResizeWindow(int w, int h) {
 	WindowWidth = w;
 	WindowHeight = h;
 	glViewport(0, 0, WindowWidth, WindowHeight);
+
+	UCreateSceneTarget(WindowWidth, WindowHeight);
+	UMarkDirty();
 }
 
-void URenderGraphics(void) {
-	glEnable(GL_DEPTH_TEST); // Enable z-depth
+// (Re)creates the offscreen color and depth target the scene is rendered into
+void UCreateSceneTarget(int width, int height) {
+	if (width <= 0 || height <= 0) {
+		return; // Minimized window, keep the previous target
+	}
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clears the screen
+	if (sceneFBO == 0) {
+		glGenFramebuffers(1, &sceneFBO);
+		glGenRenderbuffers(1, &sceneColor);
+		glGenRenderbuffers(1, &sceneDepth);
+	}
 
-	glBindVertexArray(VAO); // Activate the vertex array object before rendering and transforming
+	glBindRenderbuffer(GL_RENDERBUFFER, sceneColor);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, sceneDepth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, sceneColor);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sceneDepth);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cout << "Scene framebuffer is incomplete" << endl;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-	CameraForwardZ = front; // Replaces camera forward vector with radians normalized as a unit vector
+// Copies the offscreen target to the window, scaling it up bilinearly when it was rendered at a lower resolution,
+// and flips the front and back buffers
+void UPresentSceneTarget() {
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	{
+		UGpuProfileScope presentPass("present");
+		bool scaled = resolution.width != WindowWidth || resolution.height != WindowHeight;
+		glBlitFramebuffer(0, 0, resolution.width, resolution.height, 0, 0, WindowWidth, WindowHeight, GL_COLOR_BUFFER_BIT,
+			scaled ? GL_LINEAR : GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
 
+	if (profilerEnabled) {
+		UDrawProfileOverlay();
+	}
 
-	// Transforms the object
-	glm::mat4 model;
-	model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // Place object at the center of the viewport
-	model = glm::rotate(model, 45.0f, glm::vec3(0.0f, 1.0f, 0.0f)); // Rotate the object 45 degrees on the x
-	model = glm::scale(model, glm::vec3(scale_by_x, scale_by_y, scale_by_z)); // Increase the object size by a scale of 2
+	glutSwapBuffers();
+}
 
-	// Transforms the camera
-	glm::mat4 view;
-	view = glm::lookAt(CameraForwardZ, cameraPosition, CameraUpY);
+// Starts at full resolution; the scale only adapts with a frame budget and timer queries to measure against it
+void UCreateDynamicResolution() {
+	resolution.scale = 1.0f;
+	resolution.width = WindowWidth;
+	resolution.height = WindowHeight;
+	resolution.frame = 0;
+	resolution.lastTime = 0.0;
+	if (frameBudget > 0.0f && !timerQueriesSupported) {
+		cout << "Dynamic resolution needs timer queries, rendering at full resolution" << endl;
+		frameBudget = 0.0f;
+	}
+	if (frameBudget > 0.0f) {
+		glGenQueries(RESOLUTION_QUERY_FRAMES * 2, resolution.queries[0]);
+		for (int slot = 0; slot < RESOLUTION_QUERY_FRAMES; slot++) {
+			resolution.pending[slot] = false;
+		}
+	}
+}
 
-	glm::mat4 projection;
-	// Creates a perspective projection
-	if (perspective == true) {
-		projection = glm::perspective(45.0f, (GLfloat)WindowWidth / (GLfloat)WindowHeight, 0.1f, 100.0f);
+// Reads the oldest scene pass timing if the GPU has produced it, steers the scale towards the budget and sizes the
+// frame about to be rendered
+void UUpdateResolution() {
+	UDynamicResolution& dynamic = resolution;
+	int slot = dynamic.frame % RESOLUTION_QUERY_FRAMES;
+	GLuint64 timestamps[2];
+	if (frameBudget > 0.0f && UTakeQueryResults(dynamic.queries[slot], dynamic.pending[slot], timestamps)) {
+		dynamic.lastTime = (timestamps[1] - timestamps[0]) / 1.0e6;
+
+		// Fragment work grows with the pixel count, so the scale per axis follows the square root of the time ratio.
+		// Moving half way and ignoring small corrections lets the scale settle instead of oscillating
+		GLfloat target = dynamic.scale * sqrt(frameBudget / (GLfloat)max(dynamic.lastTime, 0.01));
+		target = glm::clamp(target, minimumScale, 1.0f);
+		if (fabs(target - dynamic.scale) > 0.02f) {
+			dynamic.scale += (target - dynamic.scale) * 0.5f;
+		}
 	}
-	else {
-		// Creates a orthographic projection
-		projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
+
+	dynamic.width = max(1, (int)(WindowWidth * dynamic.scale + 0.5f));
+	dynamic.height = max(1, (int)(WindowHeight * dynamic.scale + 0.5f));
+	URecordSample(dynamic.history, dynamic.scale * 100.0);
+}
+
+// Reads a ring slot's pair of queries, which is about to be reused. Late frames are dropped rather than waited for:
+// returns false unless the GPU has produced both results. The slot is free afterwards either way
+bool UTakeQueryResults(const GLuint queries[2], bool& pending, GLuint64 results[2]) {
+	if (!pending) {
+		return false;
+	}
+	pending = false;
+	GLint available = 0;
+	glGetQueryObjectiv(queries[1], GL_QUERY_RESULT_AVAILABLE, &available); // The second query finishes last
+	if (!available) {
+		return false;
 	}
+	glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &results[0]);
+	glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &results[1]);
+	return true;
+}
+
+// Starts with a measurement in auto mode, so the first frame already tells whether the pre-pass pays off
+void UCreateDepthPrepass() {
+	UDepthPrepass& prepass = depthPrepass;
+	glGenQueries(PREPASS_QUERY_FRAMES * 2, prepass.queries[0]);
+	for (int slot = 0; slot < PREPASS_QUERY_FRAMES; slot++) {
+		prepass.pending[slot] = false;
+	}
+	prepass.frame = 0;
+	prepass.active = false;
+	prepass.enabled = false;
+	prepass.sinceProbe = PREPASS_PROBE_INTERVAL;
+	prepass.overdraw = 0.0;
+	prepass.overdrawSum = 0.0;
+	prepass.measurements = 0;
+	prepass.frames = 0;
+}
 
-	// Retrieves and passes transform matrices to the shader program
-	GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-	GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-	GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
-    GLint secondLightColorLoc, lightColorLoc, lightPositionLoc, lightStrengthLoc, viewPositionLoc;
+// Reads the oldest sample counts if the GPU has produced them and decides whether the frame about to be rendered
+// uses the pre-pass
+void UUpdateDepthPrepass() {
+	UDepthPrepass& prepass = depthPrepass;
+	int slot = prepass.frame % PREPASS_QUERY_FRAMES;
+	GLuint64 samples[2]; // Passed by the depth pass and by the equal pass
+	if (UTakeQueryResults(prepass.queries[slot], prepass.pending[slot], samples) && samples[1] > 0) {
+		prepass.overdraw = (double)samples[0] / samples[1];
+		prepass.overdrawSum += prepass.overdraw;
+		prepass.measurements++;
+
+		// A little hysteresis keeps a view near the threshold from switching every frame
+		prepass.enabled = prepass.overdraw > overdrawThreshold * (prepass.enabled ? 0.9 : 1.0);
+	}
 
+	if (prepassMode == PREPASS_AUTO) {
+		prepass.active = prepass.enabled || prepass.sinceProbe >= PREPASS_PROBE_INTERVAL;
+	}
+	else {
+		prepass.active = prepassMode == PREPASS_ON;
+	}
+	prepass.sinceProbe = prepass.active ? 0 : prepass.sinceProbe + 1;
+	prepass.frames += prepass.active ? 1 : 0;
+}
 
-	glUniformMatrix4fv(modelLoc,1, GL_FALSE, glm::value_ptr(model));
-	glUniformMatrix4fv(viewLoc,1, GL_FALSE, glm::value_ptr(view));
-	glUniformMatrix4fv(projLoc,1, GL_FALSE, glm::value_ptr(projection));
+// Flags the scene as changed and makes sure a frame gets scheduled
+void UMarkDirty() {
+	frameDirty = true;
+	UScheduleFrame();
+}
 
-	lightColorLoc = glGetUniformLocation(shaderProgram, "lightColor");
-	lightPositionLoc = glGetUniformLocation(shaderProgram, "lightPos");
-    lightStrengthLoc = glGetUniformLocation(shaderProgram, "lightStrength");
-    secondLightColorLoc = glGetUniformLocation(shaderProgram, "secondLightColor");
-	viewPositionLoc = glGetUniformLocation(shaderProgram, "viewPosition");
+// Queues the next frame, delaying it when a frame rate cap is set
+void UScheduleFrame() {
+	if (redisplayPending) {
+		return; // Already queued; several changes collapse into one frame
+	}
+	redisplayPending = true;
 
-	//pass color, light, and camera data to the cube shader programs corresponding uniforms
-	glUniform3f(lightColorLoc, lightColor.r, lightColor.g, lightColor.b);
-	glUniform3f(secondLightColorLoc, secondLightColor.r, secondLightColor.g, secondLightColor.b);
-	glUniform3f(lightPositionLoc, lightPosition.x, lightPosition.y, lightPosition.z);
-	glUniform3f(lightStrengthLoc, lightStrength.x, lightStrength.y, lightStrength.z);
-	glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+	if (frameRateCap > 0.0f) {
+		int frameInterval = (int)(1000.0f / frameRateCap);
+		int elapsed = glutGet(GLUT_ELAPSED_TIME) - lastFrameTime;
+		glutTimerFunc(elapsed < frameInterval ? frameInterval - elapsed : 0, UFrameTimer, 0);
+	}
+	else {
+		glutPostRedisplay();
+	}
+}
 
+// Fires once the frame rate cap allows the next frame
+void UFrameTimer(int) {
 	glutPostRedisplay();
+}
 
-	glBindTexture(GL_TEXTURE_2D, texture);
+// Fences the frame just presented; its input latency is recorded once the GPU has finished it. Only the frames in
+// flight cap and the profiler need the fences, so without either no fence is made and nothing is polled
+void UFencePresentedFrame(bool measured, chrono::high_resolution_clock::time_point input) {
+	if (framesInFlight == 0 && !profilerEnabled) {
+		return;
+	}
+	ULatency& tracker = latency;
+	if (tracker.count == LATENCY_FENCES) {
+		// Without a cap the driver may queue more frames than are tracked; the oldest is dropped rather than waited for
+		UPresentedFrame& oldest = tracker.frames[tracker.oldest];
+		glDeleteSync(oldest.fence);
+		tracker.dropped += oldest.measured ? 1 : 0;
+		tracker.oldest = (tracker.oldest + 1) % LATENCY_FENCES;
+		tracker.count--;
+	}
 
-	// Draws the triangles
-	glDrawArrays(GL_TRIANGLES, 0, 216); // Draws the triangles that make up the chair
+	UPresentedFrame& frame = tracker.frames[(tracker.oldest + tracker.count) % LATENCY_FENCES];
+	frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	frame.measured = measured;
+	frame.input = input;
+	tracker.count++;
 
-	glBindVertexArray(0); // Deactivate the vertex array object
-	glutSwapBuffers(); // Flips the front and back buffers every frame
+	if (!tracker.timerPending) {
+		tracker.timerPending = true;
+		glutTimerFunc(1, ULatencyTimer, 0);
+	}
 }
 
-void UCreateShader() {
+// Retires the presented frames the GPU has finished, oldest first, and blocks while more than keep frames are still
+// in flight; a negative keep never blocks
+void URetireFrames(int keep) {
+	ULatency& tracker = latency;
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	while (tracker.count > 0) {
+		UPresentedFrame& frame = tracker.frames[tracker.oldest];
+		GLenum status = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (keep >= 0 && tracker.count > keep) {
+			while (status == GL_TIMEOUT_EXPIRED) {
+				status = glClientWaitSync(frame.fence, 0, 1000000); // Too many frames queued; wait 1ms at a time
+			}
+		}
+		else if (status == GL_TIMEOUT_EXPIRED) {
+			break; // Frames finish in order, so the younger ones are not done either
+		}
 
-	//Vertex shader
-	GLint vertexShader = glCreateShader(GL_VERTEX_SHADER); // creates the vertex shader
-	glShaderSource(vertexShader, 1, &lightVertexShaderSource, NULL); //Attaches the vertex shader to the source code
-	glCompileShader(vertexShader); //compiles the vertex shader
+		// The frame reached the screen no later than now; the histogram keeps whole milliseconds
+		if (frame.measured) {
+			double milliseconds = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - frame.input).count();
+			tracker.histogram[min((int)milliseconds, LATENCY_BUCKETS - 1)]++;
+			tracker.samples++;
+			tracker.last = milliseconds;
+			tracker.total += milliseconds;
+		}
+		glDeleteSync(frame.fence);
+		tracker.oldest = (tracker.oldest + 1) % LATENCY_FENCES;
+		tracker.count--;
+	}
+	if (keep >= 0) {
+		tracker.waited = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+	}
+}
 
-	//Fragment shader
-	GLint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER); //Creates the fragment shader
-	glShaderSource(fragmentShader, 1, &lightFragmentShaderSource, NULL); //Attaches the fragment shader to the source code
-	glCompileShader(fragmentShader); //compiles the fragment shader
+// Keeps retiring frames while nothing else is rendered, so an idle viewer still measures its last frames promptly
+void ULatencyTimer(int) {
+	latency.timerPending = false;
+	URetireFrames(-1);
+	if (latency.count > 0) {
+		latency.timerPending = true;
+		glutTimerFunc(1, ULatencyTimer, 0);
+	}
+}
 
-	// Shader Program
-	shaderProgram = glCreateProgram(); // Creates the shader program and returns an id
-	glAttachShader(shaderProgram, vertexShader); // Attach vertex shader to the shader program
-	glAttachShader(shaderProgram, fragmentShader); // Attach fragment shader to the shader program
-	glLinkProgram(shaderProgram); // Link vertex and fragment shader to shader program
+// Gives the simulation thread a moment to apply input queued since its last snapshot, instead of rendering without
+// it and polling again a millisecond later
+void UWaitForInput() {
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	UAcquireSnapshot();
+	while (UCurrentSnapshot().inputSequence != simulation.submitted
+		&& chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() < LATENCY_INPUT_WAIT) {
+		this_thread::yield();
+		UAcquireSnapshot();
+	}
+}
 
-	// Delete the vertex and fragment shaders once linked
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
-}
-
-void UCreateBuffers() {
-
-	// Chair vertices
-	GLfloat vertices[] = {
-			// center back of seat is 0,0,0
-			// Locations are referenced while looking at front of chair
-
-			//Position     	 	 	//Normals				// Texture
-
-			// Seat - Top
-			-0.5f, 0.0f, 0.0f,		0.0f, 1.0f, 0.0f,	 	0.0f, 1.0f, // 0 Back left (top)
-			-0.5f, 0.0f, 1.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 2 Front left (top)
-			0.5f, 0.0f, 1.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 3 Front right (top)
-			-0.5f, 0.0f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 0 Back left (top)
-			0.5f, 0.0f, 0.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 1 Back right (top)
-			0.5f, 0.0f, 1.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 3 Front right (top)
-
-			// Seat - Bottom
-			-0.5f, -0.2f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 4 Back left (bottom)
-			-0.5f, -0.2f, 1.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 6 Front left (bottom)
-			0.5f, -0.2f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-			-0.5f, -0.2f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 4 Back left (bottom)
-			0.5f, -0.2f, 0.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 5 Back right (bottom)
-			0.5f, -0.2f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-
-			// Seat - Left Side
-			-0.5f, 0.0f, 0.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 0 Back left (top)
-			-0.5f, -0.2f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 4 Back left (bottom)
-			-0.5f, -0.2f, 1.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 6 Front left (bottom)
-			-0.5f, 0.0f, 0.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 0 Back left (top)
-			-0.5f, 0.0f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 2 Front left (top)
-			-0.5f, -0.2f, 1.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 6 Front left (bottom)
-
-			// Seat - Back Side
-			-0.5f, 0.0f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 0 Back left (top)
-			-0.5f, -0.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 4 Back left (bottom)
-			0.5f, -0.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 5 Back right (bottom)
-			-0.5f, 0.0f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 0 Back left (top)
-			0.5f, 0.0f, 0.0f,		0.0f, 0.0f, -1.0f,		1.0f, 1.0f, // 1 Back right (top)
-			0.5f, -0.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 5 Back right (bottom)
-
-			// Seat - Right Side
-			0.5f, 0.0f, 0.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 1 Back right (top)
-			0.5f, -0.2f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 5 Back right (bottom)
-			0.5f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-			0.5f, 0.0f, 0.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 1 Back right (top)
-			0.5f, 0.0f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 3 Front right (top)
-			0.5f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-
-			// Seat - Front Side
-			-0.5f, 0.0f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 2 Front left (top)
-			-0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 6 Front left (bottom)
-			0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 7 Front right (bottom)
-			-0.5f, 0.0f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 2 Front left (top)
-			0.5f, 0.0f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 3 Front right (top)
-			0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 7 Front right (bottom)
-
-		// ---------------------------------------------
-
-			// Back Rest - Front
-			-0.5f, 1.2f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 12 Top left (front)
-			-0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 14 Bottom left (front)
-			0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 15 Bottom right (front)
-			-0.5f, 1.2f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 12 Top left (front)
-			0.5f, 1.2f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 13 Top right (front)
-			0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 15 Bottom right (front)
-
-			// Back Rest - Back
-			-0.5f, 1.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 8 Top left (back)
-			-0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 10 Bottom left (back)
-			0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 11 Bottom right (back)
-			-0.5f, 1.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 8 Top left (back)
-			0.5f, 1.2f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 9 Top right (back)
-			0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 11 Bottom right (back)
-
-			// Back Rest - Left Side
-			-0.5f, 1.2f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 8 Top left (back)
-			-0.5f, 0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 10 Bottom left (back)
-			-0.5f, 0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 14 Bottom left (front)
-			-0.5f, 1.2f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 8 Top left (back)
-			-0.5f, 1.2f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 12 Top left (front)
-			-0.5f, 0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 14 Bottom left (front)
-
-			// Back Rest - Right Side
-			0.5f, 1.2f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 9 Top right (back)
-			0.5f, 0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 11 Bottom right (back)
-			0.5f, 0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 15 Bottom right (front)
-			0.5f, 1.2f, 0.0f,		1.0f, 0.0f, 0.0f,		1.0f, 1.0f,  // 9 Top right (back)
-			0.5f, 1.2f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 13 Top right (front)
-			0.5f, 0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 15 Bottom right (front)
-
-			// Back Rest - Top Side
-			-0.5f, 1.2f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 8 Top left (back)
-			-0.5f, 1.2f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 12 Top left (front)
-			0.5f, 1.2f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 13 Top right (front)
-			-0.5f, 1.2f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 8 Top left (back)
-			0.5f, 1.2f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 9 Top right (back)
-			0.5f, 1.2f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 13 Top right (front)
-
-			// Back Rest - Bottom Side
-			-0.5f, 0.9f, 0.0f,		0.0f, -1.0f, 0.0f,		0.0f, 0.0f, // 10 Bottom left (back)
-			-0.5f, 0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f,// 14 Bottom left (front)
-			0.5f, 0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 11 Bottom right (back)
-			-0.5f, 0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 10 Bottom left (back)
-			0.5f, 0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 15 Bottom right (front)
-			0.5f, 0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 11 Bottom right (back)
-
-		// ---------------------------------------------
-
-			// Rear Left Leg - Front Side
-			-0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 14 Bottom left (front)
-			-0.5f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 19 Bottom left (front)
-			-0.4f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 21 bottom right (front)
-			-0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 14 Bottom left (front)
-			-0.4f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 17 Top right (front)
-			-0.4f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 21 bottom right (front)
-
-			// Rear Left Leg - Back Side
-			-0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.5f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 18 Bottom left (back)
-			-0.4f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 20 bottom right (back)
-			-0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.4f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 16 Top right (back)
-			-0.4f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 20 bottom right (back)
-
-			// Rear Left Leg  - Left Side
-			-0.5f, 0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.5f, -0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 18 Bottom left (back)
-			-0.5f, -0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 19 Bottom left (front)
-			-0.5f, 0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.5f, 0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 14 Bottom left (front)
-			-0.5f, -0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 19 Bottom left (front)
-
-			// Rear Left Leg - Right Side
-			-0.4f, 0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 16 Top right (back)
-			-0.4f, 0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 17 Top right (front)
-			-0.4f, -0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 21 bottom right (front)
-			-0.4f, 0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 16 Top right (back)
-			-0.4f, -0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 20 bottom right (back)
-			-0.4f, -0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 21 bottom right (front)
-
-			// Rear Left Leg - Top
-			-0.5f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f,		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.5f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 14 Bottom left (front)
-			-0.4f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 17 Top right (front)
-			-0.5f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 10 Bottom left (back)
-			-0.4f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 16 Top right (back)
-			-0.4f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 17 Top right (front)
-
-			// Rear Left Leg - Bottom
-			-0.5f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 18 Bottom left (back)
-			-0.5f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 19 Bottom left (front)
-			-0.4f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 21 bottom right (front)
-			-0.5f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 18 Bottom left (back)
-			-0.4f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 20 bottom right (back)
-			-0.4f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 21 bottom right (front)
-
-		// ---------------------------------------------
-
-			// Rear Right Leg - Front Side
-			0.4f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 23 Top left (front)
-			0.4f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 27 bottom left (front)
-			0.5f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 25 Bottom right (front)
-			0.4f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 23 Top left (front)
-			0.5f, 0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 15 Bottom right (front)
-			0.5f, -0.9f, 0.1f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 25 Bottom right (front)
-
-			// Rear Right Leg - Back Side
-			0.4f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.4f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 26 bottom left (back)
-			0.5f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 24 Bottom right (back)
-			0.4f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.5f, 0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 11 Bottom right (back)
-			0.5f, -0.9f, 0.0f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 24 Bottom right (back)
-
-			// Rear Right Leg - Left Side
-			0.4f, 0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.4f, -0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 26 bottom left (back)
-			0.4f, -0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 27 bottom left (front)
-			0.4f, 0.9f, 0.0f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.4f, 0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 23 Top left (front)
-			0.4f, -0.9f, 0.1f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 27 bottom left (front)
-
-			// Rear Right Leg - Right Side
-			0.5f, 0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 15 Bottom right (front)
-			0.5f, -0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 25 Bottom right (front)
-			0.5f, -0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 24 Bottom right (back)
-			0.5f, 0.9f, 0.1f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 15 Bottom right (front)
-			0.5f, 0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 11 Bottom right (back)
-			0.5f, -0.9f, 0.0f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 24 Bottom right (back)
-
-			// Rear Right Leg - Top
-			0.4f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.4f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 23 Top left (front)
-			0.5f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 15 Bottom right (front)
-			0.4f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 22 Top left (back)
-			0.5f, 0.9f, 0.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 11 Bottom right (back)
-			0.5f, 0.9f, 0.1f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 15 Bottom right (front)
-
-			// Rear Right Leg - Bottom
-			0.4f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 26 bottom left (back)
-			0.4f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 27 bottom left (front)
-			0.5f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 25 Bottom right (front)
-			0.4f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 26 bottom left (back)
-			0.5f, -0.9f, 0.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 24 Bottom right (back)
-			0.5f, -0.9f, 0.1f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 25 Bottom right (front)
-
-		// ---------------------------------------------
-
-			// Left Front Leg - Front
-			-0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 6 Front left (bottom)
-			-0.5f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 32 Bottom left (front)
-			-0.4f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 34 Bottom right (front)
-			-0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 6 Front left (bottom)
-			-0.4f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 30 Top right (front)
-			-0.4f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 34 Bottom right (front)
-
-			// Left Front Leg - Back
-			-0.5f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 28 Top left (back)
-			-0.5f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 31 Bottom left (back)
-			-0.4f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 33 Bottom right (back)
-			-0.5f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 28 Top left (back)
-			-0.4f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 29 Top right (back)
-			-0.4f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 33 Bottom right (back)
-
-			// Left Front Leg - Left Side
-			-0.5f, -0.2f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 28 Top left (back)
-			-0.5f, -0.9f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 31 Bottom left (back)
-			-0.5f, -0.9f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 32 Bottom left (front)
-			-0.5f, -0.2f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 28 Top left (back)
-			-0.5f, -0.2f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 6 Front left (bottom)
-			-0.5f, -0.9f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 32 Bottom left (front)
-
-			// Left Front Leg - Right Side
-			-0.4f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 30 Top right (front)
-			-0.4f, -0.9f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 34 Bottom right (front)
-			-0.4f, -0.9f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 33 Bottom right (back)
-			-0.4f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 30 Top right (front)
-			-0.4f, -0.2f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 29 Top right (back)
-			-0.4f, -0.9f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 33 Bottom right (back)
-
-			// Left Front Leg - Top
-			-0.5f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 6 Front left (bottom)
-			-0.5f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 28 Top left (back)
-			-0.4f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 29 Top right (back)
-			-0.5f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 6 Front left (bottom)
-			-0.4f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 30 Top right (front)
-			-0.4f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 29 Top right (back)
-
-			// Left Front Leg - Bottom
-			-0.5f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 31 Bottom left (back)
-			-0.5f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 32 Bottom left (front)
-			-0.4f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 34 Bottom right (front)
-			-0.5f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 31 Bottom left (back)
-			-0.4f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 33 Bottom right (back)
-			-0.4f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 34 Bottom right (front)
-
-		// ---------------------------------------------
-
-			// Right Front Leg - Front Side
-			0.4f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 37 Top left (front)
-			0.4f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 0.0f, // 41 Bottom left (front)
-			0.5f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 39 Bottom right (front)
-			0.4f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		0.0f, 1.0f, // 37 Top left (front)
-			0.5f, -0.2f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 1.0f, // 7 Front right (bottom)
-			0.5f, -0.9f, 1.0f,		0.0f, 0.0f, 1.0f, 		1.0f, 0.0f, // 39 Bottom right (front)
-
-			// Right Front Leg - Back Side
-			0.4f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.4f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 0.0f, // 38 Bottom left (back)
-			0.5f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 40 Bottom right (back)
-			0.4f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.5f, -0.2f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 1.0f, // 35 Top right (back)
-			0.5f, -0.9f, 0.9f,		0.0f, 0.0f, -1.0f, 		1.0f, 0.0f, // 40 Bottom right (back)
-
-			// Right Front Leg - Left Side
-			0.4f, -0.2f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.4f, -0.9f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 38 Bottom left (back)
-			0.4f, -0.9f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 41 Bottom left (front)
-			0.4f, -0.2f, 0.9f,		-1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.4f, -0.2f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 37 Top left (front)
-			0.4f, -0.9f, 1.0f,		-1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 41 Bottom left (front)
-
-			// Right Front Leg - Right Side
-			0.5f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 7 Front right (bottom)
-			0.5f, -0.9f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 0.0f, // 39 Bottom right (front)
-			0.5f, -0.9f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 40 Bottom right (back)
-			0.5f, -0.2f, 1.0f,		1.0f, 0.0f, 0.0f, 		0.0f, 1.0f, // 7 Front right (bottom)
-			0.5f, -0.2f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 1.0f, // 35 Top right (back)
-			0.5f, -0.9f, 0.9f,		1.0f, 0.0f, 0.0f, 		1.0f, 0.0f, // 40 Bottom right (back)
-
-			// Right Front Leg - Top
-			0.4f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.4f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		0.0f, 0.0f, // 37 Top left (front)
-			0.5f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-			0.4f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		0.0f, 1.0f, // 36 Top left (back)
-			0.5f, -0.2f, 0.9f,		0.0f, 1.0f, 0.0f, 		1.0f, 1.0f, // 35 Top right (back)
-			0.5f, -0.2f, 1.0f,		0.0f, 1.0f, 0.0f, 		1.0f, 0.0f, // 7 Front right (bottom)
-
-			// Right Front Leg - Bottom
-			0.4f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 38 Bottom left (back)
-			0.4f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		0.0f, 0.0f, // 41 Bottom left (front)
-			0.5f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 39 Bottom right (front)
-			0.4f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		0.0f, 1.0f, // 38 Bottom left (back)
-			0.5f, -0.9f, 0.9f,		0.0f, -1.0f, 0.0f, 		1.0f, 1.0f, // 40 Bottom right (back)
-			0.5f, -0.9f, 1.0f,		0.0f, -1.0f, 0.0f, 		1.0f, 0.0f, // 39 Bottom right (front)
+// Latency in milliseconds below which the given fraction of the measured frames fell, to the bucket
+double ULatencyPercentile(double fraction) {
+	unsigned long long target = (unsigned long long)(fraction * latency.samples + 0.5), seen = 0;
+	for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += latency.histogram[bucket];
+		if (seen >= target && seen > 0) {
+			return bucket + 1.0;
+		}
+	}
+	return 0.0;
+}
 
-	};
+// Writes the input-to-present latency histogram as JSON (for .json files) or CSV
+void UExportLatency(const string& fileName) {
+	ofstream file(fileName.c_str());
+	if (!file) {
+		cout << "Failed to write latency histogram " << fileName << endl;
+		return;
+	}
+
+	bool json = fileName.size() >= 5 && fileName.compare(fileName.size() - 5, 5, ".json") == 0;
+	if (json) {
+		file << "{\n  \"frames_in_flight\": " << framesInFlight << ",\n  \"samples\": " << latency.samples
+			<< ",\n  \"dropped\": " << latency.dropped << ",\n  \"buckets\": [";
+	}
+	else {
+		file << "latency_ms,frames\n";
+	}
 
+	// Empty buckets past the slowest frame are left out; the last bucket also holds everything slower
+	int used = LATENCY_BUCKETS;
+	while (used > 0 && latency.histogram[used - 1] == 0) {
+		used--;
+	}
+	for (int bucket = 0; bucket < used; bucket++) {
+		if (json) {
+			file << (bucket ? ",\n" : "\n") << "    {\"latency_ms\": " << bucket << ", \"frames\": " << latency.histogram[bucket] << "}";
+		}
+		else {
+			file << bucket << "," << latency.histogram[bucket] << "\n";
+		}
+	}
 
-	// Generate buffer IDs
-	glGenVertexArrays(1, &VAO);
-	glGenBuffers(1, &VBO);
+	if (json) {
+		file << "\n  ]\n}\n";
+	}
+	cout << "Latency histogram written to " << fileName << endl;
+}
 
-	// Activate the vertex array object before binding and setting any VBOs and vertex attrib pointers
-	glBindVertexArray(VAO);
+void URenderGraphics(void) {
+	redisplayPending = false;
 
-	// Activate the VBO
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW); // Copy vertices to VBO
+	// With frames in flight capped, block on the GPU before sampling input rather than after, so the frame is built
+	// from input that is as fresh as the cap allows
+	if (framesInFlight > 0) {
+		URetireFrames(framesInFlight - 1);
+		UWaitForInput();
+	}
 
-	// Set attribute pointer 0 to hold position data
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)0);
-	glEnableVertexAttribArray(0); // Enables vertex attribute
+	// Take the newest snapshot; input the simulation has not applied yet is polled for every millisecond
+	UAcquireSnapshot();
+	if (UCurrentSnapshot().revision != simulation.renderedRevision) {
+		frameDirty = true;
+	}
+	bool pickUpInput = inputPoll;
+	inputPoll = false;
+	if (UCurrentSnapshot().inputSequence != simulation.submitted) {
+		redisplayPending = true;
+		inputPoll = true;
+		glutTimerFunc(1, UFrameTimer, 0);
+	}
 
-	//Set attribute pointer 1 to hold Normal data
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(1);
+	// Advance texture streaming; a texture becoming resident changes the image
+	if (UPumpTextureStreaming(uploadBudget)) {
+		frameDirty = true;
+	}
+	if (textureStream.pending > 0 && !redisplayPending) {
+		redisplayPending = true; // Keep polling at roughly 60Hz until every texture is resident
+		glutTimerFunc(16, UFrameTimer, 0);
+	}
 
-	//Set attribute pointer 2 to hold texture data
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-	glEnableVertexAttribArray(2);
+	// Nothing changed (e.g. the window was only exposed): present the last frame again
+	if (!frameDirty && !continuousRendering) {
+		if (!pickUpInput) {
+			UPresentSceneTarget();
+			UFencePresentedFrame(false, chrono::high_resolution_clock::time_point());
+		}
+		return;
+	}
+	frameDirty = false;
+	const USceneSnapshot& snapshot = UCurrentSnapshot();
+	bool showsInput = snapshot.inputRevision > simulation.renderedRevision; // Otherwise its oldest input was shown already
+	simulation.renderedRevision = snapshot.revision;
+	lastFrameTime = glutGet(GLUT_ELAPSED_TIME);
 
-	glBindVertexArray(0); // Deactivates the VAO which is good practice
+	UProfilerBeginFrame();
 
-}
+	URenderScene();
 
-void UMouseMove(int x, int y) {
+	UPresentSceneTarget();
+	UFencePresentedFrame(showsInput, snapshot.inputTime);
 
-	front.x = 10.0f * cos(yaw);
-	front.y = 10.0f * sin(pitch);
-	front.z = sin(yaw) * cos(pitch) * 10.0f;
+	UProfilerEndFrame();
 
+	// Benchmark mode keeps rendering back to back
+	if (continuousRendering) {
+		UScheduleFrame();
+	}
 }
 
-void UOnMotion(int x, int y) {
+// Renders the chairs into the offscreen scene target
+void URenderScene(void) {
+	UProfileScope frameScope("scene");
+	UGpuProfileScope scenePass("scene pass");
 
-	// Boolean to check for alt and mouse button hold
-	if (checkMotion) {
+	// Bake the impostor atlas once the chair texture has streamed in
+	if (lodEnabled && !lodData.impostorReady && UResidentTexture(chairTexture) != textureStream.placeholder) {
+		UBakeImpostors();
+	}
+
+	// Re-render the shadow maps only if the cached ones no longer match the scene
+	{
+		UProfileScope shadowScope("shadow maps");
+		UUpdateShadowMaps(UCurrentSnapshot().model);
+	}
+
+	// Likewise bake the lightmap again only if the scene transform changed
+	{
+		UProfileScope lightmapScope("lightmap bake");
+		UUpdateLightmap(UCurrentSnapshot().model);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO); // Render offscreen so the frame can be presented again later
+
+	// Pick this frame's resolution from the scene passes timed so far, and time this one
+	UUpdateResolution();
+	UUpdateDepthPrepass();
+	glViewport(0, 0, resolution.width, resolution.height);
+	int resolutionSlot = resolution.frame % RESOLUTION_QUERY_FRAMES;
+	if (frameBudget > 0.0f) {
+		glQueryCounter(resolution.queries[resolutionSlot][0], GL_TIMESTAMP);
+	}
+
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Clears the screen
+
+	// Object and camera transforms come from the simulation; only the projection depends on the window
+	const USceneSnapshot& snapshot = UCurrentSnapshot();
+	const glm::mat4& model = snapshot.model;
+	const glm::mat4& view = snapshot.view;
+
+	glm::mat4 projection;
+	// Creates a perspective projection
+	if (snapshot.perspective == true) {
+		projection = glm::perspective(45.0f, (GLfloat)WindowWidth / (GLfloat)WindowHeight, nearPlane, farPlane);
+	}
+	else {
+		// Creates a orthographic projection
+		projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, nearPlane, farPlane);
+	}
+
+	// Find the chairs inside the view frustum
+	{
+		UProfileScope cullScope("frustum culling");
+		UCullInstances(projection * view * model, glm::length(glm::vec3(model[0])) * resolution.height * 0.5f * projection[1][1]);
+	}
+
+	// Upload their indices into this frame's region, timed apart from the culling since it may wait for the GPU
+	{
+		UProfileScope uploadScope("visible upload");
+		size_t bytes = cullData.visible.size() * sizeof(GLuint);
+		unsigned char* destination = UBeginDynamicWrite(visibleStream);
+		if (bytes > 0) {
+			memcpy(destination, &cullData.visible[0], bytes);
+		}
+		cullData.visibleOffset = UEndDynamicWrite(visibleStream, (GLsizeiptr)bytes);
+	}
+
+	// Sort the lights into the clusters of this view
+	{
+		UProfileScope clusterScope("light clustering");
+		UBuildLightClusters(view, projection);
+	}
+
+	// Feed the transforms, camera and lights to the shaders
+	{
+		UProfileScope uniformScope("uniform setup");
+
+		// Pack camera and cluster data and upload it to the uniform buffer in a single write
+		bool logarithmic = snapshot.perspective; // Perspective clusters grow with distance, orthographic ones do not
+		UFrameData frameData;
+		frameData.view = view;
+		frameData.projection = projection;
+		frameData.viewPosition = glm::vec4(cameraPosition, 1.0f);
+		frameData.ambient = glm::vec4(0.0f);
+		for (size_t i = 0; i < sceneLights.size(); i++) {
+			frameData.ambient += glm::vec4(glm::vec3(sceneLights[i].colorSpecular) * sceneLights[i].params.x, 0.0f);
+		}
+		frameData.viewport = glm::vec4((GLfloat)resolution.width, (GLfloat)resolution.height, 0.0f, 0.0f);
+		frameData.clusterParams = glm::vec4(nearPlane, farPlane,
+			logarithmic ? CLUSTER_Z / log(farPlane / nearPlane) : CLUSTER_Z / (farPlane - nearPlane), logarithmic ? 1.0f : 0.0f);
+		frameData.clusterGrid[0] = CLUSTER_X;
+		frameData.clusterGrid[1] = CLUSTER_Y;
+		frameData.clusterGrid[2] = CLUSTER_Z;
+		frameData.clusterGrid[3] = (GLuint)sceneLights.size();
+		frameData.model = model;
+		glm::mat3 normalMatrix = UNormalMatrix(model);
+		for (int column = 0; column < 3; column++) {
+			frameData.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+		}
+
+		memcpy(UBeginDynamicWrite(frameStream), &frameData, sizeof(UFrameData));
+		GLintptr offset = UEndDynamicWrite(frameStream, sizeof(UFrameData));
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, frameStream.buffer, offset, sizeof(UFrameData));
+	}
+
+	// Queue the draws, then submit them sorted by state
+	{
+		UProfileScope queueScope("draw queue");
+		renderQueue.packets.clear();
+
+		// One instanced packet per mesh level, each reading its own range of visible indices. The shader variant drops
+		// the texture until it is resident and the lights where the lightmap has them. With the pre-pass every level is
+		// also drawn depth only, and shaded in the equal pass
+		bool textured = UResidentTexture(chairTexture) != textureStream.placeholder;
+		bool prepass = depthPrepass.active;
+		for (int level = 0; level < LOD_MESHES; level++) {
+			if (cullData.lodCount[level] == 0) {
+				continue;
+			}
+			unsigned features = UDrawFeatures() | (textured ? VARIANT_TEXTURED : 0) | (level == 0 && lightmap.valid ? VARIANT_LIGHTMAP : 0);
+			const ULodMesh& mesh = lodData.meshes[level];
+			UDrawPacket packet;
+			packet.program = UVariantProgram(SHADER_LIGHT, features);
+			if (packet.program == 0) {
+				continue;
+			}
+			const UMeshRange& range = meshRanges[chairMesh];
+			packet.vertexArray = vertexFormats[range.format].vertexArray;
+			packet.texture = textured ? UResidentTexture(chairTexture) : 0;
+			packet.mode = GL_TRIANGLES;
+			packet.count = mesh.indexCount;
+			packet.first = (range.firstIndex + mesh.firstIndex) * sizeof(GLuint);
+			packet.baseVertex = range.baseVertex;
+			packet.indexed = true;
+			packet.instances = (GLsizei)cullData.lodCount[level];
+			packet.instanceOffset = cullData.visibleOffset + cullData.lodFirst[level] * sizeof(GLuint);
+			UQueueDraw(packet, prepass ? QUEUE_PASS_EQUAL : QUEUE_PASS_OPAQUE, cullData.lodNearest[level]);
+
+			if (prepass) {
+				UDrawPacket depthPacket = packet;
+				depthPacket.program = UVariantProgram(SHADER_DEPTH, UDrawFeatures());
+				depthPacket.texture = 0;
+				if (depthPacket.program != 0) {
+					UQueueDraw(depthPacket, QUEUE_PASS_DEPTH, cullData.lodNearest[level]);
+				}
+			}
+		}
+		UQueueImpostors();
+	}
+	{
+		UProfileScope drawScope("draw submit");
+		USubmitRenderQueue();
+	}
+
+	// The regions written this frame may be reused once the GPU has passed this point
+	UFenceDynamicBuffer(visibleStream);
+	UFenceDynamicBuffer(frameStream);
+	if (renderQueue.indirect) {
+		UFenceDynamicBuffer(indirectStream); // Only written when the queue was submitted indirectly
+	}
+
+	if (frameBudget > 0.0f) {
+		glQueryCounter(resolution.queries[resolutionSlot][1], GL_TIMESTAMP);
+		resolution.pending[resolutionSlot] = true;
+	}
+	resolution.frame++;
+	depthPrepass.frame++;
+
+	glBindVertexArray(0); // Deactivate the vertex array object
+	glUseProgram(shaderProgram); // Other passes expect the main program
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Replays the camera path offscreen and reports CPU and GPU frame times
+void URunBenchmark() {
+	vector<UCameraKey> path;
+	if (cameraPathFile.empty()) {
+		UScriptedCameraPath(benchmarkFrames, path);
+	}
+	else if (!ULoadCameraPath(cameraPathFile, path)) {
+		cout << "Failed to read camera path " << cameraPathFile << endl;
+		return;
+	}
+
+	// Render at the benchmark resolution instead of the window size
+	WindowWidth = benchmarkWidth;
+	WindowHeight = benchmarkHeight;
+	UCreateSceneTarget(WindowWidth, WindowHeight);
+	glViewport(0, 0, WindowWidth, WindowHeight);
+
+	// GPU times come back a few frames late so reading them never stalls the pipeline.
+	// Each frame is bracketed by two timestamps, which unlike GL_TIME_ELAPSED survive framebuffer switches on every driver
+	const int queryLatency = 4;
+	bool timerQueries = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+	GLuint queries[queryLatency][2];
+	if (timerQueries) {
+		glGenQueries(queryLatency * 2, queries[0]);
+	}
+
+	vector<double> cpuTimes, gpuTimes, scales;
+	double visibleTotal = 0.0; // Sum of the chairs left after culling, for the average
+	double levelTotals[LOD_LEVELS] = {}; // Same, per level of detail
+	UFinishTextureStreaming(); // Measure the steady state, not the placeholder
+	glFinish(); // Keep setup work out of the first frame
+
+	for (size_t frame = 0; frame < path.size(); frame++) {
+		int slot = frame % queryLatency;
+		if (timerQueries && frame >= (size_t)queryLatency) {
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+			gpuTimes.push_back((end - begin) / 1.0e6);
+		}
+
+		UApplyCameraKey(path[frame]);
+		UAcquireSnapshot();
+
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		if (timerQueries) {
+			glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+		}
+
+		UProfilerBeginFrame();
+		URenderScene();
+		UProfilerEndFrame();
+		visibleTotal += cullData.visible.size();
+		scales.push_back(resolution.scale);
+		for (int level = 0; level < LOD_LEVELS; level++) {
+			levelTotals[level] += cullData.lodCount[level];
+		}
+
+		if (timerQueries) {
+			glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+		}
+		cpuTimes.push_back(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+
+		if (!frameDumpPrefix.empty()) {
+			char fileName[512];
+			snprintf(fileName, sizeof(fileName), "%s%04d.png", frameDumpPrefix.c_str(), (int)frame);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1); // Rows of RGB pixels are not padded
+			SOIL_save_screenshot(fileName, SOIL_SAVE_TYPE_PNG, 0, 0, resolution.width, resolution.height); // As rendered, before upscaling
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		}
+	}
+
+	// Collect the queries still in flight
+	if (timerQueries) {
+		size_t pending = min(path.size(), (size_t)queryLatency);
+		for (size_t frame = path.size() - pending; frame < path.size(); frame++) {
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(queries[frame % queryLatency][0], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(queries[frame % queryLatency][1], GL_QUERY_RESULT, &end);
+			gpuTimes.push_back((end - begin) / 1.0e6);
+		}
+		glDeleteQueries(queryLatency * 2, queries[0]);
+	}
+
+	cout << "Benchmark: " << path.size() << " frames at " << WindowWidth << "x" << WindowHeight
+		<< ", " << chairInstances.size() << " chairs (" << visibleTotal / max((size_t)1, path.size()) << " visible on average), renderer "
+		<< glGetString(GL_RENDERER) << endl;
+	cout << "Shadow maps rendered " << shadowMaps.renders << " times" << endl;
+	cout << "Shader variants built:";
+	for (map<unsigned, UShaderVariant>::const_iterator variant = shaderVariants.begin(); variant != shaderVariants.end(); ++variant) {
+		cout << " " << variant->second.label;
+	}
+	cout << endl;
+	if (lightmap.ready) {
+		cout << "Lightmap baked " << lightmap.bakes << " times, the last in " << lightmap.bakeTime << " ms" << endl;
+	}
+	const URenderQueue& queue = renderQueue;
+	double submissions = max(queue.submissions, 1);
+	cout << "Render queue per frame: " << queue.totalPackets / submissions << " draws in " << queue.totalDrawCalls / submissions
+		<< (indirectDraws ? " multi-draw indirect calls" : " calls") << "; program, vertex array, texture binds "
+		<< queue.totalBinds[0] / submissions << ", " << queue.totalBinds[1] / submissions << ", " << queue.totalBinds[2] / submissions
+		<< "; redundant binds skipped " << queue.totalSkipped[0] / submissions << ", " << queue.totalSkipped[1] / submissions << ", "
+		<< queue.totalSkipped[2] / submissions << endl;
+	GLsizeiptr vertexBytes = 0, vertexCapacity = 0;
+	for (size_t i = 0; i < vertexFormats.size(); i++) {
+		vertexBytes += vertexFormats[i].vertices.used;
+		vertexCapacity += vertexFormats[i].vertices.capacity;
+	}
+	cout << "Buffer arenas: " << meshRanges.size() << " meshes in " << vertexFormats.size() << " vertex formats; vertices "
+		<< vertexBytes / 1024.0 << " of " << vertexCapacity / 1024 << " KB, indices " << indexArena.used / 1024.0 << " of "
+		<< indexArena.capacity / 1024 << " KB" << endl;
+	cout << "Depth pre-pass used in " << depthPrepass.frames << " of " << path.size() << " frames";
+	if (depthPrepass.measurements > 0) {
+		cout << ", mean overdraw " << depthPrepass.overdrawSum / depthPrepass.measurements << " over " << depthPrepass.measurements << " measurements";
+	}
+	cout << endl;
+	if (frameBudget > 0.0f && !scales.empty()) {
+		vector<double> sorted(scales);
+		sort(sorted.begin(), sorted.end());
+		double sum = 0.0;
+		for (size_t i = 0; i < sorted.size(); i++) {
+			sum += sorted[i];
+		}
+		cout << "Resolution scale for a " << frameBudget << " ms budget: min " << sorted.front() << "  mean " << sum / sorted.size()
+			<< "  max " << sorted.back() << "  final " << scales.back() << endl;
+	}
+	cout << "Levels of detail on average:";
+	for (int level = 0; level < LOD_LEVELS; level++) {
+		if (level < LOD_MESHES) {
+			cout << "  mesh " << level;
+		}
+		else {
+			cout << "  impostor";
+		}
+		cout << " " << levelTotals[level] / max((size_t)1, path.size());
+	}
+	cout << endl;
+	UReportTimings("CPU", cpuTimes);
+	UReportTimings("GPU", gpuTimes);
+
+	if (profilerEnabled) {
+		glFinish();
+		UCollectGpuQueries();
+		UExportProfile(profileOutput);
+	}
+
+	if (!benchmarkOutput.empty()) {
+		ofstream csv(benchmarkOutput.c_str());
+		csv << "frame,cpu_ms,gpu_ms,scale" << endl;
+		for (size_t frame = 0; frame < cpuTimes.size(); frame++) {
+			csv << frame << "," << cpuTimes[frame] << ",";
+			if (frame < gpuTimes.size()) {
+				csv << gpuTimes[frame];
+			}
+			csv << "," << scales[frame] << endl;
+		}
+	}
+}
+
+// Reads a camera path: one "yaw pitch scale perspective" line per frame, '#' starts a comment
+bool ULoadCameraPath(const string& fileName, vector<UCameraKey>& path) {
+	ifstream file(fileName.c_str());
+	if (!file) {
+		return false;
+	}
+
+	string line;
+	while (getline(file, line)) {
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		UCameraKey key;
+		int perspectiveFlag = 0;
+		if (fields >> key.yaw >> key.pitch >> key.scale >> perspectiveFlag) {
+			key.perspective = perspectiveFlag != 0;
+			path.push_back(key);
+		}
+	}
+
+	return !path.empty();
+}
+
+// Builds the default path: a full orbit that dips in pitch, zooms in and out and switches projection halfway
+void UScriptedCameraPath(int frames, vector<UCameraKey>& path) {
+	for (int frame = 0; frame < frames; frame++) {
+		GLfloat t = frame / (GLfloat)frames;
+		UCameraKey key;
+		key.yaw = t * 2.0f * 3.14159265f;
+		key.pitch = 0.4f * sin(t * 2.0f * 3.14159265f);
+		key.scale = 2.0f + 1.5f * sin(t * 4.0f * 3.14159265f);
+		key.perspective = t >= 0.5f;
+		path.push_back(key);
+	}
+}
+
+// Drives the camera state exactly as the mouse handlers would. The benchmark runs no simulation thread, so the
+// snapshot is published from here
+void UApplyCameraKey(const UCameraKey& key) {
+	yaw = key.yaw;
+	pitch = key.pitch;
+	scale_by_x = scale_by_y = scale_by_z = glm::max(key.scale, 0.2f); // Same zoom limit as USimulateMotion
+	perspective = key.perspective;
+	UUpdateCameraFront();
+	simulation.revision++;
+	UPublishSnapshot();
+}
+
+// Prints min, mean, percentiles and max of a set of frame times in milliseconds
+void UReportTimings(const char* label, vector<double> times) {
+	if (times.empty()) {
+		cout << label << ": no samples" << endl;
+		return;
+	}
+
+	sort(times.begin(), times.end());
+	double sum = 0.0;
+	for (size_t i = 0; i < times.size(); i++) {
+		sum += times[i];
+	}
+
+	struct Percentile {
+		static double Of(const vector<double>& sorted, double p) {
+			return sorted[(size_t)(p * (sorted.size() - 1) + 0.5)];
+		}
+	};
+
+	cout << label << " ms: min " << times.front() << "  mean " << sum / times.size()
+		<< "  p50 " << Percentile::Of(times, 0.50) << "  p90 " << Percentile::Of(times, 0.90)
+		<< "  p95 " << Percentile::Of(times, 0.95) << "  p99 " << Percentile::Of(times, 0.99)
+		<< "  max " << times.back() << endl;
+}
+
+// Builds the light list (the two original lights plus any --lights extras), uploads it and creates the cluster buffers
+void UCreateLights() {
+	sceneLights.clear();
+
+	// The original key light and the white second light never fall off within the scene
+	ULight light;
+	light.positionRange = glm::vec4(lightPosition, 1000.0f);
+	light.colorSpecular = glm::vec4(lightColor, lightStrength.y);
+	light.directionCosine = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+	light.params = glm::vec4(lightStrength.x, lightStrength.z, 1.0f, 0.0f);
+	sceneLights.push_back(light);
+
+	light.positionRange = glm::vec4(secondLightPosition, 1000.0f);
+	light.colorSpecular = glm::vec4(secondLightColor, 0.1f);
+	sceneLights.push_back(light);
+
+	// Extra lights hang over the floor; every other one is a downward spot light
+	unsigned seed = 12345;
+	struct Random {
+		static GLfloat Next(unsigned& state) {
+			state = state * 1664525u + 1013904223u; // Deterministic so benchmark runs are comparable
+			return (state >> 8) / 16777216.0f;
+		}
+	};
+	for (int i = 0; i < extraLightCount && sceneLights.size() < MAX_LIGHTS; i++) {
+		glm::vec3 position(Random::Next(seed) * 8.0f - 4.0f, 0.3f + Random::Next(seed) * 1.2f, Random::Next(seed) * 8.0f - 4.0f);
+		glm::vec3 color(0.1f + 0.3f * Random::Next(seed), 0.1f + 0.3f * Random::Next(seed), 0.1f + 0.3f * Random::Next(seed));
+		light.positionRange = glm::vec4(position, 1.0f + Random::Next(seed));
+		light.colorSpecular = glm::vec4(color, 0.5f);
+		light.params = glm::vec4(0.0f, lightStrength.z, cos(glm::radians(25.0f)), 0.0f);
+		light.directionCosine = i % 2 ? glm::vec4(0.0f, -1.0f, 0.0f, cos(glm::radians(35.0f))) : glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+		sceneLights.push_back(light);
+	}
+
+	// The block is always MAX_LIGHTS long; only the first sceneLights.size() entries are referenced
+	glGenBuffers(1, &lightUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
+	glBufferData(GL_UNIFORM_BUFFER, MAX_LIGHTS * sizeof(ULight), NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sceneLights.size() * sizeof(ULight), &sceneLights[0]);
+	glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_DATA_BINDING, lightUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// Cluster records and light indices are read in the fragment shader through texture buffers
+	glGenBuffers(1, &clusterRecordBuffer);
+	glGenBuffers(1, &clusterIndexBuffer);
+	glGenTextures(1, &clusterRecordTexture);
+	glGenTextures(1, &clusterIndexTexture);
+
+	glBindBuffer(GL_TEXTURE_BUFFER, clusterRecordBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, CLUSTER_X * CLUSTER_Y * CLUSTER_Z * 2 * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, clusterIndexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(GLushort), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_RECORD_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, clusterRecordTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, clusterRecordBuffer);
+	glActiveTexture(GL_TEXTURE0 + CLUSTER_INDEX_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, clusterIndexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R16UI, clusterIndexBuffer);
+	glActiveTexture(GL_TEXTURE0);
+
+	lightClusters.sliceIndices.resize(CLUSTER_Z);
+	lightClusters.sliceCounts.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+}
+
+// Assigns every light to the clusters its sphere of influence touches and uploads the lists
+void UBuildLightClusters(const glm::mat4& view, const glm::mat4& projection) {
+	ULightClusters& clusters = lightClusters;
+	if (clusters.boundsMin.empty() || projection != clusters.projection) {
+		UComputeClusterBounds(projection); // Only when the projection or aspect ratio changed
+	}
+
+	// View-space light spheres, padded to a multiple of four with spheres that never match
+	size_t padded = (sceneLights.size() + 3) & ~(size_t)3;
+	clusters.lightX.assign(padded, 0.0f);
+	clusters.lightY.assign(padded, 0.0f);
+	clusters.lightZ.assign(padded, 0.0f);
+	clusters.lightRadius2.assign(padded, -1.0f);
+	for (size_t i = 0; i < sceneLights.size(); i++) {
+		glm::vec4 center = view * glm::vec4(glm::vec3(sceneLights[i].positionRange), 1.0f);
+		GLfloat radius = sceneLights[i].positionRange.w;
+		clusters.lightX[i] = center.x;
+		clusters.lightY[i] = center.y;
+		clusters.lightZ[i] = center.z;
+		clusters.lightRadius2[i] = radius * radius;
+	}
+
+	// Depth slices are independent, so each one is a separate job for the workers
+	UParallelFor(CLUSTER_Z, UClusterSlice);
+
+	// Concatenate the per-slice lists into the upload buffers
+	size_t clusterCount = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+	clusters.records.resize(clusterCount * 2);
+	clusters.indices.clear();
+	size_t cluster = 0;
+	for (int slice = 0; slice < CLUSTER_Z; slice++) {
+		const vector<GLushort>& sliceIndices = clusters.sliceIndices[slice];
+		size_t sliceOffset = clusters.indices.size();
+		clusters.indices.insert(clusters.indices.end(), sliceIndices.begin(), sliceIndices.end());
+		for (int i = 0; i < CLUSTER_X * CLUSTER_Y; i++, cluster++) {
+			clusters.records[cluster * 2] = (GLuint)sliceOffset;
+			clusters.records[cluster * 2 + 1] = clusters.sliceCounts[cluster];
+			sliceOffset += clusters.sliceCounts[cluster];
+		}
+	}
+	if (clusters.indices.empty()) {
+		clusters.indices.push_back(0); // Texture buffers cannot be empty
+	}
+
+	// Orphan and refill both buffers so the upload never waits on the previous frame
+	glBindBuffer(GL_TEXTURE_BUFFER, clusterRecordBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, clusters.records.size() * sizeof(GLuint), &clusters.records[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, clusterIndexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, clusters.indices.size() * sizeof(GLushort), &clusters.indices[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// Computes the view-space bounding box of every cluster by unprojecting its screen tile at both slice depths
+void UComputeClusterBounds(const glm::mat4& projection) {
+	ULightClusters& clusters = lightClusters;
+	clusters.projection = projection;
+	clusters.boundsMin.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+	clusters.boundsMax.resize(CLUSTER_X * CLUSTER_Y * CLUSTER_Z);
+
+	glm::mat4 inverseProjection = glm::inverse(projection);
+	bool logarithmic = UCurrentSnapshot().perspective;
+
+	for (int z = 0; z < CLUSTER_Z; z++) {
+		GLfloat depths[2] = { USliceDepth(z, logarithmic), USliceDepth(z + 1, logarithmic) };
+		for (int y = 0; y < CLUSTER_Y; y++) {
+			for (int x = 0; x < CLUSTER_X; x++) {
+				glm::vec3 boundsMin(1e30f), boundsMax(-1e30f);
+				for (int corner = 0; corner < 4; corner++) {
+					GLfloat ndcX = -1.0f + 2.0f * (x + (corner & 1)) / CLUSTER_X;
+					GLfloat ndcY = -1.0f + 2.0f * (y + (corner >> 1)) / CLUSTER_Y;
+
+					// The ray through this tile corner, from the near plane to the far plane
+					glm::vec4 nearPoint = inverseProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+					glm::vec4 farPoint = inverseProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+					glm::vec3 rayStart = glm::vec3(nearPoint) / nearPoint.w;
+					glm::vec3 rayEnd = glm::vec3(farPoint) / farPoint.w;
+
+					for (int d = 0; d < 2; d++) {
+						GLfloat t = (-depths[d] - rayStart.z) / (rayEnd.z - rayStart.z);
+						glm::vec3 point = rayStart + (rayEnd - rayStart) * t;
+						boundsMin = glm::min(boundsMin, point);
+						boundsMax = glm::max(boundsMax, point);
+					}
+				}
+				size_t cluster = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+				clusters.boundsMin[cluster] = boundsMin;
+				clusters.boundsMax[cluster] = boundsMax;
+			}
+		}
+	}
+}
+
+// View depth where a slice starts; must match the slicing in the fragment shader's ClusterIndex
+GLfloat USliceDepth(int slice, bool logarithmic) {
+	GLfloat t = slice / (GLfloat)CLUSTER_Z;
+	return logarithmic ? nearPlane * pow(farPlane / nearPlane, t) : nearPlane + (farPlane - nearPlane) * t;
+}
+
+// Builds the light lists of one depth slice; runs on the worker threads
+void UClusterSlice(int slice) {
+	ULightClusters& clusters = lightClusters;
+	vector<GLushort>& indices = clusters.sliceIndices[slice];
+	indices.clear();
+
+	// Keep only the lights whose depth range overlaps the slice, gathered into aligned groups of four
+	size_t first = slice * CLUSTER_X * CLUSTER_Y;
+	GLfloat sliceNear = -clusters.boundsMax[first].z, sliceFar = -clusters.boundsMin[first].z;
+	GLfloat candidates[4][MAX_LIGHTS + 3];
+	GLushort candidateIds[MAX_LIGHTS];
+	size_t candidateCount = 0;
+	for (size_t i = 0; i < clusters.lightX.size(); i++) {
+		GLfloat radius = sqrt(glm::max(clusters.lightRadius2[i], 0.0f));
+		if (clusters.lightRadius2[i] >= 0.0f && -clusters.lightZ[i] + radius >= sliceNear && -clusters.lightZ[i] - radius <= sliceFar) {
+			candidates[0][candidateCount] = clusters.lightX[i];
+			candidates[1][candidateCount] = clusters.lightY[i];
+			candidates[2][candidateCount] = clusters.lightZ[i];
+			candidates[3][candidateCount] = clusters.lightRadius2[i];
+			candidateIds[candidateCount++] = (GLushort)i;
+		}
+	}
+	size_t groups = (candidateCount + 3) / 4;
+	for (size_t i = candidateCount; i < groups * 4; i++) {
+		candidates[0][i] = candidates[1][i] = candidates[2][i] = 0.0f;
+		candidates[3][i] = -1.0f; // Padding never matches
+	}
+
+	for (int tile = 0; tile < CLUSTER_X * CLUSTER_Y; tile++) {
+		size_t cluster = first + tile;
+		const glm::vec3& boxMin = clusters.boundsMin[cluster];
+		const glm::vec3& boxMax = clusters.boundsMax[cluster];
+		GLuint count = 0;
+
+		// Sphere versus box: squared distance from the sphere center to the box, four lights at a time
+		for (size_t group = 0; group < groups; group++) {
+			int mask = 0;
+#ifdef USE_SSE2
+			__m128 zero = _mm_setzero_ps();
+			__m128 distance2 = zero;
+			for (int axis = 0; axis < 3; axis++) {
+				__m128 center = _mm_loadu_ps(&candidates[axis][group * 4]);
+				__m128 below = _mm_sub_ps(_mm_set1_ps(boxMin[axis]), center);
+				__m128 above = _mm_sub_ps(center, _mm_set1_ps(boxMax[axis]));
+				__m128 outside = _mm_max_ps(_mm_max_ps(below, above), zero);
+				distance2 = _mm_add_ps(distance2, _mm_mul_ps(outside, outside));
+			}
+			mask = _mm_movemask_ps(_mm_cmple_ps(distance2, _mm_loadu_ps(&candidates[3][group * 4])));
+#else
+			for (int lane = 0; lane < 4; lane++) {
+				GLfloat distance2 = 0.0f;
+				for (int axis = 0; axis < 3; axis++) {
+					GLfloat center = candidates[axis][group * 4 + lane];
+					GLfloat outside = glm::max(glm::max(boxMin[axis] - center, center - boxMax[axis]), 0.0f);
+					distance2 += outside * outside;
+				}
+				mask |= distance2 <= candidates[3][group * 4 + lane] ? 1 << lane : 0;
+			}
+#endif
+			for (int lane = 0; lane < 4; lane++) {
+				if (mask & (1 << lane)) {
+					indices.push_back(candidateIds[group * 4 + lane]);
+					count++;
+				}
+			}
+		}
+		clusters.sliceCounts[cluster] = count;
+	}
+}
+
+// Starts one worker per extra hardware thread; the calling thread works too
+void UStartWorkers() {
+	unsigned hardwareThreads = thread::hardware_concurrency();
+	workerPool.job = NULL;
+	workerPool.itemCount = 0;
+	workerPool.nextItem = 0;
+	workerPool.busyWorkers = 0;
+	workerPool.generation = 0;
+	workerPool.quit = false;
+	workerPool.backgroundCount = 0;
+	workerPool.nextBackground = 0;
+	workerPool.backgroundDone = 0;
+	for (unsigned i = 1; i < hardwareThreads; i++) {
+		workerPool.threads.push_back(thread(UWorkerLoop));
+	}
+}
+
+// Wakes the workers for shutdown and waits for them to exit
+void UStopWorkers() {
+	{
+		lock_guard<mutex> guard(workerPool.lock);
+		workerPool.quit = true;
+	}
+	workerPool.wake.notify_all();
+	for (size_t i = 0; i < workerPool.threads.size(); i++) {
+		workerPool.threads[i].join();
+	}
+	workerPool.threads.clear();
+}
+
+// Body of a worker thread: waits for a job, takes items until none are left, reports back. Between jobs it works on
+// background items one at a time, so a new job waits for at most one of them
+void UWorkerLoop() {
+	unsigned seenGeneration = 0;
+	for (;;) {
+		unique_lock<mutex> guard(workerPool.lock);
+		while (!workerPool.quit && workerPool.generation == seenGeneration && workerPool.nextBackground >= workerPool.backgroundCount) {
+			workerPool.wake.wait(guard);
+		}
+		if (workerPool.quit) {
+			return;
+		}
+		if (workerPool.generation == seenGeneration) {
+			int item = workerPool.nextBackground++;
+			int count = workerPool.backgroundCount;
+			guard.unlock();
+			workerPool.backgroundJob(item);
+			if (++workerPool.backgroundDone == count) {
+				guard.lock();
+				workerPool.finished.notify_all();
+			}
+			continue;
+		}
+
+		// A worker busy with a background item joins late and may find every item taken
+		seenGeneration = workerPool.generation;
+		const function<void(int)>& job = *workerPool.job;
+		int itemCount = workerPool.itemCount;
+		workerPool.busyWorkers++;
+		guard.unlock();
+
+		for (int item = workerPool.nextItem++; item < itemCount; item = workerPool.nextItem++) {
+			job(item);
+		}
+
+		guard.lock();
+		if (--workerPool.busyWorkers == 0) {
+			workerPool.finished.notify_all();
+		}
+	}
+}
+
+// Runs job(0) .. job(count - 1) across the workers and the calling thread, returning when all are done. Only the
+// workers that joined are waited for, so one busy with a background item does not hold the caller up
+void UParallelFor(int count, const function<void(int)>& job) {
+	if (workerPool.threads.empty()) {
+		for (int item = 0; item < count; item++) {
+			job(item);
+		}
+		return;
+	}
+
+	{
+		unique_lock<mutex> guard(workerPool.lock);
+		while (workerPool.busyWorkers > 0) {
+			workerPool.finished.wait(guard); // Workers that joined the previous job late are still leaving it
+		}
+		workerPool.job = &job;
+		workerPool.itemCount = count;
+		workerPool.nextItem = 0;
+		workerPool.generation++;
+	}
+	workerPool.wake.notify_all();
+
+	for (int item = workerPool.nextItem++; item < count; item = workerPool.nextItem++) {
+		job(item);
+	}
+
+	unique_lock<mutex> guard(workerPool.lock);
+	while (workerPool.busyWorkers > 0) {
+		workerPool.finished.wait(guard);
+	}
+}
+
+// Hands job(0) .. job(count - 1) to the workers to run in the background and returns at once. Only one background
+// job runs at a time; the previous one has to be done
+void UStartBackground(int count, const function<void(int)>& job) {
+	{
+		lock_guard<mutex> guard(workerPool.lock);
+		workerPool.backgroundJob = job;
+		workerPool.backgroundCount = count;
+		workerPool.nextBackground = 0;
+		workerPool.backgroundDone = 0;
+	}
+	workerPool.wake.notify_all();
+}
+
+// Runs background items on the calling thread for about the given time, or until none are left to hand out when it
+// is negative. Without workers this is the only way they get done. Returns whether the job is done
+bool URunBackground(double milliseconds) {
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (;;) {
+		int item;
+		{
+			lock_guard<mutex> guard(workerPool.lock);
+			if (workerPool.nextBackground >= workerPool.backgroundCount) {
+				break;
+			}
+			item = workerPool.nextBackground++;
+		}
+		workerPool.backgroundJob(item);
+		workerPool.backgroundDone++;
+		if (milliseconds >= 0.0 && chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() >= milliseconds) {
+			break;
+		}
+	}
+	return UBackgroundDone();
+}
+
+// Whether every item of the background job has finished
+bool UBackgroundDone() {
+	return workerPool.backgroundDone == workerPool.backgroundCount;
+}
+
+// Helps with the background job and waits until the workers have finished their last items too
+void UFinishBackground() {
+	URunBackground(-1.0);
+	unique_lock<mutex> guard(workerPool.lock);
+	while (!UBackgroundDone()) {
+		workerPool.finished.wait(guard);
+	}
+}
+
+// Starts recording scopes for a frame and reads back GPU timings that have become available
+void UProfilerBeginFrame() {
+	if (!profilerEnabled) {
+		return;
+	}
+
+	UCollectGpuQueries();
+
+	// Results the GPU still has not produced after GPU_QUERY_FRAMES frames are dropped rather than waited for
+	gpuQueryFrames[profileFrame % GPU_QUERY_FRAMES].used = 0;
+	profileFrameActive = true;
+}
+
+// Stops recording scopes for the current frame
+void UProfilerEndFrame() {
+	if (!profileFrameActive) {
+		return;
+	}
+	profileFrameActive = false;
+	profileFrame++;
+}
+
+// Reads every finished frame of GPU queries without blocking
+void UCollectGpuQueries() {
+	for (int slot = 0; slot < GPU_QUERY_FRAMES; slot++) {
+		UGpuQueryFrame& frame = gpuQueryFrames[slot];
+		if (frame.used == 0) {
+			continue;
+		}
+
+		// Timestamps complete in order, so the last one tells whether the whole frame is ready
+		GLint available = 0;
+		glGetQueryObjectiv(frame.queries[frame.used * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			continue;
+		}
+
+		for (size_t i = 0; i < frame.used; i++) {
+			GLuint64 begin = 0, end = 0;
+			glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &begin);
+			glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+			URecordSample(gpuProfile[frame.names[i]], (end - begin) / 1.0e6);
+		}
+		frame.used = 0;
+	}
+}
+
+UProfileScope::UProfileScope(const char* scopeName) : name(scopeName), start(chrono::high_resolution_clock::now()) {
+}
+
+UProfileScope::~UProfileScope() {
+	if (profileFrameActive) {
+		URecordSample(cpuProfile[name], chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+	}
+}
+
+UGpuProfileScope::UGpuProfileScope(const char* scopeName) : endQuery(0) {
+	if (!profileFrameActive || !timerQueriesSupported) {
+		return;
+	}
+
+	// Query objects are created on demand and reused by later frames in the same slot
+	UGpuQueryFrame& frame = gpuQueryFrames[profileFrame % GPU_QUERY_FRAMES];
+	if (frame.used * 2 == frame.queries.size()) {
+		GLuint pair[2];
+		glGenQueries(2, pair);
+		frame.queries.push_back(pair[0]);
+		frame.queries.push_back(pair[1]);
+		frame.names.push_back(string());
+	}
+	frame.names[frame.used] = scopeName;
+	glQueryCounter(frame.queries[frame.used * 2], GL_TIMESTAMP);
+	endQuery = frame.queries[frame.used * 2 + 1];
+	frame.used++;
+}
+
+UGpuProfileScope::~UGpuProfileScope() {
+	if (endQuery != 0) {
+		glQueryCounter(endQuery, GL_TIMESTAMP);
+	}
+}
+
+// Adds a sample to a scope's rolling window
+void URecordSample(UProfileStat& stat, double milliseconds) {
+	if (stat.samples.size() < PROFILE_HISTORY) {
+		stat.samples.push_back(milliseconds);
+	}
+	else {
+		stat.samples[stat.next] = milliseconds;
+	}
+	stat.next = (stat.next + 1) % PROFILE_HISTORY;
+	stat.last = milliseconds;
+}
+
+// Computes minimum, average and 99th percentile over a scope's rolling window
+void UProfileSummary(const UProfileStat& stat, double& minimum, double& average, double& p99) {
+	minimum = average = p99 = 0.0;
+	if (stat.samples.empty()) {
+		return;
+	}
+
+	vector<double> sorted(stat.samples);
+	sort(sorted.begin(), sorted.end());
+	for (size_t i = 0; i < sorted.size(); i++) {
+		average += sorted[i];
+	}
+	minimum = sorted.front();
+	average /= sorted.size();
+	p99 = sorted[(size_t)(0.99 * (sorted.size() - 1) + 0.5)];
+}
+
+// Draws the rolling statistics as bitmap text over the presented frame
+void UDrawProfileOverlay() {
+	vector<string> lines;
+	lines.push_back("scope               last     min     avg     p99  (ms)");
+
+	for (int gpu = 0; gpu < 2; gpu++) {
+		const map<string, UProfileStat>& profile = gpu ? gpuProfile : cpuProfile;
+		for (map<string, UProfileStat>::const_iterator it = profile.begin(); it != profile.end(); ++it) {
+			double minimum, average, p99;
+			UProfileSummary(it->second, minimum, average, p99);
+			char line[128];
+			snprintf(line, sizeof(line), "%s %-14.14s %7.3f %7.3f %7.3f %7.3f", gpu ? "gpu" : "cpu",
+				it->first.c_str(), it->second.last, minimum, average, p99);
+			lines.push_back(line);
+		}
+	}
+
+	char queueLine[128];
+	snprintf(queueLine, sizeof(queueLine), "queue %u draws in %u %s  binds %u/%u/%u  skipped %u/%u/%u (program/vao/texture)",
+		(unsigned)renderQueue.packets.size(), renderQueue.drawCalls, renderQueue.indirect ? "indirect calls" : "calls", renderQueue.binds[0], renderQueue.binds[1], renderQueue.binds[2],
+		renderQueue.skipped[0], renderQueue.skipped[1], renderQueue.skipped[2]);
+	lines.push_back(queueLine);
+
+	if (!benchmarkMode) {
+		char latencyLine[128];
+		snprintf(latencyLine, sizeof(latencyLine), "latency %.1f ms  avg %.1f  p99 %.0f  frames in flight %s  waited %.2f ms",
+			latency.last, latency.samples ? latency.total / latency.samples : 0.0, ULatencyPercentile(0.99),
+			framesInFlight == 1 ? "1" : framesInFlight == 2 ? "2" : "driver", latency.waited);
+		lines.push_back(latencyLine);
+	}
+
+	char prepassLine[128];
+	snprintf(prepassLine, sizeof(prepassLine), "depth pre-pass %s%s  overdraw %.2f (threshold %.2f)", depthPrepass.active ? "on" : "off",
+		prepassMode == PREPASS_AUTO ? " (auto)" : "", depthPrepass.overdraw, overdrawThreshold);
+	lines.push_back(prepassLine);
+
+	if (frameBudget > 0.0f) {
+		double minimum, average, p99;
+		UProfileSummary(resolution.history, minimum, average, p99);
+		char line[128];
+		snprintf(line, sizeof(line), "resolution %4.0f%% (%dx%d)  min %3.0f%%  avg %3.0f%%  scene %.2f of %.2f ms",
+			resolution.scale * 100.0f, resolution.width, resolution.height, minimum, average, resolution.lastTime, frameBudget);
+		lines.push_back(line);
+	}
+
+	// Bitmap text goes through the fixed-function path: no program and no depth test
+	glUseProgram(0);
+	glDisable(GL_DEPTH_TEST);
+	glColor3f(1.0f, 1.0f, 0.0f);
+	for (size_t i = 0; i < lines.size(); i++) {
+		glWindowPos2i(10, WindowHeight - 20 - 15 * (GLint)i);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char*)lines[i].c_str());
+	}
+	glEnable(GL_DEPTH_TEST);
+	glUseProgram(shaderProgram);
+}
+
+// Writes the rolling statistics of every scope as JSON (for .json files) or CSV
+void UExportProfile(const string& fileName) {
+	ofstream file(fileName.c_str());
+	if (!file) {
+		cout << "Failed to write profile " << fileName << endl;
+		return;
+	}
+
+	bool json = fileName.size() >= 5 && fileName.compare(fileName.size() - 5, 5, ".json") == 0;
+	file << (json ? "{\n  \"frames\": " : "scope,type,last_ms,min_ms,avg_ms,p99_ms,samples\n");
+	if (json) {
+		file << profileFrame << ",\n  \"scopes\": [";
+	}
+
+	bool first = true;
+	for (int gpu = 0; gpu < 2; gpu++) {
+		const map<string, UProfileStat>& profile = gpu ? gpuProfile : cpuProfile;
+		for (map<string, UProfileStat>::const_iterator it = profile.begin(); it != profile.end(); ++it) {
+			double minimum, average, p99;
+			UProfileSummary(it->second, minimum, average, p99);
+			if (json) {
+				file << (first ? "\n" : ",\n") << "    {\"scope\": \"" << it->first << "\", \"type\": \"" << (gpu ? "gpu" : "cpu")
+					<< "\", \"last_ms\": " << it->second.last << ", \"min_ms\": " << minimum << ", \"avg_ms\": " << average
+					<< ", \"p99_ms\": " << p99 << ", \"samples\": " << it->second.samples.size() << "}";
+			}
+			else {
+				file << it->first << "," << (gpu ? "gpu" : "cpu") << "," << it->second.last << "," << minimum << ","
+					<< average << "," << p99 << "," << it->second.samples.size() << "\n";
+			}
+			first = false;
+		}
+	}
+
+	if (json) {
+		file << "\n  ]\n}\n";
+	}
+	cout << "Profile written to " << fileName << endl;
+}
+
+// Implements the keyboard function: p toggles the profiler overlay, e exports the profile and latency histogram
+void UKeyboard(unsigned char key, int, int) {
+	if (key == 'p' || key == 'P') {
+		profilerEnabled = !profilerEnabled;
+		UMarkDirty();
+	}
+	else if (key == 'e' || key == 'E') {
+		UExportProfile(profileOutput);
+		UExportLatency(latencyOutput);
+	}
+}
+
+// Exports the profile and latency histogram when the window closes while profiling, then deletes the GL objects; once
+// glutMainLoop returns, the window and its context are gone
+void UCloseWindow() {
+	if (profilerEnabled) {
+		UExportProfile(profileOutput);
+		UExportLatency(latencyOutput);
+	}
+	UDeleteGraphics();
+}
+
+// Builds the programs that have no variants; the lit chair and impostor programs come from UCreateVariants
+bool UCreateShader() {
+
+	// Far chairs are drawn as impostors, baked with a program of their own, from the binary cache when possible
+	impostorBakeProgram = UBuildProgram("impostor bake", vector<const char*>(1, impostorBakeVertexShaderSource),
+		vector<const char*>(1, impostorBakeFragmentShaderSource));
+	if (impostorBakeProgram == 0) {
+		return false;
+	}
+	UReflectProgram(impostorBakeProgram, impostorBakeProgramInfo);
+
+	// Depth-only pass filling the shadow cube maps
+	shadowProgram = UBuildProgram("shadow", vector<const char*>(1, shadowVertexShaderSource),
+		vector<const char*>(1, shadowFragmentShaderSource));
+	if (shadowProgram == 0) {
+		return false;
+	}
+	UReflectProgram(shadowProgram, shadowProgramInfo);
+	return true;
+}
+
+// Compiles, in parallel, the variants the first frames will draw with and makes the textured chair the main program.
+// Runs once the lights, shadow maps and lightmap exist, since they decide the features
+bool UCreateVariants() {
+	bool anySpecular = false;
+	for (size_t i = 0; i < sceneLights.size(); i++) {
+		anySpecular = anySpecular || sceneLights[i].colorSpecular.a > 0.0f;
+	}
+	specularEnabled = specularEnabled && anySpecular;
+
+	// The chair is drawn untextured until its texture has streamed in
+	unsigned features = UDrawFeatures();
+	vector<unsigned> keys;
+	keys.push_back(UVariantKey(SHADER_LIGHT, features | VARIANT_TEXTURED));
+	keys.push_back(UVariantKey(SHADER_LIGHT, features));
+	if (lightmap.ready) {
+		keys.push_back(UVariantKey(SHADER_LIGHT, features | VARIANT_TEXTURED | VARIANT_LIGHTMAP));
+		keys.push_back(UVariantKey(SHADER_LIGHT, features | VARIANT_LIGHTMAP));
+	}
+	if (lodEnabled) {
+		keys.push_back(UVariantKey(SHADER_IMPOSTOR, features));
+	}
+	if (prepassMode != PREPASS_OFF) {
+		keys.push_back(UVariantKey(SHADER_DEPTH, features));
+	}
+	if (!UPrecompileVariants(keys)) {
+		return false;
+	}
+
+	shaderProgram = shaderVariants[keys[0]].info.program; // Other passes restore the main program when they are done
+	variantsConfigured = true;
+	for (map<unsigned, UShaderVariant>::iterator variant = shaderVariants.begin(); variant != shaderVariants.end(); ++variant) {
+		UConfigureVariant(variant->second);
+	}
+	return true;
+}
+
+// Features every lit draw of this run has, before the per-draw texture and lightmap choices
+unsigned UDrawFeatures() {
+	unsigned features = 0;
+	if (showroomCount > 0) {
+		features |= VARIANT_INSTANCED; // The single chair needs no instance lookup
+	}
+	if (specularEnabled) {
+		features |= VARIANT_SPECULAR;
+	}
+	if (shadowSize > 0) {
+		features |= VARIANT_SHADOWS;
+	}
+	return features;
+}
+
+// Key of the variant for a shader and feature set. Features that make no difference are dropped, so equal programs
+// share one key: the lightmap replaces every light, and small scenes shade their lights without clusters
+unsigned UVariantKey(int shader, unsigned features) {
+	if (shader == SHADER_DEPTH) {
+		return ((unsigned)shader << 16) | (features & VARIANT_INSTANCED); // Nothing is shaded
+	}
+	unsigned lights = (unsigned)min(sceneLights.size(), (size_t)MAX_LIGHTS);
+	if (features & VARIANT_LIGHTMAP) {
+		features &= ~(VARIANT_SPECULAR | VARIANT_SHADOWS | VARIANT_CLUSTERED);
+		lights = 0;
+	}
+	else if (lights > DIRECT_LIGHT_LIMIT) {
+		features |= VARIANT_CLUSTERED;
+		lights = 0;
+	}
+	return ((unsigned)shader << 16) | (lights << 8) | features;
+}
+
+// Returns the variant for a shader and feature set, building it the first time it is asked for
+UShaderVariant& UShaderFor(int shader, unsigned features) {
+	unsigned key = UVariantKey(shader, features);
+	map<unsigned, UShaderVariant>::iterator found = shaderVariants.find(key);
+	if (found != shaderVariants.end()) {
+		return found->second;
+	}
+	UShaderVariant& variant = shaderVariants[key];
+	UPendingProgram pending = UBeginVariant(variant, key);
+	UFinishVariant(variant, pending);
+	return variant;
+}
+
+// Program of a variant, or 0 if the variant failed to build. The scene transform reaches it through FrameData, so
+// nothing has to be set on the program outside the render queue
+GLuint UVariantProgram(int shader, unsigned features) {
+	return UShaderFor(shader, features).info.program;
+}
+
+// Starts every variant in keys that is not built yet, then waits for them; returns false if any failed
+bool UPrecompileVariants(const vector<unsigned>& keys) {
+	if (GLEW_ARB_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsARB(0xffffffff); // Let the driver compile on as many threads as it likes
+	}
+
+	vector<unsigned> started;
+	vector<UPendingProgram> pending;
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (shaderVariants.count(keys[i]) == 0) {
+			started.push_back(keys[i]);
+			pending.push_back(UBeginVariant(shaderVariants[keys[i]], keys[i]));
+		}
+	}
+
+	bool built = true;
+	for (size_t i = 0; i < started.size(); i++) {
+		built = UFinishVariant(shaderVariants[started[i]], pending[i]) && built;
+	}
+	return built;
+}
+
+// Sets up a variant's defines and starts building it
+UPendingProgram UBeginVariant(UShaderVariant& variant, unsigned key) {
+	static const char* featureNames[VARIANT_FEATURES] = { "INSTANCED", "TEXTURED", "SPECULAR", "SHADOWS", "LIGHTMAP", "CLUSTERED" };
+	int shader = (int)(key >> 16);
+	variant.key = key;
+	variant.info.program = 0;
+
+	ostringstream defines, label;
+	defines << "#version 330\n";
+	label << (shader == SHADER_IMPOSTOR ? "impostor" : shader == SHADER_DEPTH ? "depth" : "light") << " [";
+	for (int feature = 0; feature < VARIANT_FEATURES; feature++) {
+		bool enabled = (key & (1u << feature)) != 0;
+		defines << "#define " << featureNames[feature] << " " << (enabled ? 1 : 0) << "\n";
+		if (enabled) {
+			label << (label.str().back() == '[' ? "" : " ") << featureNames[feature];
+		}
+	}
+	defines << "#define LIGHT_COUNT " << ((key >> 8) & 0xff) << "\n";
+	if ((key >> 8) & 0xff) {
+		label << (label.str().back() == '[' ? "" : " ") << ((key >> 8) & 0xff) << " LIGHTS";
+	}
+	label << "]";
+	variant.defines = defines.str();
+	variant.label = label.str();
+
+	vector<const char*> vertexSources(1, variant.defines.c_str()), fragmentSources(1, variant.defines.c_str());
+	vertexSources.push_back(frameDataShaderSource);
+	fragmentSources.push_back(frameDataShaderSource);
+	vertexSources.push_back(shader == SHADER_IMPOSTOR ? impostorVertexShaderSource : lightVertexShaderSource);
+	if (shader == SHADER_DEPTH) {
+		fragmentSources.push_back(depthFragmentShaderSource);
+	}
+	else {
+		fragmentSources.push_back(lightingShaderSource);
+		fragmentSources.push_back(shader == SHADER_IMPOSTOR ? impostorFragmentShaderSource : lightFragmentShaderSource);
+	}
+	return UBeginProgram(variant.label.c_str(), vertexSources, fragmentSources);
+}
+
+// Waits for a variant's program and resolves its uniforms
+bool UFinishVariant(UShaderVariant& variant, UPendingProgram& pending) {
+	GLuint program = UFinishProgram(pending);
+	if (program == 0) {
+		return false;
+	}
+	UReflectProgram(program, variant.info);
+	UBindFrameBlocks(variant.info);
+	if (variantsConfigured) {
+		UConfigureVariant(variant);
+	}
+	return true;
+}
+
+// Points a variant's samplers at their units and sets the uniforms that stay constant for the run
+void UConfigureVariant(UShaderVariant& variant) {
+	const UProgramInfo& info = variant.info;
+	if (info.program == 0) {
+		return;
+	}
+	glUseProgram(info.program);
+	glUniform1i(info.textureLoc, 0); // Sample the texture bound to unit 0
+	glUniform1i(UUniformLocation(info, "clusterRecords"), CLUSTER_RECORD_UNIT);
+	glUniform1i(UUniformLocation(info, "clusterIndices"), CLUSTER_INDEX_UNIT);
+	glUniform1i(UUniformLocation(info, "instanceData"), INSTANCE_DATA_UNIT);
+	glUniform1i(UUniformLocation(info, "impostorAlbedo"), IMPOSTOR_ALBEDO_UNIT);
+	glUniform1i(UUniformLocation(info, "impostorNormals"), IMPOSTOR_NORMAL_UNIT);
+	glUniform4fv(UUniformLocation(info, "impostorBounds"), 1, glm::value_ptr(lodData.bounds));
+	glUniform3f(UUniformLocation(info, "surfaceColor"), 128.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f); // The placeholder's grey
+	glUniform1i(UUniformLocation(info, "lightmap"), LIGHTMAP_UNIT);
+	USetPositionUniforms(info);
+	if (lightmap.ready) {
+		glUniform4f(UUniformLocation(info, "lightmapLayout"), (GLfloat)lightmap.tilesAcross,
+			(GLfloat)lightmapSize / lightmap.width, (GLfloat)lightmapSize / lightmap.height, 0.0f);
+	}
+	USetShadowUniforms(info);
+	glUseProgram(shaderProgram);
+}
+
+// Attaches a program's FrameData and LightData blocks, if it uses them, to the shared binding points
+void UBindFrameBlocks(const UProgramInfo& info) {
+	map<string, GLuint>::const_iterator block = info.blocks.find("FrameData");
+	if (block != info.blocks.end()) {
+		glUniformBlockBinding(info.program, block->second, FRAME_DATA_BINDING);
+	}
+	block = info.blocks.find("LightData");
+	if (block != info.blocks.end()) {
+		glUniformBlockBinding(info.program, block->second, LIGHT_DATA_BINDING);
+	}
+}
+
+// Returns a linked program for the sources, loading the cached binary when its key matches and compiling otherwise
+GLuint UBuildProgram(const char* label, const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources) {
+	UPendingProgram pending = UBeginProgram(label, vertexSources, fragmentSources);
+	return UFinishProgram(pending);
+}
+
+// Loads the cached binary when its key matches, or issues the compiles and the link without waiting for their results
+UPendingProgram UBeginProgram(const char* label, const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources) {
+	UPendingProgram pending;
+	pending.label = label;
+	pending.vertexShader = pending.fragmentShader = 0;
+	pending.key = UProgramKey(vertexSources, fragmentSources);
+	pending.start = chrono::high_resolution_clock::now();
+	char keyText[17];
+	snprintf(keyText, sizeof(keyText), "%016llx", pending.key);
+	string cacheFileName = programCachePrefix + keyText + ".bin";
+
+	// Try the cache first; any mismatch or driver rejection falls through to a full compile
+	if (!programCachePrefix.empty() && UProgramBinarySupported()) {
+		ifstream in(cacheFileName.c_str(), ios::binary);
+		UProgramCacheHeader header;
+		if (in.read((char*)&header, sizeof(header)) && memcmp(header.magic, PROGRAM_CACHE_MAGIC, 4) == 0
+			&& header.version == PROGRAM_CACHE_VERSION && header.keyLow == (GLuint)pending.key && header.keyHigh == (GLuint)(pending.key >> 32)) {
+			vector<char> binary(header.length);
+			if (header.length > 0 && in.read(&binary[0], header.length)) {
+				pending.program = glCreateProgram();
+				glProgramBinary(pending.program, header.format, &binary[0], header.length);
+				GLint linked = GL_FALSE;
+				glGetProgramiv(pending.program, GL_LINK_STATUS, &linked);
+				if (linked) {
+					cout << "Shader " << label << ": loaded " << cacheFileName << " in "
+						<< chrono::duration<double, milli>(chrono::high_resolution_clock::now() - pending.start).count() << " ms" << endl;
+					return pending;
+				}
+				cout << "Shader " << label << ": driver rejected " << cacheFileName << ", recompiling" << endl;
+				glDeleteProgram(pending.program);
+			}
+		}
+	}
+
+	//Vertex and fragment shaders
+	pending.vertexShader = UCompileShader(GL_VERTEX_SHADER, vertexSources);
+	pending.fragmentShader = UCompileShader(GL_FRAGMENT_SHADER, fragmentSources);
+
+	// Shader Program
+	pending.program = glCreateProgram(); // Creates the shader program and returns an id
+	glAttachShader(pending.program, pending.vertexShader); // Attach vertex shader to the shader program
+	glAttachShader(pending.program, pending.fragmentShader); // Attach fragment shader to the shader program
+	if (!programCachePrefix.empty() && UProgramBinarySupported()) {
+		glProgramParameteri(pending.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE); // Ask the driver to keep the binary around
+	}
+	glLinkProgram(pending.program); // Link vertex and fragment shader to shader program
+	return pending;
+}
+
+// Waits for a program started by UBeginProgram and checks it; returns 0 on failure. A compiled program is saved to the
+// binary cache
+GLuint UFinishProgram(UPendingProgram& pending) {
+	if (pending.vertexShader == 0) {
+		return pending.program; // Loaded from the cache
+	}
+
+	// Querying the status is what waits for the compiler
+	bool compiled = UCheckShader(pending.label.c_str(), GL_VERTEX_SHADER, pending.vertexShader);
+	compiled = UCheckShader(pending.label.c_str(), GL_FRAGMENT_SHADER, pending.fragmentShader) && compiled;
+	bool linked = compiled && UCheckProgram(pending.label.c_str(), pending.program);
+
+	// Delete the vertex and fragment shaders once linked
+	glDeleteShader(pending.vertexShader);
+	glDeleteShader(pending.fragmentShader);
+	if (!linked) {
+		glDeleteProgram(pending.program);
+		return 0;
+	}
+	cout << "Shader " << pending.label << ": compiled and linked in "
+		<< chrono::duration<double, milli>(chrono::high_resolution_clock::now() - pending.start).count() << " ms" << endl;
+
+	// Save the binary for the next launch; failing to write only costs the next launch a compile
+	if (!programCachePrefix.empty() && UProgramBinarySupported()) {
+		GLint length = 0;
+		glGetProgramiv(pending.program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length > 0) {
+			vector<char> binary(length);
+			GLenum format = 0;
+			glGetProgramBinary(pending.program, length, &length, &format, &binary[0]);
+
+			UProgramCacheHeader header;
+			memcpy(header.magic, PROGRAM_CACHE_MAGIC, 4);
+			header.version = PROGRAM_CACHE_VERSION;
+			header.keyLow = (GLuint)pending.key;
+			header.keyHigh = (GLuint)(pending.key >> 32);
+			header.format = format;
+			header.length = (GLuint)length;
+
+			char keyText[17];
+			snprintf(keyText, sizeof(keyText), "%016llx", pending.key);
+			string cacheFileName = programCachePrefix + keyText + ".bin";
+			ofstream out(cacheFileName.c_str(), ios::binary);
+			out.write((const char*)&header, sizeof(header));
+			out.write(&binary[0], length);
+			if (!out) {
+				cout << "Failed to write " << cacheFileName << endl;
+			}
+		}
+	}
+	return pending.program;
+}
+
+// Creates and compiles one shader stage from its concatenated sources; UCheckShader reads the result
+GLuint UCompileShader(GLenum type, const vector<const char*>& sources) {
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, (GLsizei)sources.size(), &sources[0], NULL);
+	glCompileShader(shader);
+	return shader;
+}
+
+// Checks the compile status of a shader stage, printing the info log on failure or when the compiler has warnings
+bool UCheckShader(const char* label, GLenum type, GLuint shader) {
+	GLint compiled = GL_FALSE, logLength = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+	const char* stage = type == GL_VERTEX_SHADER ? "vertex" : "fragment";
+	if (logLength > 1) {
+		string log(logLength, '\0');
+		glGetShaderInfoLog(shader, logLength, NULL, &log[0]);
+		cout << "Shader " << label << " (" << stage << ") " << (compiled ? "warnings" : "failed to compile") << ":\n" << log.c_str() << endl;
+	}
+	else if (!compiled) {
+		cout << "Shader " << label << " (" << stage << ") failed to compile" << endl;
+	}
+	return compiled == GL_TRUE;
+}
+
+// Checks the link status of a program, printing the info log on failure or when the linker has warnings
+bool UCheckProgram(const char* label, GLuint program) {
+	GLint linked = GL_FALSE, logLength = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+	if (logLength > 1) {
+		string log(logLength, '\0');
+		glGetProgramInfoLog(program, logLength, NULL, &log[0]);
+		cout << "Shader " << label << " " << (linked ? "link warnings" : "failed to link") << ":\n" << log.c_str() << endl;
+	}
+	else if (!linked) {
+		cout << "Shader " << label << " failed to link" << endl;
+	}
+	return linked == GL_TRUE;
+}
+
+// 64-bit FNV-1a hash of all sources and the driver identification, so a driver update invalidates the cache
+unsigned long long UProgramKey(const vector<const char*>& vertexSources, const vector<const char*>& fragmentSources) {
+	vector<const char*> parts(vertexSources);
+	parts.push_back(NULL); // Marks the stage boundary
+	parts.insert(parts.end(), fragmentSources.begin(), fragmentSources.end());
+	parts.push_back((const char*)glGetString(GL_VENDOR));
+	parts.push_back((const char*)glGetString(GL_RENDERER));
+	parts.push_back((const char*)glGetString(GL_VERSION));
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < parts.size(); i++) {
+		for (const char* c = parts[i] ? parts[i] : ""; *c; c++) {
+			hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+		}
+		hash = (hash ^ 0xff) * 1099511628211ULL; // Separator so moving text between parts changes the key
+	}
+	return hash;
+}
+
+// Program binaries need GL 4.1 or ARB_get_program_binary and at least one binary format
+bool UProgramBinarySupported() {
+	if (!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)) {
+		return false;
+	}
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+// Enumerates the active uniforms and uniform blocks of a linked program and caches their locations
+void UReflectProgram(GLuint program, UProgramInfo& info) {
+	info.program = program;
+	info.uniforms.clear();
+	info.blocks.clear();
+
+	GLint count = 0, maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	string name(maxLength > 0 ? maxLength : 1, '\0');
+
+	for (GLint i = 0; i < count; i++) {
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+		string uniformName(name, 0, length);
+
+		// Arrays are reported as "name[0]"; store them under their base name
+		size_t bracket = uniformName.find('[');
+		if (bracket != string::npos) {
+			uniformName.erase(bracket);
+		}
+
+		// Block members have no location and are fed through their buffer instead
+		GLint location = glGetUniformLocation(program, uniformName.c_str());
+		if (location != -1) {
+			info.uniforms[uniformName] = location;
+		}
+	}
+
+	count = maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+	name.assign(maxLength > 0 ? maxLength : 1, '\0');
+
+	for (GLint i = 0; i < count; i++) {
+		GLsizei length = 0;
+		glGetActiveUniformBlockName(program, i, (GLsizei)name.size(), &length, &name[0]);
+		info.blocks[string(name, 0, length)] = (GLuint)i;
+	}
+
+	info.modelLoc = UUniformLocation(info, "model");
+	info.textureLoc = UUniformLocation(info, "uTexture");
+}
+
+// Looks up a cached uniform location, returning -1 when the uniform is inactive
+GLint UUniformLocation(const UProgramInfo& info, const char* name) {
+	map<string, GLint>::const_iterator it = info.uniforms.find(name);
+	return it != info.uniforms.end() ? it->second : -1;
+}
+
+// Creates the per-frame uniform buffer; each frame binds the range it wrote to the binding point
+void UCreateUniformBuffers() {
+	GLint alignment = 1;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	UCreateDynamicBuffer(frameStream, GL_UNIFORM_BUFFER, sizeof(UFrameData), alignment);
+}
+
+// Creates a dynamic buffer of DYNAMIC_REGIONS regions of at least size bytes each
+void UCreateDynamicBuffer(UDynamicBuffer& dynamic, GLenum target, GLsizeiptr size, GLsizeiptr alignment) {
+	dynamic.target = target;
+	dynamic.regionSize = (max(size, (GLsizeiptr)1) + alignment - 1) / alignment * alignment;
+	dynamic.region = DYNAMIC_REGIONS - 1; // The first write goes to region 0
+	dynamic.mapped = NULL;
+	for (int i = 0; i < DYNAMIC_REGIONS; i++) {
+		dynamic.fences[i] = 0;
+	}
+
+	glGenBuffers(1, &dynamic.buffer);
+	glBindBuffer(target, dynamic.buffer);
+	if (persistentMapping && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)) {
+		// Coherent, so writes reach the GPU without explicit flushes; the fences alone keep both sides apart
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(target, dynamic.regionSize * DYNAMIC_REGIONS, NULL, flags);
+		dynamic.mapped = (unsigned char*)glMapBufferRange(target, 0, dynamic.regionSize * DYNAMIC_REGIONS, flags);
+		if (dynamic.mapped == NULL) {
+			// Immutable storage cannot be respecified, start over with a fresh buffer for the fallback
+			glDeleteBuffers(1, &dynamic.buffer);
+			glGenBuffers(1, &dynamic.buffer);
+			glBindBuffer(target, dynamic.buffer);
+		}
+	}
+	if (dynamic.mapped == NULL) {
+		glBufferData(target, dynamic.regionSize, NULL, GL_STREAM_DRAW);
+		dynamic.staging.resize(dynamic.regionSize);
+	}
+	glBindBuffer(target, 0);
+}
+
+// Moves on to the next region and returns where to write it, waiting only if the GPU is still reading that region
+unsigned char* UBeginDynamicWrite(UDynamicBuffer& dynamic) {
+	dynamic.region = (dynamic.region + 1) % DYNAMIC_REGIONS;
+	if (dynamic.mapped == NULL) {
+		return &dynamic.staging[0];
+	}
+
+	GLsync& fence = dynamic.fences[dynamic.region];
+	if (fence) {
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (status == GL_TIMEOUT_EXPIRED) {
+			status = glClientWaitSync(fence, 0, 1000000); // The GPU is DYNAMIC_REGIONS frames behind; wait 1ms at a time
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+	return dynamic.mapped + dynamic.region * dynamic.regionSize;
+}
+
+// Finishes the write of bytes into the current region and returns the buffer offset the data is read from
+GLintptr UEndDynamicWrite(UDynamicBuffer& dynamic, GLsizeiptr bytes) {
+	if (dynamic.mapped) {
+		return dynamic.region * dynamic.regionSize; // Coherent mapping: already visible to the GPU
+	}
+
+	// Orphan the storage so the upload never waits for draws still reading the previous contents
+	glBindBuffer(dynamic.target, dynamic.buffer);
+	glBufferData(dynamic.target, dynamic.regionSize, NULL, GL_STREAM_DRAW);
+	if (bytes > 0) {
+		glBufferSubData(dynamic.target, 0, bytes, &dynamic.staging[0]);
+	}
+	glBindBuffer(dynamic.target, 0);
+	return 0;
+}
+
+// Marks the end of the GPU commands reading the current region; call after the frame's last draw using it. A region
+// fenced again without a new write keeps only the newer fence
+void UFenceDynamicBuffer(UDynamicBuffer& dynamic) {
+	if (dynamic.mapped) {
+		GLsync& fence = dynamic.fences[dynamic.region];
+		if (fence) {
+			glDeleteSync(fence);
+		}
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+void UDeleteDynamicBuffer(UDynamicBuffer& dynamic) {
+	for (int i = 0; i < DYNAMIC_REGIONS; i++) {
+		if (dynamic.fences[i]) {
+			glDeleteSync(dynamic.fences[i]);
+			dynamic.fences[i] = 0;
+		}
+	}
+	if (dynamic.mapped) {
+		glBindBuffer(dynamic.target, dynamic.buffer);
+		glUnmapBuffer(dynamic.target);
+		glBindBuffer(dynamic.target, 0);
+		dynamic.mapped = NULL;
+	}
+	glDeleteBuffers(1, &dynamic.buffer);
+}
+
+bool UCreateBuffers() {
+
+	// Map the mesh file; its vertex and index data are copied from the mapping into the arenas
+	if (!UMapMeshFile(meshFileName, chairMeshFile)) {
+		cout << "Failed to load mesh " << meshFileName << endl;
+		return false;
+	}
+	const UMeshFileHeader* header = (const UMeshFileHeader*)chairMeshFile.data;
+	const unsigned char* fileData = (const unsigned char*)chairMeshFile.data;
+	chairIndexCount = (GLsizei)header->indexCount;
+	cullData.objectMin = glm::vec3(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]);
+	cullData.objectMax = glm::vec3(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]);
+
+	// Float vertices are packed first when the packed format is wanted; the layout header then describes the copy
+	const UMeshFileHeader* layout = header;
+	const unsigned char* vertexData = fileData + header->vertexOffset;
+	UMeshFileHeader packedHeader;
+	vector<unsigned char> packedVertices;
+	if (vertexFormat == VERTEX_FORMAT_PACKED && header->vertexStride > PACKED_VERTEX_STRIDE) {
+		UPackVertices(header, packedHeader, packedVertices);
+		layout = &packedHeader;
+		vertexData = &packedVertices[0];
+		cout << "Vertices packed from " << header->vertexStride << " to " << packedHeader.vertexStride << " bytes, "
+			<< header->vertexCount * packedHeader.vertexStride << " bytes in all" << endl;
+	}
+	UPositionQuantization(layout, positionScale, positionOffset);
+
+	// The index buffer is shared by every vertex format; the visible instance indices are allocated before the first
+	// vertex array is, since each one points attribute 3 at them
+	UCreateArena(indexArena, GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint));
+	UCreateDynamicBuffer(visibleStream, GL_ARRAY_BUFFER, max(showroomCount, 1) * sizeof(GLuint), sizeof(GLuint));
+
+	// The render queue's draw commands; multi-draw indirect is core in 4.3, and the base instance the commands find their
+	// visible instance indices with in 4.2
+	if (indirectDraws && !((GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && (GLEW_VERSION_4_2 || GLEW_ARB_base_instance))) {
+		cout << "Multi-draw indirect or base instances are not supported, the render queue issues its draws one at a time" << endl;
+		indirectDraws = false;
+	}
+	if (indirectDraws) {
+		UCreateDynamicBuffer(indirectStream, GL_DRAW_INDIRECT_BUFFER, INDIRECT_COMMANDS * sizeof(UDrawCommand), sizeof(UDrawCommand));
+	}
+
+	// The simplified meshes follow the original indices in the chair's index range
+	vector<GLuint> lodIndices;
+	UBuildLods(header, lodIndices);
+	chairMesh = UAddMesh(layout, vertexData, layout->vertexCount, (const GLuint*)(fileData + header->indexOffset), header->indexCount,
+		lodIndices.empty() ? NULL : &lodIndices[0], (GLuint)lodIndices.size());
+
+	// Impostors need no vertex data, only the instance indices; corners come from gl_VertexID
+	glGenVertexArrays(1, &impostorVAO);
+	glBindVertexArray(impostorVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, visibleStream.buffer);
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// The matrices of every instance stay in one static buffer, read through a texture buffer (filled by UCreateInstances)
+	glGenBuffers(1, &instanceVBO);
+	glGenTextures(1, &instanceTexture);
+
+	glBindVertexArray(0); // Deactivates the VAO which is good practice
+
+	return true;
+}
+
+// Copies a mesh into the arenas of its vertex format and the index arena, creating the format on first use. The level
+// of detail indices follow the mesh's own in its index range, uploaded from where they are. Returns the mesh id
+int UAddMesh(const UMeshFileHeader* layout, const void* vertices, GLuint vertexCount, const GLuint* indices, GLuint indexCount,
+	const GLuint* lodIndices, GLuint lodIndexCount) {
+	int formatIndex = UAddVertexFormat(layout);
+	UMeshRange range;
+	range.format = formatIndex;
+	range.vertexBytes = (GLsizeiptr)vertexCount * layout->vertexStride;
+	range.indexBytes = (GLsizeiptr)(indexCount + lodIndexCount) * sizeof(GLuint);
+	range.vertexOffset = UArenaAllocate(vertexFormats[formatIndex].vertices, range.vertexBytes);
+	range.indexOffset = UArenaAllocate(indexArena, range.indexBytes);
+	range.baseVertex = (GLint)(range.vertexOffset / layout->vertexStride);
+	range.firstIndex = (GLuint)(range.indexOffset / sizeof(GLuint));
+
+	glBindBuffer(GL_ARRAY_BUFFER, vertexFormats[formatIndex].vertices.buffer);
+	glBufferSubData(GL_ARRAY_BUFFER, range.vertexOffset, range.vertexBytes, vertices);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0); // The element buffer binding below must not change a vertex array
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexArena.buffer);
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, range.indexOffset, (GLsizeiptr)indexCount * sizeof(GLuint), indices);
+	if (lodIndexCount > 0) {
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, range.indexOffset + (GLintptr)indexCount * sizeof(GLuint),
+			(GLsizeiptr)lodIndexCount * sizeof(GLuint), lodIndices);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	meshRanges.push_back(range);
+	return (int)meshRanges.size() - 1;
+}
+
+// Returns a mesh's ranges to the arenas; the id is not reused
+void URemoveMesh(int mesh) {
+	UMeshRange& range = meshRanges[mesh];
+	if (range.format < 0) {
+		return;
+	}
+	UArenaFree(vertexFormats[range.format].vertices, range.vertexOffset);
+	UArenaFree(indexArena, range.indexOffset);
+	range.format = -1;
+}
+
+// Index of the vertex format with the same stride and attributes, or -1
+int UFindVertexFormat(const UMeshFileHeader* layout) {
+	for (size_t i = 0; i < vertexFormats.size(); i++) {
+		const UMeshFileHeader& known = vertexFormats[i].layout;
+		if (known.vertexStride == layout->vertexStride && known.attributeCount == layout->attributeCount
+			&& memcmp(known.attributes, layout->attributes, layout->attributeCount * sizeof(UMeshAttribute)) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// Index of the vertex format with the layout's stride and attributes, created on first use
+int UAddVertexFormat(const UMeshFileHeader* layout) {
+	int formatIndex = UFindVertexFormat(layout);
+	if (formatIndex >= 0) {
+		return formatIndex;
+	}
+	UVertexFormat format;
+	memset(&format.layout, 0, sizeof(format.layout));
+	format.layout.vertexStride = layout->vertexStride;
+	format.layout.attributeCount = layout->attributeCount;
+	memcpy(format.layout.attributes, layout->attributes, sizeof(layout->attributes));
+	UCreateArena(format.vertices, GL_ARRAY_BUFFER, layout->vertexStride);
+	glGenVertexArrays(1, &format.vertexArray);
+	vertexFormats.push_back(format);
+	formatIndex = (int)vertexFormats.size() - 1;
+	UBindVertexFormat(vertexFormats[formatIndex]);
+	return formatIndex;
+}
+
+// Moves a mesh's vertices into a format that has its lightmap coordinates interleaved after the other attributes, at
+// location 4. Only lightmapped meshes are drawn with that format, so no other mesh's draws read the attribute, and the
+// coordinates move with their vertices when the arena is rebuilt. The mesh keeps its id and its index range
+void UAddLightmapCoordinates(int mesh, const glm::vec2* coordinates) {
+	UMeshRange& range = meshRanges[mesh];
+	const UVertexFormat& source = vertexFormats[range.format];
+	GLuint stride = source.layout.vertexStride;
+	GLuint vertexCount = (GLuint)(range.vertexBytes / stride);
+	vector<unsigned char> vertices(range.vertexBytes);
+	glBindBuffer(GL_COPY_READ_BUFFER, source.vertices.buffer);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, range.vertexOffset, range.vertexBytes, &vertices[0]);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	UMeshFileHeader layout = source.layout;
+	UMeshAttribute& attribute = layout.attributes[layout.attributeCount++];
+	attribute.location = 4;
+	attribute.components = 2;
+	attribute.type = GL_FLOAT;
+	attribute.normalized = 0;
+	attribute.offset = stride;
+	layout.vertexStride = stride + sizeof(glm::vec2);
+	vector<unsigned char> interleaved((size_t)vertexCount * layout.vertexStride);
+	for (GLuint v = 0; v < vertexCount; v++) {
+		memcpy(&interleaved[(size_t)v * layout.vertexStride], &vertices[(size_t)v * stride], stride);
+		memcpy(&interleaved[(size_t)v * layout.vertexStride + stride], &coordinates[v], sizeof(glm::vec2));
+	}
+
+	// The new range is placed before the old one is freed; a rebuild of either arena updates range in place
+	int formatIndex = UAddVertexFormat(&layout);
+	GLsizeiptr vertexBytes = (GLsizeiptr)interleaved.size();
+	GLintptr vertexOffset = UArenaAllocate(vertexFormats[formatIndex].vertices, vertexBytes);
+	UArenaFree(vertexFormats[range.format].vertices, range.vertexOffset);
+	range.format = formatIndex;
+	range.vertexOffset = vertexOffset;
+	range.vertexBytes = vertexBytes;
+	range.baseVertex = (GLint)(vertexOffset / layout.vertexStride);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexFormats[formatIndex].vertices.buffer);
+	glBufferSubData(GL_ARRAY_BUFFER, vertexOffset, vertexBytes, &interleaved[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Points a format's vertex array at its vertex arena and at the index arena, after creation or a rebuild of either
+void UBindVertexFormat(UVertexFormat& format) {
+	glBindVertexArray(format.vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, format.vertices.buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexArena.buffer); // Recorded in the vertex array
+
+	// Set the vertex attribute pointers (position 0, normal 1, texture 2) from the layout descriptor
+	for (GLuint i = 0; i < format.layout.attributeCount; i++) {
+		const UMeshAttribute& attribute = format.layout.attributes[i];
+		glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized ? GL_TRUE : GL_FALSE,
+			format.layout.vertexStride, (GLvoid*)(size_t)attribute.offset);
+		glEnableVertexAttribArray(attribute.location); // Enables vertex attribute
+	}
+
+	// Set attribute pointer 3 to the index of each visible instance; the shader fetches its matrices with it.
+	// The draws point it at the region written each frame
+	glBindBuffer(GL_ARRAY_BUFFER, visibleStream.buffer);
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1); // Advance once per instance
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
+// Creates an empty arena of ARENA_INITIAL_BYTES
+void UCreateArena(UBufferArena& arena, GLenum target, GLsizeiptr alignment) {
+	arena.target = target;
+	arena.alignment = alignment;
+	arena.capacity = ARENA_INITIAL_BYTES / alignment * alignment;
+	arena.used = 0;
+	arena.rebuilds = 0;
+	arena.live.clear();
+	arena.freeRanges.assign(1, UArenaRange());
+	arena.freeRanges[0].offset = 0;
+	arena.freeRanges[0].size = arena.capacity;
+	glGenBuffers(1, &arena.buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, arena.buffer); // Leaves the element buffer binding of the current vertex array alone
+	glBufferData(GL_COPY_WRITE_BUFFER, arena.capacity, NULL, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+// Returns the offset of a new range of size bytes, first fit. Compacts or grows the arena when no free range fits
+GLintptr UArenaAllocate(UBufferArena& arena, GLsizeiptr size) {
+	size = max(size, arena.alignment); // Empty ranges still need an offset of their own
+	size = (size + arena.alignment - 1) / arena.alignment * arena.alignment;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		for (size_t i = 0; i < arena.freeRanges.size(); i++) {
+			UArenaRange& range = arena.freeRanges[i];
+			if (range.size < size) {
+				continue;
+			}
+			// Ranges always start and end on the alignment, so the front of a free range is usable as is
+			GLintptr offset = range.offset;
+			range.offset += size;
+			range.size -= size;
+			if (range.size == 0) {
+				arena.freeRanges.erase(arena.freeRanges.begin() + i);
+			}
+			arena.live[offset] = size;
+			arena.used += size;
+			return offset;
+		}
+
+		// Compacting is enough while the free space adds up to the size; otherwise the arena doubles as well
+		GLsizeiptr capacity = arena.capacity;
+		if (arena.capacity - arena.used < size) {
+			capacity = max(arena.capacity * 2, arena.used + size);
+		}
+		URebuildArena(arena, capacity);
+	}
+	return 0; // Not reached: the rebuilt arena has a free range of at least size at its end
+}
+
+// Returns a range to the free list, merging it with free neighbors
+void UArenaFree(UBufferArena& arena, GLintptr offset) {
+	map<GLintptr, GLsizeiptr>::iterator allocation = arena.live.find(offset);
+	if (allocation == arena.live.end()) {
+		return;
+	}
+	UArenaRange freed;
+	freed.offset = offset;
+	freed.size = allocation->second;
+	arena.used -= freed.size;
+	arena.live.erase(allocation);
+
+	size_t i = 0;
+	while (i < arena.freeRanges.size() && arena.freeRanges[i].offset < freed.offset) {
+		i++;
+	}
+	arena.freeRanges.insert(arena.freeRanges.begin() + i, freed);
+	if (i + 1 < arena.freeRanges.size() && arena.freeRanges[i].offset + arena.freeRanges[i].size == arena.freeRanges[i + 1].offset) {
+		arena.freeRanges[i].size += arena.freeRanges[i + 1].size;
+		arena.freeRanges.erase(arena.freeRanges.begin() + i + 1);
+	}
+	if (i > 0 && arena.freeRanges[i - 1].offset + arena.freeRanges[i - 1].size == arena.freeRanges[i].offset) {
+		arena.freeRanges[i - 1].size += arena.freeRanges[i].size;
+		arena.freeRanges.erase(arena.freeRanges.begin() + i);
+	}
+}
+
+// Copies the live ranges, in order and without gaps, into a new buffer of the given capacity, then moves the meshes
+// and vertex arrays over to it. What is left after the live ranges becomes one free range
+void URebuildArena(UBufferArena& arena, GLsizeiptr capacity) {
+	GLuint rebuilt;
+	glGenBuffers(1, &rebuilt);
+	glBindBuffer(GL_COPY_READ_BUFFER, arena.buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, rebuilt);
+	glBufferData(GL_COPY_WRITE_BUFFER, capacity, NULL, GL_STATIC_DRAW);
+
+	map<GLintptr, GLintptr> moved;
+	map<GLintptr, GLsizeiptr> live;
+	GLintptr end = 0;
+	for (map<GLintptr, GLsizeiptr>::const_iterator range = arena.live.begin(); range != arena.live.end(); ++range) {
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range->first, end, range->second);
+		moved[range->first] = end;
+		live[end] = range->second;
+		end += range->second;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &arena.buffer);
+
+	arena.buffer = rebuilt;
+	arena.capacity = capacity;
+	arena.live.swap(live);
+	arena.freeRanges.clear();
+	if (end < capacity) {
+		UArenaRange rest;
+		rest.offset = end;
+		rest.size = capacity - end;
+		arena.freeRanges.push_back(rest);
+	}
+	arena.rebuilds++;
+	URelocateMeshes(arena, moved);
+}
+
+// Follows a rebuild of an arena: updates the ranges of the meshes in it and re-points the vertex arrays using it
+void URelocateMeshes(const UBufferArena& arena, const map<GLintptr, GLintptr>& moved) {
+	bool indices = &arena == &indexArena;
+	for (size_t i = 0; i < meshRanges.size(); i++) {
+		UMeshRange& range = meshRanges[i];
+		if (range.format < 0) {
+			continue;
+		}
+		if (indices) {
+			range.indexOffset = moved.find(range.indexOffset)->second;
+			range.firstIndex = (GLuint)(range.indexOffset / sizeof(GLuint));
+		}
+		else if (&vertexFormats[range.format].vertices == &arena) {
+			range.vertexOffset = moved.find(range.vertexOffset)->second;
+			range.baseVertex = (GLint)(range.vertexOffset / vertexFormats[range.format].layout.vertexStride);
+		}
+	}
+	for (size_t i = 0; i < vertexFormats.size(); i++) {
+		if (indices || &vertexFormats[i].vertices == &arena) {
+			UBindVertexFormat(vertexFormats[i]);
+		}
+	}
+}
+
+// Deletes the arena buffers and the vertex arrays of every format
+void UDeleteArenas() {
+	for (size_t i = 0; i < vertexFormats.size(); i++) {
+		glDeleteVertexArrays(1, &vertexFormats[i].vertexArray);
+		glDeleteBuffers(1, &vertexFormats[i].vertices.buffer);
+	}
+	glDeleteBuffers(1, &indexArena.buffer);
+}
+
+// Maps a binary mesh file read-only and checks that its header and data ranges are consistent
+bool UMapMeshFile(const string& fileName, UMappedFile& file) {
+	if (!UMapFile(fileName, file)) {
+		return false;
+	}
+
+	const UMeshFileHeader* header = (const UMeshFileHeader*)file.data;
+	bool valid = file.size >= sizeof(UMeshFileHeader)
+		&& memcmp(header->magic, MESH_FILE_MAGIC, 4) == 0
+		&& header->version == MESH_FILE_VERSION
+		&& header->attributeCount <= MESH_MAX_ATTRIBUTES
+		&& header->vertexOffset + (size_t)header->vertexCount * header->vertexStride <= file.size
+		&& header->indexOffset + (size_t)header->indexCount * sizeof(GLuint) <= file.size
+		&& header->vertexStride > 0;
+
+	// Vertices and indices are read on the CPU too, so every attribute has to fit its vertex and every index a vertex
+	for (GLuint i = 0; valid && i < header->attributeCount; i++) {
+		const UMeshAttribute& attribute = header->attributes[i];
+		size_t bytes = 0;
+		if (attribute.type == GL_INT_2_10_10_10_REV) {
+			bytes = attribute.components == 4 ? sizeof(GLuint) : 0;
+		}
+		else if (attribute.type == GL_FLOAT) {
+			bytes = attribute.components * sizeof(GLfloat);
+		}
+		else if (attribute.type == GL_HALF_FLOAT || attribute.type == GL_SHORT || attribute.type == GL_UNSIGNED_SHORT) {
+			bytes = attribute.components * sizeof(GLushort);
+		}
+		valid = attribute.location < MESH_ATTRIBUTE_LOCATIONS && attribute.components >= 1 && attribute.components <= 4
+			&& bytes > 0 && attribute.offset + bytes <= header->vertexStride;
+	}
+	if (valid) {
+		const GLuint* indices = (const GLuint*)((const char*)file.data + header->indexOffset);
+		for (GLuint i = 0; i < header->indexCount; i++) {
+			if (indices[i] >= header->vertexCount) {
+				valid = false;
+				break;
+			}
+		}
+	}
+
+	if (!valid) {
+		cout << fileName << " is not a valid version " << MESH_FILE_VERSION << " mesh file" << endl;
+		UUnmapFile(file);
+	}
+	return valid;
+}
+
+// Maps a whole file into memory read-only
+bool UMapFile(const string& fileName, UMappedFile& file) {
+	file.data = NULL;
+	file.size = 0;
+
+#ifdef _WIN32
+	file.file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file.file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(file.file, &size);
+	file.size = (size_t)size.QuadPart;
+	file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (file.mapping != NULL) {
+		file.data = MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	file.descriptor = open(fileName.c_str(), O_RDONLY);
+	if (file.descriptor < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(file.descriptor, &info) == 0 && info.st_size > 0) {
+		file.size = (size_t)info.st_size;
+		void* data = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.descriptor, 0);
+		file.data = data == MAP_FAILED ? NULL : data;
+	}
+#endif
+
+	if (file.data == NULL) {
+		UUnmapFile(file);
+		return false;
+	}
+	return true;
+}
+
+// Releases a mapping made by UMapFile
+void UUnmapFile(UMappedFile& file) {
+#ifdef _WIN32
+	if (file.data != NULL) {
+		UnmapViewOfFile(file.data);
+	}
+	if (file.mapping != NULL) {
+		CloseHandle(file.mapping);
+	}
+	if (file.file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file.file);
+	}
+	file.mapping = NULL;
+	file.file = INVALID_HANDLE_VALUE;
+#else
+	if (file.data != NULL) {
+		munmap(file.data, file.size);
+	}
+	if (file.descriptor >= 0) {
+		close(file.descriptor);
+	}
+	file.descriptor = -1;
+#endif
+	file.data = NULL;
+	file.size = 0;
+}
+
+// Converts a Wavefront OBJ file into the binary mesh format: welded, cache-optimized and ready to upload
+bool UImportObj(const string& objFileName, const string& outputFileName) {
+	ifstream obj(objFileName.c_str());
+	if (!obj) {
+		cout << "Failed to open " << objFileName << endl;
+		return false;
+	}
+
+	vector<glm::vec3> positions, normals;
+	vector<glm::vec2> textureCoordinates;
+	vector<GLfloat> triangles; // Flat triangle list, 8 floats per corner like the VBO layout
+
+	string line;
+	while (getline(obj, line)) {
+		istringstream fields(line);
+		string type;
+		fields >> type;
+
+		if (type == "v") {
+			glm::vec3 p;
+			fields >> p.x >> p.y >> p.z;
+			positions.push_back(p);
+		}
+		else if (type == "vn") {
+			glm::vec3 n;
+			fields >> n.x >> n.y >> n.z;
+			normals.push_back(n);
+		}
+		else if (type == "vt") {
+			glm::vec2 t;
+			fields >> t.x >> t.y;
+			textureCoordinates.push_back(t);
+		}
+		else if (type == "f") {
+			// Corners are v, v/vt, v//vn or v/vt/vn; negative indices count from the end
+			vector<int> corners[3];
+			string corner;
+			while (fields >> corner) {
+				int index[3] = { 0, 0, 0 };
+				size_t start = 0;
+				for (int k = 0; k < 3 && start <= corner.size(); k++) {
+					size_t slash = corner.find('/', start);
+					string part = corner.substr(start, slash == string::npos ? string::npos : slash - start);
+					index[k] = part.empty() ? 0 : atoi(part.c_str());
+					if (slash == string::npos) {
+						break;
+					}
+					start = slash + 1;
+				}
+				int counts[3] = { (int)positions.size(), (int)textureCoordinates.size(), (int)normals.size() };
+				for (int k = 0; k < 3; k++) {
+					corners[k].push_back(index[k] < 0 ? counts[k] + index[k] : index[k] - 1);
+				}
+			}
+
+			// Triangulate polygons as a fan around the first corner
+			for (size_t c = 1; c + 1 < corners[0].size(); c++) {
+				size_t fan[3] = { 0, c, c + 1 };
+				glm::vec3 p[3];
+				for (int k = 0; k < 3; k++) {
+					int v = corners[0][fan[k]];
+					if (v < 0 || v >= (int)positions.size()) {
+						cout << "Bad vertex index in " << objFileName << ": " << line << endl;
+						return false;
+					}
+					p[k] = positions[v];
+				}
+				glm::vec3 faceNormal = glm::normalize(glm::cross(p[1] - p[0], p[2] - p[0]));
+
+				for (int k = 0; k < 3; k++) {
+					int t = corners[1][fan[k]], n = corners[2][fan[k]];
+					glm::vec2 uv = t >= 0 && t < (int)textureCoordinates.size() ? textureCoordinates[t] : glm::vec2(0.0f);
+					glm::vec3 normal = n >= 0 && n < (int)normals.size() ? normals[n] : faceNormal; // Flat shading without normals
+					GLfloat vertex[8] = { p[k].x, p[k].y, p[k].z, normal.x, normal.y, normal.z, uv.x, uv.y };
+					triangles.insert(triangles.end(), vertex, vertex + 8);
+				}
+			}
+		}
+	}
+
+	if (triangles.empty()) {
+		cout << "No faces in " << objFileName << endl;
+		return false;
+	}
+
+	UMesh mesh;
+	UBuildIndexedMesh(&triangles[0], (int)(triangles.size() / 8), 8, mesh);
+
+	// Header with the interleaved position / normal / texture layout and the mesh bounds
+	UMeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_FILE_MAGIC, 4);
+	header.version = MESH_FILE_VERSION;
+	header.vertexCount = (GLuint)(mesh.vertices.size() / 8);
+	header.indexCount = (GLuint)mesh.indices.size();
+	header.vertexStride = 8 * sizeof(GLfloat);
+	header.attributeCount = 3;
+	UMeshAttribute layout[3] = {
+		{ 0, 3, GL_FLOAT, 0, 0 },
+		{ 1, 3, GL_FLOAT, 0, 3 * sizeof(GLfloat) },
+		{ 2, 2, GL_FLOAT, 0, 6 * sizeof(GLfloat) }
+	};
+	memcpy(header.attributes, layout, sizeof(layout));
+
+	glm::vec3 boundsMin(mesh.vertices[0], mesh.vertices[1], mesh.vertices[2]), boundsMax = boundsMin;
+	for (size_t v = 0; v < mesh.vertices.size(); v += 8) {
+		glm::vec3 p(mesh.vertices[v], mesh.vertices[v + 1], mesh.vertices[v + 2]);
+		boundsMin = glm::min(boundsMin, p);
+		boundsMax = glm::max(boundsMax, p);
+	}
+	for (int k = 0; k < 3; k++) {
+		header.boundsMin[k] = boundsMin[k];
+		header.boundsMax[k] = boundsMax[k];
+	}
+
+	header.vertexOffset = sizeof(UMeshFileHeader);
+	header.indexOffset = header.vertexOffset + header.vertexCount * header.vertexStride;
+
+	// The packed format is converted from the float file image, the way the viewer packs float files at load
+	vector<unsigned char> vertices((const unsigned char*)&mesh.vertices[0], (const unsigned char*)&mesh.vertices[0] + mesh.vertices.size() * sizeof(GLfloat));
+	if (vertexFormat == VERTEX_FORMAT_PACKED) {
+		vector<unsigned char> image((const unsigned char*)&header, (const unsigned char*)&header + sizeof(header));
+		image.insert(image.end(), vertices.begin(), vertices.end());
+		UMeshFileHeader packed;
+		UPackVertices((const UMeshFileHeader*)&image[0], packed, vertices);
+		header = packed;
+		header.indexOffset = header.vertexOffset + header.vertexCount * header.vertexStride;
+	}
+
+	ofstream out(outputFileName.c_str(), ios::binary);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)&vertices[0], vertices.size());
+	out.write((const char*)&mesh.indices[0], mesh.indices.size() * sizeof(GLuint));
+	if (!out) {
+		cout << "Failed to write " << outputFileName << endl;
+		return false;
+	}
+
+	cout << "Imported " << objFileName << ": " << triangles.size() / 8 << " corners welded to " << header.vertexCount
+		<< " vertices, " << header.indexCount / 3 << " triangles -> " << outputFileName << endl;
+	return true;
+}
+
+// Places the chairs and uploads their matrices: one chair at the origin, or a showroom floor of rows
+void UCreateInstances() {
+	chairInstances.clear();
+
+	// The shaders fetch the matrices from a texture buffer, which GL 3.3 only guarantees 65536 texels for; chairs past
+	// the driver's limit would read zero matrices, so the showroom is cut down to what fits
+	GLint maxTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	int maxInstances = maxTexels / INSTANCE_TEXELS;
+	if (showroomCount > maxInstances) {
+		cout << "Instance data of " << showroomCount << " chairs needs " << (long long)showroomCount * INSTANCE_TEXELS
+			<< " texels but the driver allows " << maxTexels << ", showing " << maxInstances << " chairs" << endl;
+		showroomCount = maxInstances;
+	}
+
+	if (showroomCount <= 0) {
+		UInstance chair;
+		chair.model = glm::mat4(1.0f);
+		chair.normalMatrix = glm::mat3(1.0f);
+		chairInstances.push_back(chair);
+	}
+	else {
+		// Square grid of rows, shrunk so the whole floor spans 4 units and fits the default view
+		int columns = (int)ceil(sqrt((float)showroomCount));
+		int rows = (showroomCount + columns - 1) / columns;
+		const GLfloat spacingX = 1.5f, spacingZ = 2.0f; // Chair width plus aisle, chair depth plus row gap
+		GLfloat fit = 4.0f / glm::max(columns * spacingX, rows * spacingZ);
+
+		chairInstances.reserve(showroomCount);
+		for (int i = 0; i < showroomCount; i++) {
+			GLfloat x = ((i % columns) - (columns - 1) * 0.5f) * spacingX;
+			GLfloat z = ((i / columns) - (rows - 1) * 0.5f) * spacingZ;
+
+			UInstance chair;
+			chair.model = glm::scale(glm::mat4(1.0f), glm::vec3(fit));
+			chair.model = glm::translate(chair.model, glm::vec3(x, 0.0f, z));
+			chair.normalMatrix = UNormalMatrix(chair.model);
+			chairInstances.push_back(chair);
+		}
+	}
+
+	// Pack the matrices as whole texels for the texture buffer and compute each instance's bounds for culling
+	size_t count = chairInstances.size();
+	vector<glm::vec4> texels(count * INSTANCE_TEXELS);
+	glm::vec3 objectCenter = (cullData.objectMin + cullData.objectMax) * 0.5f;
+	glm::vec3 objectExtent = (cullData.objectMax - cullData.objectMin) * 0.5f;
+	cullData.centerX.resize(count);
+	cullData.centerY.resize(count);
+	cullData.centerZ.resize(count);
+	cullData.extentX.resize(count);
+	cullData.extentY.resize(count);
+	cullData.extentZ.resize(count);
+	cullData.scale.resize(count);
+	lodData.instanceLevel.assign(count, 0);
+	for (size_t i = 0; i < count; i++) {
+		const UInstance& chair = chairInstances[i];
+		for (int column = 0; column < 4; column++) {
+			texels[i * INSTANCE_TEXELS + column] = chair.model[column];
+		}
+		for (int column = 0; column < 3; column++) {
+			texels[i * INSTANCE_TEXELS + 4 + column] = glm::vec4(chair.normalMatrix[column], 0.0f);
+		}
+
+		// Box under an affine transform: move the center, sum the absolute axes for the extent
+		glm::vec3 center = glm::vec3(chair.model * glm::vec4(objectCenter, 1.0f));
+		glm::vec3 extent(0.0f);
+		for (int column = 0; column < 3; column++) {
+			extent += glm::abs(glm::vec3(chair.model[column])) * objectExtent[column];
+		}
+		cullData.centerX[i] = center.x;
+		cullData.centerY[i] = center.y;
+		cullData.centerZ[i] = center.z;
+		cullData.extentX[i] = extent.x;
+		cullData.extentY[i] = extent.y;
+		cullData.extentZ[i] = extent.z;
+		cullData.scale[i] = glm::length(glm::vec3(chair.model[0]));
+	}
+	for (int level = 0; level < LOD_LEVELS; level++) {
+		cullData.chunkCount[level].resize((count + CULL_CHUNK - 1) / CULL_CHUNK);
+		cullData.chunkVisible[level].resize(cullData.chunkCount[level].size() * CULL_CHUNK);
+		cullData.chunkNearest[level].resize(cullData.chunkCount[level].size());
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, instanceVBO);
+	glBufferData(GL_TEXTURE_BUFFER, texels.size() * sizeof(glm::vec4), &texels[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glActiveTexture(GL_TEXTURE0 + INSTANCE_DATA_UNIT);
+	glBindTexture(GL_TEXTURE_BUFFER, instanceTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, instanceVBO);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+// Tests every instance's bounds against the frustum of clip (projection * view * model) and compacts the visible ones,
+// grouped by level of detail
+void UCullInstances(const glm::mat4& clip, GLfloat pixelScale) {
+	UCullData& cull = cullData;
+	cull.depthRow = glm::vec4(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+	cull.pixelScale = pixelScale;
+
+	// Gribb-Hartmann: each plane is the last row of the matrix plus or minus another row. Taken from the full
+	// clip matrix, the planes land in the space of the instance bounds, for perspective and orthographic alike
+	for (int axis = 0; axis < 3; axis++) {
+		glm::vec4 row(clip[0][axis], clip[1][axis], clip[2][axis], clip[3][axis]);
+		glm::vec4 last(clip[0][3], clip[1][3], clip[2][3], clip[3][3]);
+		cull.planes[axis * 2] = last + row;
+		cull.planes[axis * 2 + 1] = last - row;
+	}
+
+	UParallelFor((int)cull.chunkCount[0].size(), UCullChunk);
+
+	// Concatenate the per-job lists level by level; within a level they stay in instance order
+	cull.visible.clear();
+	for (int level = 0; level < LOD_LEVELS; level++) {
+		cull.lodFirst[level] = (GLuint)cull.visible.size();
+		cull.lodNearest[level] = farPlane;
+		for (size_t chunk = 0; chunk < cull.chunkCount[level].size(); chunk++) {
+			const GLuint* found = &cull.chunkVisible[level][chunk * CULL_CHUNK];
+			cull.visible.insert(cull.visible.end(), found, found + cull.chunkCount[level][chunk]);
+			cull.lodNearest[level] = min(cull.lodNearest[level], cull.chunkNearest[level][chunk]);
+		}
+		cull.lodCount[level] = (GLuint)cull.visible.size() - cull.lodFirst[level];
+	}
+}
+
+// Picks the level of detail of a visible instance from its projected error, with hysteresis, and returns its view
+// depth through depth. Runs on the worker threads
+int USelectLevel(size_t instance, GLfloat& depth) {
+	const UCullData& cull = cullData;
+	ULodData& lod = lodData;
+	GLfloat w = cull.depthRow.x * cull.centerX[instance] + cull.depthRow.y * cull.centerY[instance]
+		+ cull.depthRow.z * cull.centerZ[instance] + cull.depthRow.w;
+	depth = w;
+	if (!lodEnabled) {
+		return 0;
+	}
+
+	// Pixels covered by one object unit at this instance's distance
+	GLfloat pixelsPerUnit = cull.pixelScale * cull.scale[instance] / glm::max(w, nearPlane);
+
+	// Coarsest level within the threshold; levels are ordered by error
+	int levels = lod.impostorReady ? LOD_LEVELS : LOD_MESHES;
+	int current = glm::min((int)lod.instanceLevel[instance], levels - 1);
+	int level = 0;
+	while (level + 1 < levels && lod.switchError[level + 1] * pixelsPerUnit <= lodThreshold) {
+		level++;
+	}
+
+	// Refine at once, but only coarsen once the error is well below the threshold so levels do not flicker
+	if (level > current) {
+		level = current;
+		while (level + 1 < levels && lod.switchError[level + 1] * pixelsPerUnit <= lodThreshold * LOD_HYSTERESIS) {
+			level++;
+		}
+	}
+	lod.instanceLevel[instance] = (unsigned char)level;
+	return level;
+}
+
+// Reads an attribute of one vertex from the mapped mesh as floats, padded to three components. Float, half float,
+// 16-bit integer and 2_10_10_10 data are understood; integer positions are returned in object space
+glm::vec3 UReadAttribute(const UMeshFileHeader* header, GLuint location, GLuint vertex) {
+	glm::vec3 value(0.0f);
+	for (GLuint i = 0; i < header->attributeCount; i++) {
+		const UMeshAttribute& attribute = header->attributes[i];
+		if (attribute.location != location) {
+			continue;
+		}
+		const unsigned char* data = (const unsigned char*)header + header->vertexOffset + vertex * header->vertexStride + attribute.offset;
+		if (attribute.type == GL_INT_2_10_10_10_REV) {
+			GLuint packed;
+			memcpy(&packed, data, sizeof(packed));
+			for (int k = 0; k < 3; k++) {
+				int field = (int)(packed << (22 - 10 * k)) >> 22; // Sign-extends the k-th 10-bit field
+				value[k] = attribute.normalized ? max(field / 511.0f, -1.0f) : (GLfloat)field;
+			}
+			continue;
+		}
+		for (GLuint k = 0; k < attribute.components && k < 3; k++) {
+			if (attribute.type == GL_FLOAT) {
+				memcpy(&value[k], data + k * sizeof(GLfloat), sizeof(GLfloat));
+			}
+			else if (attribute.type == GL_HALF_FLOAT) {
+				GLushort half;
+				memcpy(&half, data + k * sizeof(GLushort), sizeof(half));
+				value[k] = UHalfToFloat(half);
+			}
+			else if (attribute.type == GL_SHORT) {
+				GLshort integer;
+				memcpy(&integer, data + k * sizeof(GLshort), sizeof(integer));
+				value[k] = attribute.normalized ? max(integer / 32767.0f, -1.0f) : (GLfloat)integer;
+			}
+			else if (attribute.type == GL_UNSIGNED_SHORT) {
+				GLushort integer;
+				memcpy(&integer, data + k * sizeof(GLushort), sizeof(integer));
+				value[k] = attribute.normalized ? integer / 65535.0f : (GLfloat)integer;
+			}
+		}
+	}
+	if (location == 0) {
+		glm::vec3 scale, offset;
+		UPositionQuantization(header, scale, offset);
+		value = offset + scale * value;
+	}
+	return value;
+}
+
+// Scale and offset from stored positions to object space: integer positions span the header bounds, with the
+// largest magnitude short at the bounds; float positions are stored as they are
+void UPositionQuantization(const UMeshFileHeader* header, glm::vec3& scale, glm::vec3& offset) {
+	scale = glm::vec3(1.0f);
+	offset = glm::vec3(0.0f);
+	for (GLuint i = 0; i < header->attributeCount; i++) {
+		const UMeshAttribute& attribute = header->attributes[i];
+		if (attribute.location != 0 || attribute.type == GL_FLOAT || attribute.type == GL_HALF_FLOAT) {
+			continue;
+		}
+		for (int k = 0; k < 3; k++) {
+			GLfloat halfExtent = (header->boundsMax[k] - header->boundsMin[k]) * 0.5f;
+			offset[k] = (header->boundsMin[k] + header->boundsMax[k]) * 0.5f;
+			scale[k] = halfExtent > 0.0f ? halfExtent / 32767.0f : 1.0f;
+		}
+	}
+}
+
+// Converts the vertices of a mesh to the packed layout. packed receives the header with the new stride and attributes;
+// the data offsets are the caller's to fill in
+void UPackVertices(const UMeshFileHeader* header, UMeshFileHeader& packed, vector<unsigned char>& vertices) {
+	bool unitCoordinates = true;
+	for (GLuint v = 0; v < header->vertexCount && unitCoordinates; v++) {
+		glm::vec3 coordinate = UReadAttribute(header, 2, v);
+		unitCoordinates = coordinate.x >= 0.0f && coordinate.x <= 1.0f && coordinate.y >= 0.0f && coordinate.y <= 1.0f;
+	}
+
+	packed = *header;
+	packed.vertexStride = PACKED_VERTEX_STRIDE;
+	packed.attributeCount = 3;
+	memset(packed.attributes, 0, sizeof(packed.attributes));
+	UMeshAttribute layout[3] = {
+		{ 0, 3, GL_SHORT, 0, 0 }, // Two bytes of padding follow, keeping the normal 4-byte aligned
+		{ 1, 4, GL_INT_2_10_10_10_REV, 1, 8 },
+		{ 2, 2, (GLuint)(unitCoordinates ? GL_UNSIGNED_SHORT : GL_HALF_FLOAT), unitCoordinates ? 1u : 0u, 12 }
+	};
+	memcpy(packed.attributes, layout, sizeof(layout));
+	glm::vec3 scale, offset;
+	UPositionQuantization(&packed, scale, offset);
+
+	vertices.assign((size_t)header->vertexCount * PACKED_VERTEX_STRIDE, 0);
+	for (GLuint v = 0; v < header->vertexCount; v++) {
+		unsigned char* out = &vertices[(size_t)v * PACKED_VERTEX_STRIDE];
+		glm::vec3 position = (UReadAttribute(header, 0, v) - offset) / scale;
+		GLshort quantized[3];
+		for (int k = 0; k < 3; k++) {
+			quantized[k] = (GLshort)glm::clamp(floor(position[k] + 0.5f), -32767.0f, 32767.0f);
+		}
+		memcpy(out, quantized, sizeof(quantized));
+
+		glm::vec3 normal = UReadAttribute(header, 1, v);
+		if (glm::length(normal) > 0.0f) {
+			normal = glm::normalize(normal);
+		}
+		GLuint packedNormal = 0;
+		for (int k = 0; k < 3; k++) {
+			packedNormal |= ((GLuint)(int)floor(glm::clamp(normal[k], -1.0f, 1.0f) * 511.0f + 0.5f) & 0x3ff) << (10 * k);
+		}
+		memcpy(out + 8, &packedNormal, sizeof(packedNormal));
+
+		glm::vec3 coordinate = UReadAttribute(header, 2, v);
+		GLushort coordinates[2];
+		for (int k = 0; k < 2; k++) {
+			coordinates[k] = unitCoordinates ? (GLushort)floor(coordinate[k] * 65535.0f + 0.5f) : UFloatToHalf(coordinate[k]);
+		}
+		memcpy(out + 12, coordinates, sizeof(coordinates));
+	}
+}
+
+// Passes the dequantization of the chair positions to the bound program
+void USetPositionUniforms(const UProgramInfo& info) {
+	glUniform3fv(UUniformLocation(info, "positionScale"), 1, glm::value_ptr(positionScale));
+	glUniform3fv(UUniformLocation(info, "positionOffset"), 1, glm::value_ptr(positionOffset));
+}
+
+// IEEE half precision conversions, rounding to nearest; values too small for a normal half become zero
+GLushort UFloatToHalf(GLfloat value) {
+	GLuint bits;
+	memcpy(&bits, &value, sizeof(bits));
+	GLushort sign = (GLushort)((bits >> 16) & 0x8000);
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	GLuint mantissa = bits & 0x7fffff;
+	if (exponent <= 0) {
+		return sign;
+	}
+	if (exponent >= 31) {
+		return (GLushort)(sign | 0x7c00); // Infinity
+	}
+	GLuint half = ((GLuint)exponent << 10) | (mantissa >> 13);
+	half += (mantissa >> 12) & 1; // A carry into the exponent is still the correctly rounded value
+	return (GLushort)(sign | min(half, (GLuint)0x7c00));
+}
+
+GLfloat UHalfToFloat(GLushort value) {
+	GLuint sign = (GLuint)(value & 0x8000) << 16;
+	GLuint exponent = (value >> 10) & 0x1f;
+	GLuint mantissa = value & 0x3ff;
+	GLuint bits;
+	if (exponent == 0) {
+		GLfloat subnormal = mantissa / 16777216.0f; // 2^-24 per step
+		return sign ? -subnormal : subnormal;
+	}
+	if (exponent == 31) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else {
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	}
+	GLfloat result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+// Generates the simplified meshes of the mapped mesh; their indices go after the original ones in the index buffer
+void UBuildLods(const UMeshFileHeader* header, vector<GLuint>& lodIndices) {
+	ULodData& lod = lodData;
+	const GLuint* indices = (const GLuint*)((const unsigned char*)header + header->indexOffset);
+
+	vector<glm::vec3> positions(header->vertexCount), normals(header->vertexCount);
+	for (GLuint v = 0; v < header->vertexCount; v++) {
+		positions[v] = UReadAttribute(header, 0, v);
+		normals[v] = UReadAttribute(header, 1, v);
+	}
+
+	glm::vec3 boundsMin(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]);
+	glm::vec3 boundsMax(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]);
+	glm::vec3 size = boundsMax - boundsMin;
+	lod.bounds = glm::vec4((boundsMin + boundsMax) * 0.5f, glm::length(size) * 0.5f);
+
+	// Each level clusters the previous level's triangles on a coarser grid, so the triangle counts only go down; a level
+	// that collapses completely or removes nothing reuses the one before
+	const GLfloat cellsAcross[LOD_MESHES] = { 0.0f, 12.0f, 5.0f };
+	vector<GLuint> previous(indices, indices + header->indexCount);
+	lod.meshes[0].firstIndex = 0;
+	lod.meshes[0].indexCount = (GLsizei)header->indexCount;
+	lod.meshes[0].error = 0.0f;
+	for (int level = 1; level < LOD_MESHES; level++) {
+		vector<GLuint> simplified;
+		GLfloat error = 0.0f;
+		USimplifyMesh(positions, normals, &previous[0], previous.size(), glm::max(size.x, glm::max(size.y, size.z)) / cellsAcross[level],
+			simplified, error);
+		if (simplified.empty() || simplified.size() >= previous.size()) {
+			lod.meshes[level] = lod.meshes[level - 1];
+			continue;
+		}
+		lod.meshes[level].firstIndex = header->indexCount + (GLuint)lodIndices.size();
+		lod.meshes[level].indexCount = (GLsizei)simplified.size();
+		lod.meshes[level].error = error + lod.meshes[level - 1].error; // Vertices may have moved at every level
+		lodIndices.insert(lodIndices.end(), simplified.begin(), simplified.end());
+		previous.swap(simplified);
+	}
+
+	// The impostor's error is chosen so it takes over where the chair shrinks below impostorSize pixels
+	for (int level = 0; level < LOD_MESHES; level++) {
+		lod.switchError[level] = lod.meshes[level].error;
+	}
+	lod.switchError[LOD_MESHES] = glm::max(lod.bounds.w * 2.0f * lodThreshold / impostorSize, lod.switchError[LOD_MESHES - 1]);
+	lod.impostorReady = false;
+
+	cout << "Levels of detail:";
+	for (int level = 0; level < LOD_MESHES; level++) {
+		cout << "  " << lod.meshes[level].indexCount / 3 << " triangles (error " << lod.meshes[level].error << ")";
+	}
+	cout << endl;
+}
+
+// Vertex clustering: vertices sharing a grid cell and a dominant normal direction collapse onto the first of them, and
+// triangles that lose a corner or repeat another disappear. Reports the largest distance a vertex moved
+void USimplifyMesh(const vector<glm::vec3>& positions, const vector<glm::vec3>& normals, const GLuint* indices, size_t indexCount,
+	GLfloat cellSize, vector<GLuint>& simplified, GLfloat& error) {
+	unordered_map<unsigned long long, GLuint> clusters;
+	vector<GLuint> remap(positions.size());
+	error = 0.0f;
+
+	for (size_t v = 0; v < positions.size(); v++) {
+		glm::vec3 cell = glm::floor(positions[v] / cellSize);
+		const glm::vec3& normal = normals[v];
+		glm::vec3 magnitude = glm::abs(normal);
+		int axis = magnitude.x > magnitude.y ? (magnitude.x > magnitude.z ? 0 : 2) : (magnitude.y > magnitude.z ? 1 : 2);
+		int facing = axis * 2 + (normal[axis] < 0.0f ? 1 : 0); // Keeps opposite sides of thin parts apart
+
+		unsigned long long key = ((unsigned long long)((int)cell.x & 0xfffff) << 40) | ((unsigned long long)((int)cell.y & 0xfffff) << 20)
+			| (unsigned long long)((int)cell.z & 0xfffff);
+		key = key * 8 + facing;
+		remap[v] = clusters.insert(make_pair(key, (GLuint)v)).first->second;
+		error = glm::max(error, glm::length(positions[v] - positions[remap[v]]));
+	}
+
+	// Rotate each triangle to start at its smallest index so repeats are found regardless of the starting corner
+	set<pair<unsigned long long, GLuint> > seen;
+	simplified.clear();
+	for (size_t i = 0; i + 2 < indexCount; i += 3) {
+		GLuint a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+		if (a == b || b == c || a == c) {
+			continue;
+		}
+		while (a > b || a > c) {
+			GLuint first = a;
+			a = b;
+			b = c;
+			c = first;
+		}
+		if (seen.insert(make_pair(((unsigned long long)a << 32) | b, c)).second) {
+			simplified.push_back(a);
+			simplified.push_back(b);
+			simplified.push_back(c);
+		}
+	}
+}
+
+// Renders the chair from IMPOSTOR_AZIMUTHS x IMPOSTOR_ELEVATIONS directions into the color and normal atlases
+void UBakeImpostors() {
+	ULodData& lod = lodData;
+	int width = IMPOSTOR_AZIMUTHS * IMPOSTOR_TILE, height = IMPOSTOR_ELEVATIONS * IMPOSTOR_TILE;
+
+	GLuint atlases[2];
+	glGenTextures(2, atlases);
+	for (int i = 0; i < 2; i++) {
+		glBindTexture(GL_TEXTURE_2D, atlases[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 2); // Coarser mipmaps would blend neighbouring tiles
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	lod.albedoAtlas = atlases[0];
+	lod.normalAtlas = atlases[1];
+
+	GLuint framebuffer, depth;
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, lod.albedoAtlas, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, lod.normalAtlas, 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, drawBuffers);
+
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f); // Zero coverage outside the chair
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+	glUseProgram(impostorBakeProgram);
+	const UMeshRange& chair = meshRanges[chairMesh];
+	glBindVertexArray(vertexFormats[chair.format].vertexArray);
+	glDisableVertexAttribArray(3); // A single copy of the mesh, no instance indices
+	glBindTexture(GL_TEXTURE_2D, UResidentTexture(chairTexture));
+
+	// Orthographic views framed on the bounding sphere, the same directions the impostor shader snaps to
+	glm::vec3 center(lod.bounds);
+	GLfloat radius = lod.bounds.w;
+	for (int row = 0; row < IMPOSTOR_ELEVATIONS; row++) {
+		for (int column = 0; column < IMPOSTOR_AZIMUTHS; column++) {
+			GLfloat azimuth = glm::radians(360.0f) * column / IMPOSTOR_AZIMUTHS;
+			GLfloat elevation = glm::radians(180.0f) * (row + 0.5f) / IMPOSTOR_ELEVATIONS - glm::radians(90.0f);
+			glm::vec3 direction(sin(azimuth) * cos(elevation), sin(elevation), cos(azimuth) * cos(elevation));
+
+			glm::mat4 bakeView = glm::lookAt(center + direction * radius * 2.0f, center, glm::vec3(0.0f, 1.0f, 0.0f));
+			glm::mat4 bakeProjection = glm::ortho(-radius, radius, -radius, radius, radius, radius * 3.0f);
+			glUniformMatrix4fv(UUniformLocation(impostorBakeProgramInfo, "bakeViewProjection"), 1, GL_FALSE, glm::value_ptr(bakeProjection * bakeView));
+			glViewport(column * IMPOSTOR_TILE, row * IMPOSTOR_TILE, IMPOSTOR_TILE, IMPOSTOR_TILE);
+			glDrawElementsBaseVertex(GL_TRIANGLES, lod.meshes[0].indexCount, GL_UNSIGNED_INT, (GLvoid*)(chair.firstIndex * sizeof(GLuint)), chair.baseVertex);
+		}
+	}
+
+	glEnableVertexAttribArray(3);
+	glBindVertexArray(0);
+	glUseProgram(shaderProgram);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(1, &depth);
+	glViewport(0, 0, WindowWidth, WindowHeight);
+
+	// The atlases stay bound to their own units from now on
+	glActiveTexture(GL_TEXTURE0 + IMPOSTOR_ALBEDO_UNIT);
+	glBindTexture(GL_TEXTURE_2D, lod.albedoAtlas);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glActiveTexture(GL_TEXTURE0 + IMPOSTOR_NORMAL_UNIT);
+	glBindTexture(GL_TEXTURE_2D, lod.normalAtlas);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	lod.impostorReady = true;
+}
+
+// Queues the chairs at the impostor level as instanced quads
+void UQueueImpostors() {
+	const UCullData& cull = cullData;
+	if (cull.lodCount[LOD_MESHES] == 0) {
+		return;
+	}
+
+	UDrawPacket packet;
+	packet.program = UVariantProgram(SHADER_IMPOSTOR, UDrawFeatures() | VARIANT_INSTANCED);
+	if (packet.program == 0) {
+		return;
+	}
+	packet.vertexArray = impostorVAO;
+	packet.texture = 0; // The atlases stay bound to their own units
+	packet.mode = GL_TRIANGLE_STRIP;
+	packet.count = 4;
+	packet.first = 0;
+	packet.baseVertex = 0;
+	packet.indexed = false;
+	packet.instances = (GLsizei)cull.lodCount[LOD_MESHES];
+	packet.instanceOffset = cull.visibleOffset + cull.lodFirst[LOD_MESHES] * sizeof(GLuint);
+	UQueueDraw(packet, QUEUE_PASS_OPAQUE, cull.lodNearest[LOD_MESHES]);
+}
+
+// Builds the packet's sort key and adds it to the queue
+void UQueueDraw(UDrawPacket& packet, int pass, GLfloat depth) {
+	URenderQueue& queue = renderQueue;
+	unsigned long long quantizedDepth = (unsigned long long)(glm::clamp(depth / farPlane, 0.0f, 1.0f) * 16777215.0f);
+	packet.key = ((unsigned long long)(pass & 0xf) << 60)
+		| ((unsigned long long)USortId(0, packet.program, 0xff) << 52)
+		| ((unsigned long long)USortId(2, packet.texture, 0xfff) << 40)
+		| ((unsigned long long)USortId(1, packet.vertexArray, 0xff) << 32)
+		| (quantizedDepth << 8)
+		| (unsigned long long)min(queue.packets.size(), (size_t)0xff); // Keeps equal keys in recording order
+	queue.packets.push_back(packet);
+}
+
+// Small id of a GL name for one key field, assigned on first sight; names beyond the field's range share its last id
+unsigned USortId(int state, GLuint name, unsigned limit) {
+	vector<GLuint>& names = renderQueue.names[state];
+	size_t id = find(names.begin(), names.end(), name) - names.begin();
+	if (id == names.size()) {
+		names.push_back(name);
+	}
+	return (unsigned)min(id, (size_t)limit);
+}
+
+// Sorts the packets by key a byte at a time, least significant first; bytes every key shares are skipped
+void URadixSort(vector<UDrawPacket>& packets, vector<UDrawPacket>& scratch) {
+	if (packets.size() < 2) {
+		return;
+	}
+	scratch.resize(packets.size());
+	for (int shift = 0; shift < 64; shift += 8) {
+		size_t counts[256] = {};
+		for (size_t i = 0; i < packets.size(); i++) {
+			counts[(packets[i].key >> shift) & 0xff]++;
+		}
+		if (counts[(packets[0].key >> shift) & 0xff] == packets.size()) {
+			continue;
+		}
+
+		// Counts become each byte value's first output position; the scatter is stable
+		size_t offset = 0;
+		for (int value = 0; value < 256; value++) {
+			size_t count = counts[value];
+			counts[value] = offset;
+			offset += count;
+		}
+		for (size_t i = 0; i < packets.size(); i++) {
+			scratch[counts[(packets[i].key >> shift) & 0xff]++] = packets[i];
+		}
+		packets.swap(scratch);
+	}
+}
+
+// Sorts the queued draws and issues each run sharing pass and state as one multi-draw, binding program, vertex array
+// and texture only when they change
+void USubmitRenderQueue() {
+	URenderQueue& queue = renderQueue;
+	URadixSort(queue.packets, queue.scratch);
+
+	// One command per packet, in submission order
+	queue.commands.resize(queue.packets.size());
+	for (size_t i = 0; i < queue.packets.size(); i++) {
+		const UDrawPacket& packet = queue.packets[i];
+		UDrawCommand& command = queue.commands[i];
+		GLuint baseInstance = (GLuint)(packet.instanceOffset / sizeof(GLuint));
+		command.count = (GLuint)packet.count;
+		command.instanceCount = (GLuint)packet.instances;
+		command.first = packet.indexed ? (GLuint)(packet.first / sizeof(GLuint)) : (GLuint)packet.first;
+		command.baseVertex = packet.indexed ? packet.baseVertex : (GLint)baseInstance;
+		command.baseInstance = packet.indexed ? baseInstance : 0;
+	}
+	bool indirect = indirectDraws && !queue.commands.empty() && queue.commands.size() <= INDIRECT_COMMANDS;
+	queue.indirect = indirect;
+	GLintptr commandOffset = 0;
+	if (indirect) {
+		GLsizeiptr bytes = queue.commands.size() * sizeof(UDrawCommand);
+		memcpy(UBeginDynamicWrite(indirectStream), &queue.commands[0], bytes);
+		commandOffset = UEndDynamicWrite(indirectStream, bytes);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectStream.buffer);
+	}
+
+	// Other passes change bindings between frames, so nothing is assumed to be bound yet
+	GLuint current[QUEUE_STATES] = { 0, 0, 0 };
+	bool known[QUEUE_STATES] = { false, false, false };
+	for (int state = 0; state < QUEUE_STATES; state++) {
+		queue.binds[state] = 0;
+		queue.skipped[state] = 0;
+	}
+	queue.drawCalls = 0;
+
+	int pass = QUEUE_PASS_OPAQUE; // The state every other pass leaves behind
+	for (size_t i = 0; i < queue.packets.size();) {
+		const UDrawPacket& packet = queue.packets[i];
+		size_t end = i + 1;
+		while (end < queue.packets.size() && USameBucket(packet, queue.packets[end])) {
+			end++;
+		}
+		int packetPass = (int)(packet.key >> 60);
+		if (packetPass != pass) {
+			USwitchQueuePass(pass, packetPass);
+			pass = packetPass;
+		}
+
+		const GLuint wanted[QUEUE_STATES] = { packet.program, packet.vertexArray, packet.texture };
+		for (int state = 0; state < QUEUE_STATES; state++) {
+			if (state == 2 && wanted[state] == 0) {
+				continue; // The program does not sample unit 0, whatever is bound there can stay
+			}
+			queue.skipped[state] += (unsigned)(end - i - 1); // The rest of the run shares the state
+			if (known[state] && current[state] == wanted[state]) {
+				queue.skipped[state]++;
+				continue;
+			}
+			if (state == 0) {
+				glUseProgram(wanted[state]);
+			}
+			else if (state == 1) {
+				glBindVertexArray(wanted[state]);
+			}
+			else {
+				glBindTexture(GL_TEXTURE_2D, wanted[state]);
+			}
+			current[state] = wanted[state];
+			known[state] = true;
+			queue.binds[state]++;
+		}
+
+		if (indirect) {
+			// The instance index attribute starts at the beginning of visibleStream; each command's base instance
+			// skips to its own indices
+			glBindBuffer(GL_ARRAY_BUFFER, visibleStream.buffer);
+			glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			const GLvoid* commands = (const GLvoid*)(commandOffset + i * sizeof(UDrawCommand));
+			if (packet.indexed) {
+				glMultiDrawElementsIndirect(packet.mode, GL_UNSIGNED_INT, commands, (GLsizei)(end - i), sizeof(UDrawCommand));
+			}
+			else {
+				glMultiDrawArraysIndirect(packet.mode, commands, (GLsizei)(end - i), sizeof(UDrawCommand));
+			}
+			queue.drawCalls++;
+		}
+		else {
+			// The same commands from the CPU: the attribute is pointed at each draw's indices instead of using a base instance
+			for (size_t k = i; k < end; k++) {
+				const UDrawCommand& command = queue.commands[k];
+				GLuint baseInstance = packet.indexed ? command.baseInstance : (GLuint)command.baseVertex;
+				glBindBuffer(GL_ARRAY_BUFFER, visibleStream.buffer);
+				glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)(baseInstance * sizeof(GLuint)));
+				glBindBuffer(GL_ARRAY_BUFFER, 0);
+				if (packet.indexed) {
+					glDrawElementsInstancedBaseVertex(packet.mode, command.count, GL_UNSIGNED_INT, (GLvoid*)(command.first * sizeof(GLuint)),
+						command.instanceCount, command.baseVertex);
+				}
+				else {
+					glDrawArraysInstanced(packet.mode, command.first, command.count, command.instanceCount);
+				}
+				queue.drawCalls++;
+			}
+		}
+		i = end;
+	}
+	if (pass != QUEUE_PASS_OPAQUE) {
+		USwitchQueuePass(pass, QUEUE_PASS_OPAQUE);
+	}
+	if (indirect) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+	for (int state = 0; state < QUEUE_STATES; state++) {
+		queue.totalBinds[state] += queue.binds[state];
+		queue.totalSkipped[state] += queue.skipped[state];
+	}
+	queue.totalPackets += queue.packets.size();
+	queue.totalDrawCalls += queue.drawCalls;
+	queue.submissions++;
+}
+
+// Whether a packet can join the multi-draw started by first: same pass, state, primitive and kind of draw
+bool USameBucket(const UDrawPacket& first, const UDrawPacket& packet) {
+	return (first.key >> 60) == (packet.key >> 60) && first.program == packet.program && first.vertexArray == packet.vertexArray
+		&& first.texture == packet.texture && first.mode == packet.mode && first.indexed == packet.indexed;
+}
+
+// Sets the depth and color writes of a queue pass and counts the samples of the pre-pass passes
+void USwitchQueuePass(int from, int to) {
+	UDepthPrepass& prepass = depthPrepass;
+	int slot = prepass.frame % PREPASS_QUERY_FRAMES;
+	if (from == QUEUE_PASS_DEPTH || from == QUEUE_PASS_EQUAL) {
+		glEndQuery(GL_SAMPLES_PASSED);
+	}
+
+	if (to == QUEUE_PASS_DEPTH) {
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glBeginQuery(GL_SAMPLES_PASSED, prepass.queries[slot][0]);
+	}
+	else if (to == QUEUE_PASS_EQUAL) {
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_FALSE); // The depth pass already wrote it
+		glDepthFunc(GL_EQUAL);
+		glBeginQuery(GL_SAMPLES_PASSED, prepass.queries[slot][1]);
+		prepass.pending[slot] = true;
+	}
+	else {
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LEQUAL);
+	}
+}
+
+// Creates the shadow cube maps and the framebuffer their faces are rendered through
+void UCreateShadowMaps() {
+	UShadowMaps& shadows = shadowMaps;
+	shadows.range = farPlane; // Anything the camera can see can cast a shadow
+	shadows.valid = false;
+	shadows.renders = 0;
+	if (shadowSize == 0) {
+		return;
+	}
+
+	glGenTextures(SHADOW_LIGHTS, shadows.cubes);
+	for (int light = 0; light < SHADOW_LIGHTS; light++) {
+		glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT + light);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, shadows.cubes[light]);
+		for (int face = 0; face < 6; face++) {
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT24, shadowSize, shadowSize, 0,
+				GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		}
+		// Hardware comparison; linear filtering blends the four nearest results where the driver supports it
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	glGenFramebuffers(1, &shadows.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, shadows.framebuffer);
+	glDrawBuffer(GL_NONE); // Depth only
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Points the bound lit program's shadow samplers at their units and passes the filter settings
+void USetShadowUniforms(const UProgramInfo& info) {
+	glUniform1i(UUniformLocation(info, "shadowMap0"), SHADOW_MAP_UNIT);
+	glUniform1i(UUniformLocation(info, "shadowMap1"), SHADOW_MAP_UNIT + 1);
+	glUniform4f(UUniformLocation(info, "shadowParams"), 1.0f / shadowMaps.range, shadowSize > 0 ? 2.0f / shadowSize : 0.0f,
+		(GLfloat)(shadowKernel / 2), shadowSize > 0 ? (GLfloat)SHADOW_LIGHTS : 0.0f);
+}
+
+// Renders the cube maps of every shadowed light, unless the cached ones were rendered for the same lights and scene.
+// Orbiting the camera reuses them; only zooming, which scales the chairs, renders them again
+void UUpdateShadowMaps(const glm::mat4& model) {
+	UShadowMaps& shadows = shadowMaps;
+	if (shadowSize == 0) {
+		return;
+	}
+
+	bool current = shadows.valid && shadows.cachedModel == model;
+	for (int light = 0; light < SHADOW_LIGHTS; light++) {
+		current = current && shadows.cachedLights[light] == glm::vec3(sceneLights[light].positionRange);
+	}
+	if (current) {
+		return;
+	}
+
+	UGpuProfileScope shadowPass("shadow pass");
+
+	// Cube face directions in GL face order, with the up vectors of the cube map convention
+	static const glm::vec3 faceDirections[6] = { glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+		glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f) };
+	static const glm::vec3 faceUps[6] = { glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f),
+		glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f) };
+	GLfloat shadowNear = 0.05f;
+	glm::mat4 faceProjection = glm::frustum(-shadowNear, shadowNear, -shadowNear, shadowNear, shadowNear, shadows.range); // 90 degrees
+
+	glUseProgram(shadowProgram);
+	glUniformMatrix4fv(shadowProgramInfo.modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+	const UMeshRange& chair = meshRanges[chairMesh];
+	glBindVertexArray(vertexFormats[chair.format].vertexArray);
+	glDisableVertexAttribArray(3); // Every instance is drawn, no visible index list
+	glBindFramebuffer(GL_FRAMEBUFFER, shadows.framebuffer);
+	glViewport(0, 0, shadowSize, shadowSize);
+
+	for (int light = 0; light < SHADOW_LIGHTS; light++) {
+		glm::vec3 position(sceneLights[light].positionRange);
+		glUniform4f(UUniformLocation(shadowProgramInfo, "shadowLight"), position.x, position.y, position.z, 1.0f / shadows.range);
+		for (int face = 0; face < 6; face++) {
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, shadows.cubes[light], 0);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			glm::mat4 faceView = glm::lookAt(position, position + faceDirections[face], faceUps[face]);
+			glUniformMatrix4fv(UUniformLocation(shadowProgramInfo, "faceViewProjection"), 1, GL_FALSE, glm::value_ptr(faceProjection * faceView));
+			glDrawElementsInstancedBaseVertex(GL_TRIANGLES, lodData.meshes[0].indexCount, GL_UNSIGNED_INT, (GLvoid*)(chair.firstIndex * sizeof(GLuint)),
+				(GLsizei)chairInstances.size(), chair.baseVertex);
+		}
+		shadows.cachedLights[light] = position;
+	}
+
+	glEnableVertexAttribArray(3);
+	glBindVertexArray(0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0, 0, WindowWidth, WindowHeight);
+	glUseProgram(shaderProgram);
+
+	shadows.cachedModel = model;
+	shadows.valid = true;
+	shadows.renders++;
+}
+
+// Unwraps the mesh into charts and lays out the lightmap atlas, one tile per chair. The texture coordinates of each
+// connected patch are reused as its layout inside the chart. Patches whose coordinates overlap or are missing, such as
+// coplanar faces of the chair that share vertices but each map the whole texture, are projected along their normal
+void UCreateLightmap() {
+	ULightmap& map = lightmap;
+	map.ready = false;
+	map.valid = false;
+	map.stage = LIGHTMAP_IDLE;
+	map.timerPending = false;
+	map.bakes = 0;
+	map.bakeTime = 0.0;
+	if (!lightmapEnabled) {
+		return;
+	}
+	if (vertexFormats[meshRanges[chairMesh].format].layout.attributeCount >= MESH_MAX_ATTRIBUTES) {
+		cout << "Lightmap: the mesh has no attribute left for the lightmap coordinates, lighting stays per pixel" << endl;
+		return;
+	}
+
+	const UMeshFileHeader* header = (const UMeshFileHeader*)chairMeshFile.data;
+	const GLuint* indices = (const GLuint*)((const unsigned char*)header + header->indexOffset);
+	GLuint vertexCount = header->vertexCount;
+	map.positions.resize(vertexCount);
+	map.normals.resize(vertexCount);
+	vector<glm::vec2> textureCoordinates(vertexCount);
+	for (GLuint v = 0; v < vertexCount; v++) {
+		map.positions[v] = UReadAttribute(header, 0, v);
+		map.normals[v] = UReadAttribute(header, 1, v);
+		glm::vec3 coordinate = UReadAttribute(header, 2, v);
+		textureCoordinates[v] = glm::vec2(coordinate.x, coordinate.y);
+	}
+
+	// Triangles sharing a vertex belong to the same chart; vertices are only shared within a smooth, continuously
+	// mapped patch, so each vertex ends up in exactly one chart
+	vector<GLuint> parent(vertexCount);
+	for (GLuint v = 0; v < vertexCount; v++) {
+		parent[v] = v;
+	}
+	struct Root {
+		static GLuint Find(vector<GLuint>& parent, GLuint v) {
+			while (parent[v] != v) {
+				v = parent[v] = parent[parent[v]];
+			}
+			return v;
+		}
+	};
+	for (GLuint i = 0; i + 2 < header->indexCount; i += 3) {
+		GLuint a = Root::Find(parent, indices[i]);
+		parent[Root::Find(parent, indices[i + 1])] = a;
+		parent[Root::Find(parent, indices[i + 2])] = a;
+	}
+	map.charts.clear();
+	unordered_map<GLuint, size_t> chartOfRoot;
+	for (GLuint i = 0; i + 2 < header->indexCount; i += 3) {
+		size_t chart = chartOfRoot.insert(make_pair(Root::Find(parent, indices[i]), map.charts.size())).first->second;
+		if (chart == map.charts.size()) {
+			map.charts.push_back(vector<GLuint>());
+		}
+		map.charts[chart].push_back(i);
+	}
+
+	// Charts get equal square cells in a grid inside the tile, with a gutter on every side
+	int chartsAcross = (int)ceil(sqrt((double)map.charts.size()));
+	int cell = lightmapSize / max(chartsAcross, 1);
+	if (cell - 2 * LIGHTMAP_GUTTER < 2) {
+		cout << "Lightmap: " << map.charts.size() << " charts need more than " << lightmapSize << " texels per chair, lighting stays per pixel" << endl;
+		return;
+	}
+	map.coordinates.assign(vertexCount, glm::vec2(0.0f));
+	for (size_t chart = 0; chart < map.charts.size(); chart++) {
+		const vector<GLuint>& triangles = map.charts[chart];
+		glm::vec2 low(1e30f), high(-1e30f);
+		glm::vec3 normal(0.0f);
+		GLfloat mappedArea = 0.0f;
+		for (size_t t = 0; t < triangles.size(); t++) {
+			const glm::vec2* coordinate[3];
+			for (int corner = 0; corner < 3; corner++) {
+				coordinate[corner] = &textureCoordinates[indices[triangles[t] + corner]];
+				low = glm::min(low, *coordinate[corner]);
+				high = glm::max(high, *coordinate[corner]);
+			}
+			glm::vec2 edge1 = *coordinate[1] - *coordinate[0], edge2 = *coordinate[2] - *coordinate[0];
+			mappedArea += fabs(edge1.x * edge2.y - edge2.x * edge1.y) * 0.5f;
+			const glm::vec3& a = map.positions[indices[triangles[t]]];
+			normal += glm::cross(map.positions[indices[triangles[t] + 1]] - a, map.positions[indices[triangles[t] + 2]] - a);
+		}
+
+		// Without a usable mapping, drop the coordinate the patch faces along. Triangles covering more than the bounds
+		// of their coordinates must overlap somewhere
+		bool projected = high.x - low.x < 1e-6f || high.y - low.y < 1e-6f || mappedArea > (high.x - low.x) * (high.y - low.y) * 1.01f;
+		glm::vec3 magnitude = glm::abs(normal);
+		int axis = magnitude.x > magnitude.y ? (magnitude.x > magnitude.z ? 0 : 2) : (magnitude.y > magnitude.z ? 1 : 2);
+		if (projected) {
+			low = glm::vec2(1e30f);
+			high = glm::vec2(-1e30f);
+			for (size_t t = 0; t < triangles.size(); t++) {
+				for (int corner = 0; corner < 3; corner++) {
+					const glm::vec3& position = map.positions[indices[triangles[t] + corner]];
+					glm::vec2 planar(position[(axis + 1) % 3], position[(axis + 2) % 3]);
+					low = glm::min(low, planar);
+					high = glm::max(high, planar);
+				}
+			}
+		}
+
+		glm::vec2 origin = glm::vec2((GLfloat)((chart % chartsAcross) * cell), (GLfloat)((chart / chartsAcross) * cell)) + glm::vec2((GLfloat)LIGHTMAP_GUTTER);
+		GLfloat inside = (GLfloat)(cell - 2 * LIGHTMAP_GUTTER);
+		glm::vec2 extent = glm::max(high - low, glm::vec2(1e-6f));
+		for (size_t t = 0; t < triangles.size(); t++) {
+			for (int corner = 0; corner < 3; corner++) {
+				GLuint v = indices[triangles[t] + corner];
+				glm::vec2 source = projected ? glm::vec2(map.positions[v][(axis + 1) % 3], map.positions[v][(axis + 2) % 3]) : textureCoordinates[v];
+				map.coordinates[v] = (origin + (source - low) / extent * inside) / (GLfloat)lightmapSize;
+			}
+		}
+	}
+
+	// Tiles fill a square atlas row by row, within what the driver supports
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	int count = (int)chairInstances.size();
+	map.tilesAcross = (int)ceil(sqrt((double)count));
+	map.width = map.tilesAcross * lightmapSize;
+	map.height = (count + map.tilesAcross - 1) / map.tilesAcross * lightmapSize;
+	if (map.width > min(maxSize, 8192)) {
+		cout << "Lightmap: " << count << " chairs of " << lightmapSize << " texels do not fit one atlas, lighting stays per pixel" << endl;
+		return;
+	}
+	map.texels.assign((size_t)map.width * map.height, glm::vec3(0.0f));
+	map.covered.assign(map.texels.size(), 0);
+
+	glGenTextures(1, &map.texture);
+	glActiveTexture(GL_TEXTURE0 + LIGHTMAP_UNIT);
+	glBindTexture(GL_TEXTURE_2D, map.texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, map.width, map.height, 0, GL_RGB, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // No mipmaps, they would blend neighboring charts
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
+
+	// The chair moves to a vertex format with the lightmap coordinates as attribute 4
+	UAddLightmapCoordinates(chairMesh, &map.coordinates[0]);
+
+	map.ready = true;
+	cout << "Lightmap: " << map.charts.size() << " charts, " << map.width << "x" << map.height << " texels for " << count << " chairs" << endl;
+}
+
+// Bakes the lightmap for the scene transform, unless the atlas was already baked for it. After the first bake a new
+// transform has to last two frames, so zooming does not start a bake per step. The bake runs in the background and
+// the chairs stay lit per pixel until it is done; the benchmark waits for it instead, so its frames do not depend on
+// timing
+void UUpdateLightmap(const glm::mat4& model) {
+	ULightmap& map = lightmap;
+	if (!map.ready) {
+		return;
+	}
+	UPollLightmapBake();
+	if (map.stage != LIGHTMAP_IDLE || (map.valid && map.cachedModel == model)) {
+		return; // A bake for another transform is still running; it is discarded, and the next frame starts over
+	}
+	if (map.bakes > 0 && map.settlingModel != model) {
+		map.valid = false;
+		map.settlingModel = model;
+		if (!benchmarkMode) {
+			UMarkDirty(); // Draw once more, to bake if nothing changes in between
+		}
+		return;
+	}
+
+	// The chairs are traced in world space, so every bake first rebuilds the hierarchy
+	map.valid = false;
+	map.bakingModel = model;
+	map.bakeStart = chrono::high_resolution_clock::now();
+	map.stage = LIGHTMAP_TRACING_BVH;
+	UStartBackground(1, UBuildLightmapBvh);
+	if (benchmarkMode) {
+		UFinishBackground();
+		UPollLightmapBake();
+		UFinishBackground();
+		UPollLightmapBake();
+	}
+	else {
+		UPollLightmapBake();
+	}
+}
+
+// Moves every chair into world space for the running bake and builds the hierarchy over them. A background item
+void UBuildLightmapBvh(int) {
+	ULightmap& map = lightmap;
+	const UMeshFileHeader* header = (const UMeshFileHeader*)chairMeshFile.data;
+	const GLuint* indices = (const GLuint*)((const unsigned char*)header + header->indexOffset);
+	map.bvh.corners.resize(chairInstances.size() * header->indexCount);
+	for (size_t instance = 0; instance < chairInstances.size(); instance++) {
+		glm::mat4 world = map.bakingModel * chairInstances[instance].model;
+		glm::vec3* corners = &map.bvh.corners[instance * header->indexCount];
+		for (GLuint i = 0; i < header->indexCount; i++) {
+			corners[i] = glm::vec3(world * glm::vec4(map.positions[indices[i]], 1.0f));
+		}
+	}
+	UBuildBvh(map.bvh);
+}
+
+// Moves the running bake on: helps with its items when there are no workers, starts the chart stage once the
+// hierarchy is built and uploads the finished atlas if the scene still has the transform it was baked for. Keeps a
+// timer checking while the bake runs, so it also finishes while the viewer is idle
+void UPollLightmapBake() {
+	ULightmap& map = lightmap;
+	if (map.stage == LIGHTMAP_IDLE) {
+		return;
+	}
+	if (workerPool.threads.empty() && !benchmarkMode) {
+		URunBackground(LIGHTMAP_FRAME_BUDGET);
+	}
+	if (!UBackgroundDone()) {
+		if (!map.timerPending && !benchmarkMode) {
+			map.timerPending = true;
+			glutTimerFunc(LIGHTMAP_POLL_INTERVAL, ULightmapTimer, 0);
+		}
+		return;
+	}
+
+	if (map.stage == LIGHTMAP_TRACING_BVH) {
+		map.stage = LIGHTMAP_BAKING_CHARTS;
+		UStartBackground((int)(chairInstances.size() * map.charts.size()), UBakeChart);
+		UPollLightmapBake();
+		return;
+	}
+
+	map.stage = LIGHTMAP_IDLE;
+	if (map.bakingModel != UCurrentSnapshot().model) {
+		if (!benchmarkMode) {
+			UMarkDirty(); // The scene moved on meanwhile; a frame starts a bake for where it is now
+		}
+		return;
+	}
+	glActiveTexture(GL_TEXTURE0 + LIGHTMAP_UNIT);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, map.width, map.height, GL_RGB, GL_FLOAT, &map.texels[0]);
+	glActiveTexture(GL_TEXTURE0);
+
+	map.cachedModel = map.bakingModel;
+	map.valid = true;
+	map.bakeTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - map.bakeStart).count();
+	if (map.bakes++ == 0) {
+		cout << "Lightmap: baked " << map.bvh.corners.size() / 3 << " triangles with " << lightmapSamples << " occlusion rays per texel on "
+			<< workerPool.threads.size() + 1 << " threads in " << map.bakeTime << " ms" << endl;
+	}
+	if (!benchmarkMode) {
+		UMarkDirty(); // Draw with the new atlas
+	}
+}
+
+// Checks on the running bake while no frames are drawn
+void ULightmapTimer(int) {
+	lightmap.timerPending = false;
+	UPollLightmapBake();
+}
+
+// Bakes one chart of one chair: rasterizes its triangles into the chart's cell, then copies edge texels outwards
+// over the gutter. A background item; the items write disjoint cells
+void UBakeChart(int job) {
+	ULightmap& map = lightmap;
+	size_t instance = job / map.charts.size(), chart = job % map.charts.size();
+	const UMeshFileHeader* header = (const UMeshFileHeader*)chairMeshFile.data;
+	const GLuint* indices = (const GLuint*)((const unsigned char*)header + header->indexOffset);
+
+	glm::mat4 world = map.bakingModel * chairInstances[instance].model;
+	glm::mat3 normalMatrix = UNormalMatrix(map.bakingModel) * chairInstances[instance].normalMatrix;
+	GLfloat scale = glm::length(glm::vec3(world[0]));
+	GLfloat occlusionDistance = lodData.bounds.w * scale; // Only nearby geometry darkens the ambient light
+	GLfloat bias = 1e-3f * lodData.bounds.w * scale; // Ray origins leave the surface by this much
+
+	int chartsAcross = (int)ceil(sqrt((double)map.charts.size()));
+	int cell = lightmapSize / chartsAcross;
+	int cellX = (int)(chart % chartsAcross) * cell + (int)(instance % map.tilesAcross) * lightmapSize;
+	int cellY = (int)(chart / chartsAcross) * cell + (int)(instance / map.tilesAcross) * lightmapSize;
+	for (int y = 0; y < cell; y++) {
+		memset(&map.covered[(size_t)(cellY + y) * map.width + cellX], 0, cell);
+	}
+
+	// A texel belongs to the triangle its center falls in
+	const vector<GLuint>& triangles = map.charts[chart];
+	for (size_t t = 0; t < triangles.size(); t++) {
+		GLuint v[3] = { indices[triangles[t]], indices[triangles[t] + 1], indices[triangles[t] + 2] };
+		glm::vec2 corner[3];
+		for (int k = 0; k < 3; k++) {
+			corner[k] = map.coordinates[v[k]] * (GLfloat)lightmapSize - glm::vec2((GLfloat)(cellX % lightmapSize), (GLfloat)(cellY % lightmapSize));
+		}
+		GLfloat area = (corner[1].x - corner[0].x) * (corner[2].y - corner[0].y) - (corner[2].x - corner[0].x) * (corner[1].y - corner[0].y);
+		if (fabs(area) < 1e-12f) {
+			continue;
+		}
+		glm::vec2 low = glm::min(corner[0], glm::min(corner[1], corner[2])), high = glm::max(corner[0], glm::max(corner[1], corner[2]));
+		for (int y = max(0, (int)floor(low.y)); y < min(cell, (int)ceil(high.y)); y++) {
+			for (int x = max(0, (int)floor(low.x)); x < min(cell, (int)ceil(high.x)); x++) {
+				glm::vec2 p((GLfloat)x + 0.5f, (GLfloat)y + 0.5f);
+				GLfloat b0 = ((corner[1].x - p.x) * (corner[2].y - p.y) - (corner[2].x - p.x) * (corner[1].y - p.y)) / area;
+				GLfloat b1 = ((corner[2].x - p.x) * (corner[0].y - p.y) - (corner[0].x - p.x) * (corner[2].y - p.y)) / area;
+				GLfloat b2 = 1.0f - b0 - b1;
+				size_t texel = (size_t)(cellY + y) * map.width + cellX + x;
+				if (b0 < -1e-4f || b1 < -1e-4f || b2 < -1e-4f || map.covered[texel]) {
+					continue;
+				}
+				glm::vec3 position = map.positions[v[0]] * b0 + map.positions[v[1]] * b1 + map.positions[v[2]] * b2;
+				glm::vec3 normal = map.normals[v[0]] * b0 + map.normals[v[1]] * b1 + map.normals[v[2]] * b2;
+				map.texels[texel] = UBakeTexel(glm::vec3(world * glm::vec4(position, 1.0f)), glm::normalize(normalMatrix * normal),
+					occlusionDistance, bias, (unsigned)texel);
+				map.covered[texel] = 1;
+			}
+		}
+	}
+
+	// Texels the triangles missed take the average of their covered neighbors, one ring per pass
+	for (int pass = 0; pass < LIGHTMAP_GUTTER + 1; pass++) {
+		vector<pair<size_t, glm::vec3> > filled;
+		for (int y = 0; y < cell; y++) {
+			for (int x = 0; x < cell; x++) {
+				size_t texel = (size_t)(cellY + y) * map.width + cellX + x;
+				if (map.covered[texel]) {
+					continue;
+				}
+				glm::vec3 sum(0.0f);
+				int neighbors = 0;
+				for (int dy = max(y - 1, 0); dy <= min(y + 1, cell - 1); dy++) {
+					for (int dx = max(x - 1, 0); dx <= min(x + 1, cell - 1); dx++) {
+						size_t neighbor = (size_t)(cellY + dy) * map.width + cellX + dx;
+						if (map.covered[neighbor]) {
+							sum += map.texels[neighbor];
+							neighbors++;
+						}
+					}
+				}
+				if (neighbors > 0) {
+					filled.push_back(make_pair(texel, sum / (GLfloat)neighbors));
+				}
+			}
+		}
+		for (size_t i = 0; i < filled.size(); i++) {
+			map.texels[filled[i].first] = filled[i].second;
+			map.covered[filled[i].first] = 2;
+		}
+	}
+}
+
+// Light reaching a surface point without its color: the diffuse part of ShadeFragment for every light, with a shadow
+// ray instead of the shadow maps, plus the ambient light scaled by the unoccluded fraction of the hemisphere
+glm::vec3 UBakeTexel(const glm::vec3& position, const glm::vec3& normal, GLfloat occlusionDistance, GLfloat bias, unsigned seed) {
+	const UBvh& bvh = lightmap.bvh;
+	glm::vec3 origin = position + normal * bias;
+	glm::vec3 lighting(0.0f), ambient(0.0f);
+
+	for (size_t i = 0; i < sceneLights.size(); i++) {
+		const ULight& light = sceneLights[i];
+		ambient += glm::vec3(light.colorSpecular) * light.params.x;
+
+		glm::vec3 toLight = glm::vec3(light.positionRange) - origin;
+		GLfloat distance = glm::length(toLight);
+		glm::vec3 direction = toLight / distance;
+		GLfloat falloff = glm::clamp(1.0f - pow(distance / light.positionRange.w, 4.0f), 0.0f, 1.0f);
+		GLfloat impact = glm::max(glm::dot(normal, direction), 0.0f);
+		GLfloat cone = 1.0f;
+		if (light.directionCosine.w > -1.0f) {
+			GLfloat t = glm::clamp((glm::dot(-direction, glm::vec3(light.directionCosine)) - light.directionCosine.w)
+				/ (light.params.z - light.directionCosine.w), 0.0f, 1.0f);
+			cone = t * t * (3.0f - 2.0f * t); // smoothstep, as in the shader
+		}
+		if (falloff * impact * cone <= 0.0f || UOccluded(bvh, origin, direction, distance - bias)) {
+			continue;
+		}
+		lighting += falloff * falloff * cone * impact * glm::vec3(light.colorSpecular);
+	}
+
+	// Cosine-weighted hemisphere directions from a Hammersley set, shifted per texel so the noise does not form a pattern
+	if (lightmapSamples > 0) {
+		glm::vec3 side = glm::normalize(glm::cross(normal, fabs(normal.y) < 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f)));
+		glm::vec3 up = glm::cross(normal, side);
+		seed = seed * 747796405u + 2891336453u;
+		GLfloat shiftU = (seed >> 8) / 16777216.0f;
+		seed = seed * 747796405u + 2891336453u;
+		GLfloat shiftV = (seed >> 8) / 16777216.0f;
+		int open = 0;
+		for (int s = 0; s < lightmapSamples; s++) {
+			unsigned bits = (unsigned)s;
+			bits = (bits << 16) | (bits >> 16);
+			bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+			bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+			bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+			bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+			GLfloat u = fmod((s + 0.5f) / lightmapSamples + shiftU, 1.0f);
+			GLfloat v = fmod(bits / 4294967296.0f + shiftV, 1.0f);
+			GLfloat radius = sqrt(u), angle = glm::radians(360.0f) * v;
+			glm::vec3 direction = side * (radius * cos(angle)) + up * (radius * sin(angle)) + normal * sqrt(1.0f - u);
+			if (!UOccluded(bvh, origin, direction, occlusionDistance)) {
+				open++;
+			}
+		}
+		ambient *= open / (GLfloat)lightmapSamples;
+	}
+	return lighting + ambient;
+}
+
+// Builds a bounding volume hierarchy over the triangles in bvh.corners, splitting each node at the median of the
+// triangle centers along its longest axis, and reorders the corners so every leaf owns a contiguous range
+void UBuildBvh(UBvh& bvh) {
+	size_t triangleCount = bvh.corners.size() / 3;
+	vector<GLuint> order(triangleCount);
+	vector<glm::vec3> centers(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++) {
+		order[t] = (GLuint)t;
+		centers[t] = (bvh.corners[t * 3] + bvh.corners[t * 3 + 1] + bvh.corners[t * 3 + 2]) / 3.0f;
+	}
+
+	bvh.nodes.clear();
+	bvh.nodes.push_back(UBvhNode());
+	vector<pair<GLuint, pair<GLuint, GLuint> > > pending(1, make_pair(0u, make_pair(0u, (GLuint)triangleCount)));
+	while (!pending.empty()) {
+		GLuint node = pending.back().first, begin = pending.back().second.first, end = pending.back().second.second;
+		pending.pop_back();
+
+		glm::vec3 boundsMin(1e30f), boundsMax(-1e30f), centerMin(1e30f), centerMax(-1e30f);
+		for (GLuint i = begin; i < end; i++) {
+			for (int corner = 0; corner < 3; corner++) {
+				boundsMin = glm::min(boundsMin, bvh.corners[order[i] * 3 + corner]);
+				boundsMax = glm::max(boundsMax, bvh.corners[order[i] * 3 + corner]);
+			}
+			centerMin = glm::min(centerMin, centers[order[i]]);
+			centerMax = glm::max(centerMax, centers[order[i]]);
+		}
+		bvh.nodes[node].boundsMin = boundsMin;
+		bvh.nodes[node].boundsMax = boundsMax;
+		if (end - begin <= BVH_LEAF_TRIANGLES) {
+			bvh.nodes[node].first = begin;
+			bvh.nodes[node].count = end - begin;
+			continue;
+		}
+
+		glm::vec3 extent = centerMax - centerMin;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		GLuint middle = (begin + end) / 2;
+		nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+			[&centers, axis](GLuint a, GLuint b) { return centers[a][axis] < centers[b][axis]; });
+
+		GLuint children = (GLuint)bvh.nodes.size();
+		bvh.nodes[node].first = children;
+		bvh.nodes[node].count = 0;
+		bvh.nodes.push_back(UBvhNode());
+		bvh.nodes.push_back(UBvhNode());
+		pending.push_back(make_pair(children, make_pair(begin, middle)));
+		pending.push_back(make_pair(children + 1, make_pair(middle, end)));
+	}
+
+	vector<glm::vec3> sorted(bvh.corners.size());
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int corner = 0; corner < 3; corner++) {
+			sorted[t * 3 + corner] = bvh.corners[order[t] * 3 + corner];
+		}
+	}
+	bvh.corners.swap(sorted);
+}
+
+// Whether anything lies on the ray within distance of its origin; stops at the first hit
+bool UOccluded(const UBvh& bvh, const glm::vec3& origin, const glm::vec3& direction, GLfloat distance) {
+	glm::vec3 inverse;
+	for (int k = 0; k < 3; k++) {
+		inverse[k] = 1.0f / (fabs(direction[k]) > 1e-8f ? direction[k] : 1e-8f); // Keeps the slab test free of NaNs
+	}
+
+	GLuint stack[64];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		const UBvhNode& node = bvh.nodes[stack[--depth]];
+		glm::vec3 toMin = (node.boundsMin - origin) * inverse, toMax = (node.boundsMax - origin) * inverse;
+		glm::vec3 entry = glm::min(toMin, toMax), exit = glm::max(toMin, toMax);
+		GLfloat enter = glm::max(glm::max(entry.x, entry.y), glm::max(entry.z, 0.0f));
+		GLfloat leave = glm::min(glm::min(exit.x, exit.y), glm::min(exit.z, distance));
+		if (enter > leave) {
+			continue;
+		}
+		if (node.count == 0) {
+			stack[depth++] = node.first;
+			stack[depth++] = node.first + 1;
+			continue;
+		}
+
+		// Moller-Trumbore against the leaf's triangles
+		for (GLuint t = node.first; t < node.first + node.count; t++) {
+			const glm::vec3& a = bvh.corners[t * 3];
+			glm::vec3 edge1 = bvh.corners[t * 3 + 1] - a, edge2 = bvh.corners[t * 3 + 2] - a;
+			glm::vec3 p = glm::cross(direction, edge2);
+			GLfloat determinant = glm::dot(edge1, p);
+			if (fabs(determinant) < 1e-12f) {
+				continue;
+			}
+			GLfloat inverseDeterminant = 1.0f / determinant;
+			glm::vec3 s = origin - a;
+			GLfloat u = glm::dot(s, p) * inverseDeterminant;
+			if (u < 0.0f || u > 1.0f) {
+				continue;
+			}
+			glm::vec3 q = glm::cross(s, edge1);
+			GLfloat v = glm::dot(direction, q) * inverseDeterminant;
+			if (v < 0.0f || u + v > 1.0f) {
+				continue;
+			}
+			GLfloat hit = glm::dot(edge2, q) * inverseDeterminant;
+			if (hit > 0.0f && hit < distance) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Culls one chunk of instances; a box is outside when it lies entirely behind any plane. The vector loops pick the level
+// of detail of their lanes the way USelectLevel does: the levels are ordered by error, so the coarsest one within a
+// threshold is the number of finer-than-coarsest levels that pass it. Runs on the worker threads
+void UCullChunk(int chunk) {
+	const UCullData& cull = cullData;
+	ULodData& lod = lodData;
+	GLuint* visible[LOD_LEVELS];
+	GLuint count[LOD_LEVELS];
+	GLfloat nearest[LOD_LEVELS];
+	for (int level = 0; level < LOD_LEVELS; level++) {
+		visible[level] = &cullData.chunkVisible[level][(size_t)chunk * CULL_CHUNK];
+		count[level] = 0;
+		nearest[level] = farPlane;
+	}
+	GLfloat depth;
+	int level;
+
+	size_t begin = (size_t)chunk * CULL_CHUNK;
+	size_t end = min(begin + CULL_CHUNK, cull.centerX.size());
+	size_t i = begin;
+
+#if defined(USE_SSE2) || defined(USE_AVX)
+	int levels = lod.impostorReady ? LOD_LEVELS : LOD_MESHES;
+	GLfloat depths[8];
+	int picked[8];
+#endif
+
+#if defined(USE_AVX)
+	// Eight boxes per step: distance of the center plus the box's projected radius must stay in front of every plane
+	for (; i + 8 <= end; i += 8) {
+		__m256 centerX = _mm256_loadu_ps(&cull.centerX[i]), centerY = _mm256_loadu_ps(&cull.centerY[i]), centerZ = _mm256_loadu_ps(&cull.centerZ[i]);
+		__m256 extentX = _mm256_loadu_ps(&cull.extentX[i]), extentY = _mm256_loadu_ps(&cull.extentY[i]), extentZ = _mm256_loadu_ps(&cull.extentZ[i]);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; p++) {
+			const glm::vec4& plane = cull.planes[p];
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(centerX, _mm256_set1_ps(plane.x)), _mm256_mul_ps(centerY, _mm256_set1_ps(plane.y))),
+				_mm256_add_ps(_mm256_mul_ps(centerZ, _mm256_set1_ps(plane.z)), _mm256_set1_ps(plane.w)));
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(extentX, _mm256_set1_ps(fabs(plane.x))), _mm256_mul_ps(extentY, _mm256_set1_ps(fabs(plane.y)))),
+				_mm256_mul_ps(extentZ, _mm256_set1_ps(fabs(plane.z))));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+		int mask = _mm256_movemask_ps(inside);
+		if (mask == 0) {
+			continue;
+		}
+
+		// View depth, and the level of detail from the error projected at that depth
+		__m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(cull.depthRow.x), centerX),
+			_mm256_mul_ps(_mm256_set1_ps(cull.depthRow.y), centerY)), _mm256_mul_ps(_mm256_set1_ps(cull.depthRow.z), centerZ)),
+			_mm256_set1_ps(cull.depthRow.w));
+		__m256 chosen = _mm256_setzero_ps();
+		if (lodEnabled) {
+			__m256 pixelsPerUnit = _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(cull.pixelScale), _mm256_loadu_ps(&cull.scale[i])),
+				_mm256_max_ps(w, _mm256_set1_ps(nearPlane)));
+			__m256 refine = _mm256_setzero_ps(), coarsen = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+			for (int next = 1; next < levels; next++) {
+				__m256 error = _mm256_mul_ps(_mm256_set1_ps(lod.switchError[next]), pixelsPerUnit);
+				refine = _mm256_add_ps(refine, _mm256_and_ps(_mm256_cmp_ps(error, _mm256_set1_ps(lodThreshold), _CMP_LE_OQ), one));
+				coarsen = _mm256_add_ps(coarsen, _mm256_and_ps(_mm256_cmp_ps(error, _mm256_set1_ps(lodThreshold * LOD_HYSTERESIS), _CMP_LE_OQ), one));
+			}
+
+			// Refine at once, but only coarsen as far as the stricter threshold allows
+			__m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&lod.instanceLevel[i]), _mm_setzero_si128());
+			__m256 current = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, _mm_setzero_si128()))),
+				_mm_cvtepi32_ps(_mm_unpackhi_epi16(bytes, _mm_setzero_si128())), 1);
+			current = _mm256_min_ps(current, _mm256_set1_ps((GLfloat)(levels - 1)));
+			chosen = _mm256_blendv_ps(refine, _mm256_max_ps(current, coarsen), _mm256_cmp_ps(refine, current, _CMP_GT_OQ));
+		}
+		_mm256_storeu_ps(depths, w);
+		_mm256_storeu_si256((__m256i*)picked, _mm256_cvttps_epi32(chosen));
+
+		for (int lane = 0; lane < 8; lane++) {
+			if (mask & (1 << lane)) {
+				level = picked[lane];
+				if (lodEnabled) {
+					lod.instanceLevel[i + lane] = (unsigned char)level;
+				}
+				visible[level][count[level]++] = (GLuint)(i + lane);
+				nearest[level] = min(nearest[level], depths[lane]);
+			}
+		}
+	}
+#elif defined(USE_SSE2)
+	// Four boxes per step: distance of the center plus the box's projected radius must stay in front of every plane
+	for (; i + 4 <= end; i += 4) {
+		__m128 centerX = _mm_loadu_ps(&cull.centerX[i]), centerY = _mm_loadu_ps(&cull.centerY[i]), centerZ = _mm_loadu_ps(&cull.centerZ[i]);
+		__m128 extentX = _mm_loadu_ps(&cull.extentX[i]), extentY = _mm_loadu_ps(&cull.extentY[i]), extentZ = _mm_loadu_ps(&cull.extentZ[i]);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; p++) {
+			const glm::vec4& plane = cull.planes[p];
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(plane.x)), _mm_mul_ps(centerY, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(centerZ, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(extentX, _mm_set1_ps(fabs(plane.x))), _mm_mul_ps(extentY, _mm_set1_ps(fabs(plane.y)))),
+				_mm_mul_ps(extentZ, _mm_set1_ps(fabs(plane.z))));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(inside);
+		if (mask == 0) {
+			continue;
+		}
+
+		// View depth, and the level of detail from the error projected at that depth
+		__m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(cull.depthRow.x), centerX),
+			_mm_mul_ps(_mm_set1_ps(cull.depthRow.y), centerY)), _mm_mul_ps(_mm_set1_ps(cull.depthRow.z), centerZ)),
+			_mm_set1_ps(cull.depthRow.w));
+		__m128 chosen = _mm_setzero_ps();
+		if (lodEnabled) {
+			__m128 pixelsPerUnit = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(cull.pixelScale), _mm_loadu_ps(&cull.scale[i])),
+				_mm_max_ps(w, _mm_set1_ps(nearPlane)));
+			__m128 refine = _mm_setzero_ps(), coarsen = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+			for (int next = 1; next < levels; next++) {
+				__m128 error = _mm_mul_ps(_mm_set1_ps(lod.switchError[next]), pixelsPerUnit);
+				refine = _mm_add_ps(refine, _mm_and_ps(_mm_cmple_ps(error, _mm_set1_ps(lodThreshold)), one));
+				coarsen = _mm_add_ps(coarsen, _mm_and_ps(_mm_cmple_ps(error, _mm_set1_ps(lodThreshold * LOD_HYSTERESIS)), one));
+			}
+
+			// Refine at once, but only coarsen as far as the stricter threshold allows
+			int packed;
+			memcpy(&packed, &lod.instanceLevel[i], sizeof(packed));
+			__m128i bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), _mm_setzero_si128());
+			__m128 current = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bytes, _mm_setzero_si128()));
+			current = _mm_min_ps(current, _mm_set1_ps((GLfloat)(levels - 1)));
+			__m128 coarser = _mm_cmpgt_ps(refine, current);
+			chosen = _mm_or_ps(_mm_and_ps(coarser, _mm_max_ps(current, coarsen)), _mm_andnot_ps(coarser, refine));
+		}
+		_mm_storeu_ps(depths, w);
+		_mm_storeu_si128((__m128i*)picked, _mm_cvttps_epi32(chosen));
+
+		for (int lane = 0; lane < 4; lane++) {
+			if (mask & (1 << lane)) {
+				level = picked[lane];
+				if (lodEnabled) {
+					lod.instanceLevel[i + lane] = (unsigned char)level;
+				}
+				visible[level][count[level]++] = (GLuint)(i + lane);
+				nearest[level] = min(nearest[level], depths[lane]);
+			}
+		}
+	}
+#endif
+
+	// Whatever the vector loop left over, one box at a time
+	for (; i < end; i++) {
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++) {
+			const glm::vec4& plane = cull.planes[p];
+			GLfloat distance = plane.x * cull.centerX[i] + plane.y * cull.centerY[i] + plane.z * cull.centerZ[i] + plane.w;
+			GLfloat radius = fabs(plane.x) * cull.extentX[i] + fabs(plane.y) * cull.extentY[i] + fabs(plane.z) * cull.extentZ[i];
+			inside = distance + radius >= 0.0f;
+		}
+		if (inside) {
+			level = USelectLevel(i, depth);
+			visible[level][count[level]++] = (GLuint)i;
+			nearest[level] = min(nearest[level], depth);
+		}
+	}
+
+	for (level = 0; level < LOD_LEVELS; level++) {
+		cullData.chunkCount[level][chunk] = count[level];
+		cullData.chunkNearest[level][chunk] = nearest[level];
+	}
+}
+
+// Returns the matrix that takes normals to world space, skipping the inverse when the transform only scales uniformly
+glm::mat3 UNormalMatrix(const glm::mat4& model) {
+	glm::mat3 linear(model);
+
+	// Rotation times uniform scale s: the inverse transpose is the same matrix divided by s squared
+	GLfloat scaleSquared = glm::dot(linear[0], linear[0]);
+	GLfloat tolerance = 1e-4f * scaleSquared;
+	if (fabs(glm::dot(linear[1], linear[1]) - scaleSquared) < tolerance &&
+		fabs(glm::dot(linear[2], linear[2]) - scaleSquared) < tolerance &&
+		fabs(glm::dot(linear[0], linear[1])) < tolerance &&
+		fabs(glm::dot(linear[0], linear[2])) < tolerance &&
+		fabs(glm::dot(linear[1], linear[2])) < tolerance) {
+		return linear * (1.0f / scaleSquared);
+	}
+
+	return glm::transpose(glm::inverse(linear));
+}
+
+// Welds bit-identical vertices of a flat triangle list into an indexed mesh, then reorders it for the GPU caches
+void UBuildIndexedMesh(const GLfloat* vertices, int vertexCount, int floatsPerVertex, UMesh& mesh) {
+	mesh.floatsPerVertex = floatsPerVertex;
+	mesh.vertices.clear();
+	mesh.indices.clear();
+	mesh.indices.reserve(vertexCount);
+
+	// Hash every vertex's bytes; equal hashes are confirmed with a full compare
+	unordered_multimap<size_t, GLuint> lookup;
+	size_t vertexBytes = floatsPerVertex * sizeof(GLfloat);
+
+	for (int i = 0; i < vertexCount; i++) {
+		const GLfloat* vertex = vertices + i * floatsPerVertex;
+
+		size_t hash = 2166136261u; // FNV-1a
+		const unsigned char* bytes = (const unsigned char*)vertex;
+		for (size_t b = 0; b < vertexBytes; b++) {
+			hash = (hash ^ bytes[b]) * 16777619u;
+		}
+
+		GLuint index = (GLuint)-1;
+		pair<unordered_multimap<size_t, GLuint>::iterator, unordered_multimap<size_t, GLuint>::iterator> range = lookup.equal_range(hash);
+		for (unordered_multimap<size_t, GLuint>::iterator it = range.first; it != range.second; ++it) {
+			if (memcmp(&mesh.vertices[it->second * floatsPerVertex], vertex, vertexBytes) == 0) {
+				index = it->second;
+				break;
+			}
+		}
+
+		// First time this vertex is seen
+		if (index == (GLuint)-1) {
+			index = (GLuint)(mesh.vertices.size() / floatsPerVertex);
+			mesh.vertices.insert(mesh.vertices.end(), vertex, vertex + floatsPerVertex);
+			lookup.insert(make_pair(hash, index));
+		}
+		mesh.indices.push_back(index);
+	}
+
+	UOptimizeVertexCache(mesh);
+	UOptimizeVertexFetch(mesh);
+}
+
+// Reorders triangles so recently transformed vertices are reused (Forsyth's linear-speed algorithm)
+void UOptimizeVertexCache(UMesh& mesh) {
+	const int cacheSize = 32; // Simulated post-transform cache entries
+	size_t triangleCount = mesh.indices.size() / 3;
+	size_t vertexCount = mesh.vertices.size() / mesh.floatsPerVertex;
+	if (triangleCount == 0) {
+		return;
+	}
+
+	// Triangles that use each vertex, as offsets into one shared list
+	vector<int> remaining(vertexCount, 0), adjacencyStart(vertexCount + 1, 0);
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		remaining[mesh.indices[i]]++;
+	}
+	for (size_t v = 0; v < vertexCount; v++) {
+		adjacencyStart[v + 1] = adjacencyStart[v] + remaining[v];
+	}
+	vector<int> adjacency(mesh.indices.size()), fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		adjacency[fill[mesh.indices[i]]++] = (int)(i / 3);
+	}
+
+	// Vertex score favours vertices in the cache and vertices with few triangles left
+	vector<float> vertexScore(vertexCount), triangleScore(triangleCount, 0.0f);
+	vector<bool> emitted(triangleCount, false);
+
+	struct Score {
+		static float Vertex(int position, int valence) {
+			if (valence == 0) {
+				return -1.0f; // Nothing left to draw with this vertex
+			}
+			float score = 0.0f;
+			if (position >= 0) {
+				// The last triangle's vertices get a fixed score so its neighbours are not favoured too strongly
+				score = position < 3 ? 0.75f : pow(1.0f - (position - 3) / (float)(cacheSize - 3), 1.5f);
+			}
+			return score + 2.0f * pow((float)valence, -0.5f);
+		}
+	};
+
+	for (size_t v = 0; v < vertexCount; v++) {
+		vertexScore[v] = Score::Vertex(-1, remaining[v]);
+	}
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (int k = 0; k < 3; k++) {
+			triangleScore[t] += vertexScore[mesh.indices[t * 3 + k]];
+		}
+	}
+
+	vector<GLuint> optimized;
+	optimized.reserve(mesh.indices.size());
+	vector<GLuint> cache, nextCache;
+	size_t scanFrom = 0;
+
+	while (optimized.size() < mesh.indices.size()) {
+		// Best triangle touching the cache, or the best remaining one when the cache has nothing to offer
+		int best = -1;
+		float bestScore = -1.0f;
+		for (size_t c = 0; c < cache.size(); c++) {
+			GLuint v = cache[c];
+			for (int a = adjacencyStart[v]; a < adjacencyStart[v + 1]; a++) {
+				int t = adjacency[a];
+				if (!emitted[t] && triangleScore[t] > bestScore) {
+					best = t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+		if (best == -1) {
+			while (emitted[scanFrom]) {
+				scanFrom++;
+			}
+			for (size_t t = scanFrom; t < triangleCount; t++) {
+				if (!emitted[t] && triangleScore[t] > bestScore) {
+					best = (int)t;
+					bestScore = triangleScore[t];
+				}
+			}
+		}
+
+		// Emit it and drop it from its vertices' adjacency
+		emitted[best] = true;
+		nextCache.clear();
+		for (int k = 0; k < 3; k++) {
+			GLuint v = mesh.indices[best * 3 + k];
+			optimized.push_back(v);
+			nextCache.push_back(v);
+
+			for (int a = adjacencyStart[v]; a < adjacencyStart[v] + remaining[v]; a++) {
+				if (adjacency[a] == best) {
+					adjacency[a] = adjacency[adjacencyStart[v] + remaining[v] - 1];
+					break;
+				}
+			}
+			remaining[v]--;
+		}
+
+		// Move the triangle's vertices to the front of the simulated LRU cache
+		for (size_t c = 0; c < cache.size(); c++) {
+			GLuint v = cache[c];
+			if (v != nextCache[0] && v != nextCache[1] && v != nextCache[2]) {
+				nextCache.push_back(v);
+			}
+		}
+
+		// Rescore every vertex whose cache position changed, including evicted ones, and the triangles still using them
+		for (size_t c = 0; c < nextCache.size(); c++) {
+			GLuint v = nextCache[c];
+			int position = c < (size_t)cacheSize ? (int)c : -1;
+			float score = Score::Vertex(position, remaining[v]);
+			float delta = score - vertexScore[v];
+			vertexScore[v] = score;
+			for (int a = adjacencyStart[v]; a < adjacencyStart[v] + remaining[v]; a++) {
+				triangleScore[adjacency[a]] += delta;
+			}
+		}
+
+		if (nextCache.size() > (size_t)cacheSize) {
+			nextCache.resize(cacheSize);
+		}
+		cache.swap(nextCache);
+	}
+
+	mesh.indices.swap(optimized);
+}
+
+// Renumbers vertices in the order the index buffer first references them so vertex fetches stream linearly
+void UOptimizeVertexFetch(UMesh& mesh) {
+	int floats = mesh.floatsPerVertex;
+	vector<GLuint> remap(mesh.vertices.size() / floats, (GLuint)-1);
+	vector<GLfloat> reordered;
+	reordered.reserve(mesh.vertices.size());
+
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		GLuint& index = mesh.indices[i];
+		if (remap[index] == (GLuint)-1) {
+			remap[index] = (GLuint)(reordered.size() / floats);
+			reordered.insert(reordered.end(), mesh.vertices.begin() + index * floats, mesh.vertices.begin() + (index + 1) * floats);
+		}
+		index = remap[index];
+	}
+
+	mesh.vertices.swap(reordered); // Unreferenced vertices are dropped
+}
+
+// GLUT input callbacks only record the event for the simulation thread and ask for a frame that will pick it up
+void UMouseMove(int x, int y) {
+	UInputEvent event = { INPUT_MOVE, 0, 0, 0, x, y, chrono::high_resolution_clock::now() };
+	UQueueInput(event);
+}
+
+void UOnMotion(int x, int y) {
+	UInputEvent event = { INPUT_DRAG, 0, 0, 0, x, y, chrono::high_resolution_clock::now() };
+	UQueueInput(event);
+}
+
+void UMouseClick(int button, int state, int x, int y) {
+	UInputEvent event = { INPUT_CLICK, button, state, glutGetModifiers(), x, y, chrono::high_resolution_clock::now() };
+	UQueueInput(event);
+}
+
+void UQueueInput(const UInputEvent& event) {
+	{
+		lock_guard<mutex> guard(simulation.lock);
+		simulation.events.push_back(event);
+	}
+	simulation.wake.notify_one();
+	simulation.submitted++;
+	inputPoll = true;
+	UScheduleFrame();
+}
+
+// Publishes the initial snapshot and starts the simulation thread; the benchmark publishes its own snapshots instead
+void UStartSimulation() {
+	USimulation& sim = simulation;
+	sim.quit = false;
+	sim.submitted = 0;
+	sim.applied = 0;
+	sim.revision = 0;
+	sim.changed = false;
+	sim.inputRevision = 0;
+	sim.acquiredRevision = 0;
+	sim.renderedRevision = 0;
+	sim.snapshots.front = 0;
+	sim.snapshots.middle = 1;
+	sim.snapshots.back = 2;
+	UPublishSnapshot();
+	UAcquireSnapshot();
+
+	if (!benchmarkMode) {
+		sim.worker = thread(USimulationLoop);
+	}
+}
+
+void UStopSimulation() {
+	{
+		lock_guard<mutex> guard(simulation.lock);
+		simulation.quit = true;
+	}
+	simulation.wake.notify_one();
+	if (simulation.worker.joinable()) {
+		simulation.worker.join();
+	}
+}
+
+// Body of the simulation thread: applies every queued event, then publishes one snapshot for the batch
+void USimulationLoop() {
+	USimulation& sim = simulation;
+	deque<UInputEvent> batch;
+	for (;;) {
+		{
+			unique_lock<mutex> guard(sim.lock);
+			while (!sim.quit && sim.events.empty()) {
+				sim.wake.wait(guard);
+			}
+			if (sim.quit) {
+				return;
+			}
+			batch.swap(sim.events);
+		}
+
+		sim.changed = false;
+		for (size_t i = 0; i < batch.size(); i++) {
+			const UInputEvent& event = batch[i];
+			if (event.type == INPUT_CLICK) {
+				USimulateClick(event.button, event.state, event.modifiers);
+			}
+			else if (event.type == INPUT_DRAG) {
+				USimulateMotion(event.x, event.y);
+			}
+			else {
+				USimulateMove();
+			}
+		}
+		sim.applied += (unsigned)batch.size();
+		if (sim.changed) {
+			sim.revision++;
+
+			// Latency is measured from the oldest change the renderer has not picked up yet
+			if (sim.acquiredRevision.load(memory_order_acquire) >= sim.inputRevision) {
+				sim.inputRevision = sim.revision;
+				sim.inputTime = batch.front().time;
+			}
+		}
+		batch.clear();
+		UPublishSnapshot();
+	}
+}
+
+// Builds the frame transforms from the camera state into the back slot and makes it the newest snapshot
+void UPublishSnapshot() {
+	USnapshotBuffer& buffer = simulation.snapshots;
+	USceneSnapshot& snapshot = buffer.slots[buffer.back];
+
+	CameraForwardZ = front; // Replaces camera forward vector with radians normalized as a unit vector
+
+	// Transforms the object
+	glm::mat4 model;
+	model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // Place object at the center of the viewport
+	model = glm::rotate(model, 45.0f, glm::vec3(0.0f, 1.0f, 0.0f)); // Rotate the object 45 degrees on the x
+	model = glm::scale(model, glm::vec3(scale_by_x, scale_by_y, scale_by_z)); // Increase the object size by a scale of 2
+	snapshot.model = model;
+
+	// Transforms the camera
+	snapshot.view = glm::lookAt(CameraForwardZ, cameraPosition, CameraUpY);
+
+	snapshot.perspective = perspective;
+	snapshot.revision = simulation.revision;
+	snapshot.inputSequence = simulation.applied;
+	snapshot.inputRevision = simulation.inputRevision;
+	snapshot.inputTime = simulation.inputTime;
+
+	// Release makes the slot contents visible to the renderer; acquire gets back the slot it let go of
+	buffer.back = buffer.middle.exchange(buffer.back | SNAPSHOT_FRESH, memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+}
+
+// Takes the newest published snapshot if there is one; returns whether the front slot changed
+bool UAcquireSnapshot() {
+	USnapshotBuffer& buffer = simulation.snapshots;
+	if ((buffer.middle.load(memory_order_relaxed) & SNAPSHOT_FRESH) == 0) {
+		return false;
+	}
+	buffer.front = buffer.middle.exchange(buffer.front, memory_order_acq_rel) & ~SNAPSHOT_FRESH;
+	simulation.acquiredRevision.store(UCurrentSnapshot().revision, memory_order_release);
+	return true;
+}
+
+// Snapshot the renderer is drawing
+const USceneSnapshot& UCurrentSnapshot() {
+	return simulation.snapshots.slots[simulation.snapshots.front];
+}
+
+// Applies a passive mouse move recorded by UMouseMove; where the cursor is does not matter, only that it moved
+void USimulateMove() {
+
+	glm::vec3 previousFront = front;
+	UUpdateCameraFront();
+
+	// Only the first passive move actually changes the camera
+	if (front != previousFront) {
+		simulation.changed = true;
+	}
+
+}
+
+// Rebuilds the orbiting camera position from yaw and pitch
+void UUpdateCameraFront() {
+	front.x = 10.0f * cos(yaw);
+	front.y = 10.0f * sin(pitch);
+	front.z = sin(yaw) * cos(pitch) * 10.0f;
+}
+
+void USimulateMotion(int x, int y) {
+
+	// Boolean to check for alt and mouse button hold
+	if (checkMotion) {
 
 		// Get mouse direction
 		mouseXOffset = x - lastMouseX;
@@ -699,9 +5993,9 @@ void UOnMotion(int x, int y) {
 			pitch += mouseYOffset;
 		}
 
-		front.x = 10.0f * cos(yaw);
-		front.y = 10.0f * sin(pitch);
-		front.z = sin(yaw) * cos(pitch) * 10.0f;
+		UUpdateCameraFront();
+
+		simulation.changed = true;
 
 	}
 
@@ -717,7 +6011,7 @@ void UOnMotion(int x, int y) {
 			scale_by_z += 0.1f;
 
 			//Redisplay
-			glutPostRedisplay();
+			simulation.changed = true;
 
 		}
 		else {
@@ -737,7 +6031,7 @@ void UOnMotion(int x, int y) {
 			}
 
 			// Redisplay
-			glutPostRedisplay();
+			simulation.changed = true;
 
 		}
 
@@ -749,11 +6043,11 @@ void UOnMotion(int x, int y) {
 
 }
 
-// Implements the UMouseClick function
-void UMouseClick(int button, int state, int x, int y) {
+// Applies a mouse click recorded by UMouseClick
+void USimulateClick(int button, int state, int modifiers) {
 
 	// Check for alt press
-	mod = glutGetModifiers();
+	mod = modifiers;
 
 	// Set variable to false
 	checkMotion = false;
@@ -777,6 +6071,8 @@ void UMouseClick(int button, int state, int x, int y) {
 
 	}
 
+	bool previousPerspective = perspective;
+
 	if (mod == GLUT_ACTIVE_CTRL) {
 		perspective = true;
 	}
@@ -784,21 +6080,245 @@ void UMouseClick(int button, int state, int x, int y) {
 		perspective = false;
 	}
 
+	// Redraw only when the projection actually switched
+	if (perspective != previousPerspective) {
+		simulation.changed = true;
+	}
+
 }
 
 //Generate and load the texture
+// Starts the texture streaming service and requests the chair texture; returns before anything is decoded
 void UGenerateTexture(){
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+	UTextureStream& stream = textureStream;
+	stream.nextSlot = 0;
+	stream.pending = 0;
+	stream.quit = false;
+
+	// A single grey texel stands in for every texture until it is resident
+	const unsigned char grey[4] = { 128, 128, 128, 255 };
+	glGenTextures(1, &stream.placeholder);
+	glBindTexture(GL_TEXTURE_2D, stream.placeholder);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0); //Unbind the texture
 
-	int width, height;
+	for (int i = 0; i < STREAM_RING_SIZE; i++) {
+		glGenBuffers(1, &stream.slots[i].buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream.slots[i].buffer);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, STREAM_SLOT_BYTES, NULL, GL_STREAM_DRAW);
+		stream.slots[i].fence = 0;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-	unsigned char* image = SOIL_load_image("alder.jpg", &width, &height, 0, SOIL_LOAD_RGB);//loads texture file
+	for (int i = 0; i < decodeThreadCount; i++) {
+		stream.decoders.push_back(thread(UDecodeLoop));
+	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	SOIL_free_image_data(image);
-	glBindTexture(GL_TEXTURE_2D, 0); //Unbind the texture
+	chairTexture = UStreamTexture("alder.jpg");
+}
+
+// Queues an image file for decoding and returns its handle; the placeholder is used until it is resident
+int UStreamTexture(const string& fileName) {
+	UTextureStream& stream = textureStream;
+	UStreamedTexture texture;
+	texture.fileName = fileName;
+	texture.texture = 0;
+	texture.pixels = NULL;
+	texture.width = texture.height = 0;
+	texture.uploadedRows = 0;
+	texture.resident = false;
+	stream.pending++;
+
+	UDecodedImage request;
+	request.pixels = NULL;
+	request.width = request.height = 0;
+	{
+		lock_guard<mutex> guard(stream.lock); // The decode threads read file names from the vector
+		stream.textures.push_back(texture);
+		request.handle = (int)stream.textures.size() - 1;
+		stream.decodeQueue.push_back(request);
+	}
+	stream.wake.notify_one();
+	return request.handle;
+}
+
+// Body of a decode thread: takes requests until shutdown and hands the pixels back to the main thread
+void UDecodeLoop() {
+	UTextureStream& stream = textureStream;
+	for (;;) {
+		unique_lock<mutex> guard(stream.lock);
+		while (!stream.quit && stream.decodeQueue.empty()) {
+			stream.wake.wait(guard);
+		}
+		if (stream.quit) {
+			return;
+		}
+		UDecodedImage image = stream.decodeQueue.front();
+		stream.decodeQueue.pop_front();
+		string fileName = stream.textures[image.handle].fileName; // Copied under the lock; the vector only grows under it
+		guard.unlock();
+
+		// RGBA rows are always 4-byte aligned, which suits pixel buffer uploads
+		image.pixels = SOIL_load_image(fileName.c_str(), &image.width, &image.height, 0, SOIL_LOAD_RGBA);
+
+		guard.lock();
+		stream.decoded.push_back(image);
+	}
+}
+
+// Retires finished uploads and uploads decoded rows up to budget bytes; returns true when a texture became resident
+bool UPumpTextureStreaming(size_t budget) {
+	UTextureStream& stream = textureStream;
+	if (stream.pending == 0) {
+		return false;
+	}
+	bool changed = false;
+
+	// Free the ring slots the GPU has finished reading
+	for (int i = 0; i < STREAM_RING_SIZE; i++) {
+		UStreamSlot& slot = stream.slots[i];
+		if (slot.fence == 0) {
+			continue;
+		}
+		GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+			glDeleteSync(slot.fence);
+			slot.fence = 0;
+			if (slot.lastChunk) {
+				stream.textures[slot.handle].resident = true;
+				stream.pending--;
+				changed = true;
+			}
+		}
+	}
+
+	// Pick up the images the decode threads have finished
+	deque<UDecodedImage> decoded;
+	{
+		lock_guard<mutex> guard(stream.lock);
+		decoded.swap(stream.decoded);
+	}
+	for (size_t i = 0; i < decoded.size(); i++) {
+		UStreamedTexture& texture = stream.textures[decoded[i].handle];
+		if (decoded[i].pixels == NULL) {
+			cout << "Failed to load texture " << texture.fileName << endl;
+			stream.pending--; // Keeps the placeholder for good
+			continue;
+		}
+		texture.pixels = decoded[i].pixels;
+		texture.width = decoded[i].width;
+		texture.height = decoded[i].height;
+		stream.uploadQueue.push_back(decoded[i].handle);
+	}
+
+	// Copy rows into free ring slots until the budget is spent; every call makes progress by at least one row
+	bool first = true;
+	while (!stream.uploadQueue.empty()) {
+		UStreamSlot& slot = stream.slots[stream.nextSlot];
+		if (slot.fence != 0) {
+			break; // Every pixel buffer is still in flight
+		}
+		UStreamedTexture& texture = stream.textures[stream.uploadQueue.front()];
+		size_t rowBytes = texture.width * 4;
+		int rows = min(texture.height - texture.uploadedRows, (int)(min((size_t)STREAM_SLOT_BYTES, budget) / rowBytes));
+		if (rows == 0) {
+			if (!first) {
+				break; // The rest of the budget is less than a row
+			}
+			rows = 1;
+		}
+		size_t bytes = rows * rowBytes;
+		budget -= min(budget, bytes);
+		first = false;
+
+		if (texture.uploadedRows == 0) {
+			glGenTextures(1, &texture.texture);
+			glBindTexture(GL_TEXTURE_2D, texture.texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, texture.width, texture.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		}
+		else {
+			glBindTexture(GL_TEXTURE_2D, texture.texture);
+		}
+
+		// The slot's fence has signaled, so the buffer can be written without the driver synchronizing
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+		void* destination = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		if (destination) {
+			memcpy(destination, texture.pixels + texture.uploadedRows * rowBytes, bytes);
+		}
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, texture.uploadedRows, texture.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)0);
+		texture.uploadedRows += rows;
+
+		slot.handle = stream.uploadQueue.front();
+		slot.lastChunk = texture.uploadedRows == texture.height;
+		if (slot.lastChunk) {
+			glGenerateMipmap(GL_TEXTURE_2D);
+			SOIL_free_image_data(texture.pixels);
+			texture.pixels = NULL;
+			stream.uploadQueue.pop_front();
+		}
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		stream.nextSlot = (stream.nextSlot + 1) % STREAM_RING_SIZE;
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, 0); //Unbind the texture
+	}
+	return changed;
+}
+
+// Blocks until every requested texture is resident or has failed
+void UFinishTextureStreaming() {
+	while (textureStream.pending > 0) {
+		UPumpTextureStreaming(STREAM_SLOT_BYTES * STREAM_RING_SIZE);
+		if (textureStream.pending > 0) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	}
+}
+
+// Stops the decode threads and frees any pixels still waiting; the GL objects go with UDeleteStreamedTextures
+void UStopTextureStreaming() {
+	UTextureStream& stream = textureStream;
+	{
+		lock_guard<mutex> guard(stream.lock);
+		stream.quit = true;
+	}
+	stream.wake.notify_all();
+	for (size_t i = 0; i < stream.decoders.size(); i++) {
+		stream.decoders[i].join();
+	}
+	stream.decoders.clear();
+
+	for (size_t i = 0; i < stream.decoded.size(); i++) {
+		SOIL_free_image_data(stream.decoded[i].pixels);
+	}
+	for (size_t i = 0; i < stream.textures.size(); i++) {
+		SOIL_free_image_data(stream.textures[i].pixels);
+	}
+}
+
+// Releases the textures, pixel buffers and fences of the streaming service; the decode threads do not touch them
+void UDeleteStreamedTextures() {
+	UTextureStream& stream = textureStream;
+	for (size_t i = 0; i < stream.textures.size(); i++) {
+		glDeleteTextures(1, &stream.textures[i].texture);
+	}
+	for (int i = 0; i < STREAM_RING_SIZE; i++) {
+		if (stream.slots[i].fence != 0) {
+			glDeleteSync(stream.slots[i].fence);
+		}
+		glDeleteBuffers(1, &stream.slots[i].buffer);
+	}
+	glDeleteTextures(1, &stream.placeholder);
+}
+
+// Texture to bind for a handle: the real one once resident, the placeholder before that
+GLuint UResidentTexture(int handle) {
+	const UStreamedTexture& texture = textureStream.textures[handle];
+	return texture.resident ? texture.texture : textureStream.placeholder;
 }
 
 